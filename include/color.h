@@ -0,0 +1,21 @@
+// color.h
+// Color conversions for lights.
+//
+// HSI to RGB is the conversion the lights have always used: hue in
+// degrees, saturation from 0 to 1, giving red, green and blue which
+// sum to 1, intensity being left to the caller.  Within each third of
+// the wheel the hue only comes in as cos(h)/cos(60-h), which is
+// 1/2 - (sqrt 3)/2 tan(h - 60); that's worked out from short sin and
+// cos polynomials with no branches or table lookups, so the batch
+// version vectorizes.  It's within 1e-6 of the trig (see colorbench).
+
+#ifndef _squidlights_color_h
+#define _squidlights_color_h
+
+// one color.  Any hue works, negative or past 360.
+void sq_hsi_to_rgb(float h, float s, float * r, float * g, float * b);
+// n of them, from h[i] and s[i] into r[i], g[i] and b[i]
+void sq_hsi_to_rgb_n(int n, const float * h, const float * s,
+		     float * r, float * g, float * b);
+
+#endif
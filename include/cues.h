@@ -0,0 +1,151 @@
+// cues.h
+// Shows as cue tables.  A cue file is text, one cue to a line:
+//
+//   # track  time       target        action
+//   1        0:18       rig-color-3   hsi 120 1 1
+//   1        0:30.5     rig-fade-*    effect chase 500 1
+//   2        1:02.250   rig-fade-0    fade 0 2000
+//
+// where time is seconds into the track, as [[h:]m:]s[.fraction], and
+// the action is one of
+//
+//   on | off | brightness (v) | rgb (r) (g) (b) | hsi (h) (s) (i)
+//   fade (v) (ms) | fadergb (r) (g) (b) (ms) | fadehsi (h) (s) (i) (ms)
+//   effect chase|wheel|strobe|stop (period ms) (level) [(param)]
+//   recall [(fade ms)]
+//
+// The target is a light's name, for an effect an fnmatch(3) pattern,
+// and for recall a scene the router keeps (see scenes.h).  Everything after a # is a comment.
+//
+// Compiling a cue file makes each cue into the message it sends and
+// sorts them by track then time (cues at the same time keep their
+// order in the file), so a player walks a track's cues with a cursor
+// and firing them is a comparison and a send each.
+//
+// To start part way through a track, a player has to set the lights as
+// the cues before that point would have left them.  So every few
+// seconds of each track there's a keyframe: the cues whose effect
+// still stands there (the last of each kind for each light, the
+// effects still running and the scenes recalled, in order).  The state
+// at any time is then the nearest keyframe before it, plus the few
+// cues between the two.
+//
+// The compiled table is a header, the tracks, the cues, the keyframes
+// and then the keyframes' cues, as below, and is loaded back whole.
+
+#ifndef _squidlights_cues_h
+#define _squidlights_cues_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SQ_CUES_MAGIC "sqcuetab"
+#define SQ_CUES_VERSION 2
+#define SQ_CUE_MSG_SIZE 64  // room for any client light message
+#define SQ_CUES_KEY_MS 10000  // between keyframes, unless told otherwise
+
+struct sq_cue_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t ntracks;
+  uint32_t ncues;
+  uint32_t nkeys;
+  uint32_t nkeycues;
+  uint32_t key_ms;  // between keyframes
+};
+
+struct sq_cue_track {
+  uint32_t track;
+  uint32_t first;     // its first cue
+  uint32_t n;         // and how many it has
+  uint32_t firstkey;  // its first keyframe, which is at 0
+  uint32_t nkeys;
+  uint32_t reserved;
+  uint64_t last;      // ns into the track of its last cue
+};
+
+// the state of the lights at t into a track
+struct sq_cue_key {
+  uint64_t t;
+  uint32_t next;      // the track's first cue at or after t
+  uint32_t first;     // the cues standing at t, in the order they came,
+  uint32_t n;         // in the table's keycues
+  uint32_t reserved;
+};
+
+struct sq_cue {
+  uint64_t t;       // ns into its track
+  uint32_t track;
+  uint32_t line;    // in the cue file
+  uint32_t len;     // of msg
+  uint32_t reserved;
+  char msg[SQ_CUE_MSG_SIZE];  // for sqlights_client_send()
+};
+
+struct sq_cue_table {
+  struct sq_cue_header header;
+  struct sq_cue_track * tracks;  // by track number
+  struct sq_cue * cues;          // by track, then time
+  struct sq_cue_key * keys;      // by track, then time
+  uint32_t * keycues;            // indexes of cues
+};
+
+// compiles the cue file fp, called path in messages, with keyframes
+// every key_ms (0 for SQ_CUES_KEY_MS).  Returns 0, or -1 having printed every line that's
+// wrong.
+int sq_cues_parse(FILE * fp, const char * path, uint32_t key_ms,
+		  struct sq_cue_table * table);
+// writes a compiled table, or reads one back.  Return 0, or -1 if the
+// file can't be written, or doesn't hold a table.
+int sq_cues_write(const char * path, const struct sq_cue_table * table);
+int sq_cues_load(const char * path, struct sq_cue_table * table);
+void sq_cues_free(struct sq_cue_table * table);
+
+// a track, or NULL if the table has no cues for it
+const struct sq_cue_track * sq_cues_track(const struct sq_cue_table * table,
+					  uint32_t track);
+
+// a cue as it would be written in a cue file, into buf
+void sq_cue_format(const struct sq_cue * cue, char * buf, size_t size);
+
+// where a player is in a track
+struct sq_cue_cursor {
+  const struct sq_cue * cues;
+  uint32_t next;  // the next cue to fire
+  uint32_t end;   // one past the track's last
+};
+
+// points cursor at the first cue of track at or after t.  Returns 0,
+// or -1 if the table has no such track.
+int sq_cue_seek(struct sq_cue_cursor * cursor,
+		const struct sq_cue_table * table, uint32_t track, uint64_t t);
+// the next cue due by t, moving the cursor past it, or NULL if there
+// isn't one yet
+const struct sq_cue * sq_cue_due(struct sq_cue_cursor * cursor, uint64_t t);
+// when the next cue is due, or UINT64_MAX if the track's over
+uint64_t sq_cue_next_time(const struct sq_cue_cursor * cursor);
+
+// the cues standing at some point, as indexes into a table's cues
+struct sq_cue_state {
+  uint32_t * cues;
+  uint32_t n, size;
+};
+
+void sq_cue_state_init(struct sq_cue_state * state);
+void sq_cue_state_free(struct sq_cue_state * state);
+// adds the cue at index i of table, dropping those it overrides
+void sq_cue_state_apply(struct sq_cue_state * state,
+			const struct sq_cue_table * table, uint32_t i);
+// makes state the cues standing just before t into track, from the
+// keyframe before it.  Returns 0, or -1 if the table has no such track.
+int sq_cue_state_at(struct sq_cue_state * state,
+		    const struct sq_cue_table * table, uint32_t track,
+		    uint64_t t);
+// passes send the messages which set the lights to state at t into its
+// track: one stopping every effect, then each standing cue's, with
+// fades resumed part way or, if they're over, as where they ended
+void sq_cue_state_send(const struct sq_cue_state * state,
+		       const struct sq_cue_table * table, uint64_t t,
+		       void (*send)(const void * msg, size_t length));
+
+#endif
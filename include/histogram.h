@@ -0,0 +1,42 @@
+// histogram.h
+// Log-linear histograms, in the manner of HdrHistogram: values below
+// 16 get a bucket each, and every power of two above that is split
+// into 16 buckets, so a value is never more than 1/16 above its
+// bucket's lower bound.  Recording is a few instructions and never
+// allocates, so it can sit on a hot path.  Values are usually
+// nanoseconds.
+
+#ifndef _squidlights_histogram_h
+#define _squidlights_histogram_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SQ_HIST_SUB_BITS 4
+#define SQ_HIST_SUB (1 << SQ_HIST_SUB_BITS)
+#define SQ_HIST_MAX_BITS 40  // largest value kept apart, about 18 min in ns
+#define SQ_HIST_BUCKETS ((SQ_HIST_MAX_BITS - SQ_HIST_SUB_BITS + 1) * SQ_HIST_SUB)
+
+struct sq_hist {
+  uint32_t counts[SQ_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+};
+
+void sq_hist_init(struct sq_hist * h);
+void sq_hist_record(struct sq_hist * h, uint64_t value);
+// adds src's counts into dst
+void sq_hist_add(struct sq_hist * dst, const struct sq_hist * src);
+
+// which bucket value falls in, and the smallest value of a bucket
+int sq_hist_bucket(uint64_t value);
+uint64_t sq_hist_bucket_low(int bucket);
+
+// the largest value in the bucket holding the p'th percentile, 0 to
+// 100, so the true percentile is at most that
+uint64_t sq_hist_percentile(const struct sq_hist * h, double p);
+
+// one line of count, percentiles and max, each divided by scale
+void sq_hist_print(FILE * fp, const struct sq_hist * h, double scale);
+
+#endif
@@ -0,0 +1,38 @@
+// playhead.h
+// Following a playhead kept by another program: /time messages over
+// OSC from a media player, the JACK transport, or a file another
+// program keeps rewriting.  /time takes (seconds), (track) (seconds)
+// or (track) (seconds) (rolling); the file holds the same as text.
+// Between updates the position is carried forward on the clock, for up
+// to a second, after which the player is taken to have stopped.
+
+#ifndef _squidlights_playhead_h
+#define _squidlights_playhead_h
+
+#include <stdint.h>
+
+#define SQ_PLAYHEAD_OSC_PORT "13174"
+
+enum sq_playhead_source_e {
+  SQ_PLAYHEAD_OSC = 1,  // arg is the port, or NULL for the default
+  SQ_PLAYHEAD_JACK,     // arg is the client's name
+  SQ_PLAYHEAD_FILE      // arg is the file
+};
+
+// where the music is
+struct sq_playhead {
+  int known;       // whether anything's been heard
+  uint32_t track;
+  uint64_t pos;    // ns into the track
+  uint64_t at;     // sqlights_time() when it was there
+  int rolling;
+};
+
+// starts following source, as default_track for sources which don't
+// say which.  Returns 0, or -1 having printed why not.
+int sq_playhead_open(int source, const char * arg, uint32_t default_track);
+// where it is at now, a sqlights_time()
+void sq_playhead_read(struct sq_playhead * ph, uint64_t now);
+void sq_playhead_close(void);
+
+#endif
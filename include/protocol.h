@@ -1,11 +1,19 @@
 #ifndef _squidlights_protocol_h
 #define _squidlights_protocol_h
 
+#include <stdint.h>
+#include <stdio.h>
+
 #define SQ_PORT 13172
 #define SQ_OSC_PORT 13173
+// the router's unix datagram socket, for a router address of "unix:"
+#define SQ_UNIX_SOCKET "/tmp/sqlights-dgram.sock"
 #define ACK_DELAY 1
 #define REACK_DELAY 5
 #define REMOVE_DELAY 10
+// the largest datagram the router sends a light process, so the most
+// that a light's receive buffer has to take
+#define SQ_BATCH_SIZE 1024
 
 enum sq_light_type_e {
   SQ_ONOFF = 1,
@@ -24,6 +32,8 @@ struct light_s {
   void (*brightness_handler)(struct light_s * light, float brightness);
   void (*rgb_handler)(struct light_s * light, float r, float g, float b);
   void (*hsi_handler)(struct light_s * light, float h, float s, float i);
+  // the library's: where its gathered frame updates are, or -1
+  int frame_color, frame_level;
 };
 typedef struct light_s light_t;
 
@@ -36,7 +46,18 @@ enum sq_msg_e {
   SQ_LIGHT_BRIGHTNESS,
   SQ_LIGHT_RGB,
   SQ_LIGHT_HSI,
-  SQ_DIE
+  SQ_DIE,
+  SQ_STATS_QUERY,   // a client asks the router for its statistics
+  SQ_STATS_TOTALS,  // and the router replies with these,
+  SQ_STATS_HIST,
+  SQ_STATS_LIGHTS,
+  SQ_STATS_END,     // ending with this
+  SQ_FADE,          // a client asks the router to fade a light
+  SQ_EFFECT,        // or to run an effect on a group of lights
+  SQ_BATCH,         // several light messages to one light process
+  SQ_SCENE_CAPTURE, // a client asks the router to keep lights' state
+  SQ_SCENE_RECALL,  // or to set them back to it
+  SQ_NUM_MSG_TYPES
 };
 
 typedef enum sq_msg_e sq_msg_type;
@@ -100,20 +121,332 @@ struct sq_die {
   sq_msg_type type;
 };
 
+// a client sends this to ask for the router's statistics.  Each
+// message of the reply fits in SQ_STATS_REPLY_SIZE, which is what the
+// client takes a reply into.
+#define SQ_STATS_REPLY_SIZE 256
+struct sq_stats_query {
+  sq_msg_type type;
+};
+
+// the router's counts since it started.  The gauges come first,
+// together, so the struct doesn't pad out past the reply size.
+struct sq_stats_totals {
+  sq_msg_type type;
+  uint32_t lights;                // registered now
+  uint32_t peers;                 // shared-memory connections now
+  uint32_t held;                  // waiting for their time now
+  uint32_t fading;                // lights being faded now
+  uint32_t effects;               // effects running now
+  uint32_t scenes;                // kept now
+  uint64_t in[SQ_NUM_MSG_TYPES];  // messages received, by type
+  uint64_t forwarded;             // passed on to lights
+  uint64_t dropped;               // lost to full sockets and rings
+  uint64_t unknown_dest;          // for lights that aren't registered
+  uint64_t bad;                   // of no known type
+  uint64_t scheduled;             // held for an execute-at time
+  uint64_t schedule_full;         // dropped, the router holding too many
+  uint64_t rendered;              // light messages made by fades and effects
+  uint64_t batches;               // and the datagrams they went out in
+};
+
+// part of the histogram of nanoseconds spent handling each message,
+// as in histogram.h: counts of buckets first to first+n-1.  Empty
+// stretches aren't sent.
+#define SQ_STATS_HIST_CHUNK 48
+struct sq_stats_hist {
+  sq_msg_type type;
+  uint32_t first;
+  uint32_t n;
+  uint32_t counts[SQ_STATS_HIST_CHUNK];
+};
+
+// counts for up to four lights
+#define SQ_STATS_LIGHTS_PER_MSG 4
+struct sq_stats_lights {
+  sq_msg_type type;
+  uint32_t n;
+  struct {
+    char name[32];
+    uint64_t in;         // messages for it
+    uint64_t forwarded;
+    uint64_t dropped;
+  } lights[SQ_STATS_LIGHTS_PER_MSG];
+};
+
+// the end of the reply
+struct sq_stats_end {
+  sq_msg_type type;
+  uint32_t nlights;  // lights in the SQ_STATS_LIGHTS messages before it
+};
+
+_Static_assert(sizeof(struct sq_stats_totals) <= SQ_STATS_REPLY_SIZE,
+	       "stats totals don't fit a reply");
+_Static_assert(sizeof(struct sq_stats_hist) <= SQ_STATS_REPLY_SIZE,
+	       "stats histogram chunks don't fit a reply");
+_Static_assert(sizeof(struct sq_stats_lights) <= SQ_STATS_REPLY_SIZE,
+	       "stats lights don't fit a reply");
+_Static_assert(sizeof(struct sq_stats_end) <= SQ_STATS_REPLY_SIZE,
+	       "stats end doesn't fit a reply");
+
+// Fades and effects.  The router renders these itself, a frame at a
+// time (40 a second unless it's told otherwise), sending each light
+// only what changed, and everything for one light process in one
+// SQ_BATCH.  A light message sent to a light stops its fade, but not
+// an effect on it.
+
+// fade a light from where it is to value over ms milliseconds.  to is
+// SQ_LIGHT_BRIGHTNESS (value[0]), SQ_LIGHT_RGB or SQ_LIGHT_HSI.  A
+// light last set some other way fades up from off.
+struct sq_fade {
+  sq_msg_type type;
+  char name[32];
+  sq_msg_type to;
+  float value[3];
+  uint32_t ms;
+};
+
+enum sq_effect_e {
+  SQ_FX_STOP = 0,     // stops the effects on group
+  SQ_FX_CHASE,        // level on each light in turn, a step a period
+  SQ_FX_COLOR_WHEEL,  // hue round once a period, param the spread of
+		      // hues across the group (0 all the same, 1 a
+		      // whole wheel)
+  SQ_FX_STROBE        // level for param (the duty, 0.5 if 0) of each
+		      // period, then off
+};
+
+// runs effect on the lights whose names match group, an fnmatch(3)
+// pattern.  A new effect on a group replaces the one running on it,
+// and of overlapping groups, the latest effect wins.  Lights which
+// register later join in.
+struct sq_effect {
+  sq_msg_type type;
+  char group[32];
+  uint32_t effect;
+  uint32_t period_ms;
+  float level;
+  float param;
+};
+
+// n light messages follow, back to back, each sqlights_msg_size() of
+// its type
+struct sq_batch {
+  sq_msg_type type;
+  uint32_t n;
+};
+
+// Scenes.  The router keeps named looks, each the state of a set of
+// lights, loaded from a file (see scenes.h) or captured from the state
+// it last sent the lights.  Recalling one sets every light in it at
+// once, everything for one light process going in one SQ_BATCH (or as
+// few as SQ_BATCH_SIZE allows), so a look changes together rather than
+// smeared over a packet per light.  Effects running on its lights
+// carry on over it.
+
+// makes scene the state of the lights matching group, an fnmatch(3)
+// pattern, replacing what it held.  An empty group forgets the scene.
+struct sq_scene_capture {
+  sq_msg_type type;
+  char scene[32];
+  char group[32];
+};
+
+// sets the lights to scene, fading those that can over fade_ms (0 for
+// straight away)
+struct sq_scene_recall {
+  sq_msg_type type;
+  char scene[32];
+  uint32_t fade_ms;
+};
+
+// Tracing.  A client with tracing on sets SQ_TRACE_FLAG in the type of
+// each light message and appends this after it; the router fills in
+// its times as it forwards it, and the light's library times the
+// handler.  Times are CLOCK_MONOTONIC ns, so only mean anything when
+// the client, router and light share a host.
+#define SQ_TRACE_FLAG 0x40000000
+struct sq_trace {
+  uint32_t pid;          // the client's
+  uint32_t seq;          // its count of traced messages
+  uint64_t client_send;
+  uint64_t router_recv;
+  uint64_t router_fwd;
+};
+
+// Scheduling.  A client sets SQ_AT_FLAG in the type of a light message
+// and appends this after it (before any trace) to have the router hold
+// the message until then, instead of passing it on as it arrives.
+// Times are CLOCK_REALTIME ns, so hosts kept in step by NTP or PTP
+// agree on them.
+#define SQ_AT_FLAG 0x20000000
+struct sq_at {
+  uint64_t at;
+};
+
+// the hops each process keeps a histogram of
+enum sq_trace_hop_e {
+  SQ_HOP_CLIENT_ROUTER = 0,  // client send to router receive
+  SQ_HOP_ROUTER,             // router receive to forward
+  SQ_HOP_ROUTER_LIGHT,       // router forward to handler entry
+  SQ_HOP_HANDLER,            // in the handler
+  SQ_HOP_END_TO_END,         // client send to handler entry
+  SQ_HOP_SCHEDULE,           // a scheduled message's time to its release
+  SQ_NUM_HOPS
+};
+
 int sqlights_eq_name(char * n1, char * n2);
 
+// the size of a message of type which a client may send for lights,
+// or 0 if type isn't one
+size_t sqlights_msg_size(sq_msg_type type);
+
+// a light a client sends to, opened by name with its messages already
+// filled in, so that setting it only patches the values before the
+// send.  A handle should be used from one thread at a time.
+struct sq_client_light_s {
+  char name[33];
+  struct sq_light_onoff onoff;
+  struct sq_light_brightness brightness;
+  struct sq_light_color rgb;
+  struct sq_light_color hsi;
+
+  // set by sqlights_client_limit()
+  char limited;
+  float epsilon;
+  double min_interval;   // seconds, from the maximum rate
+  // what was last sent, and an update held back by the rate
+  char busy;             // a lock, as the flush may come from elsewhere
+  void * last_msg;
+  float last[3];
+  double last_time;
+  void * held_msg;
+  float held[3];
+  struct sq_client_light_s * next;
+};
+typedef struct sq_client_light_s sq_client_light_t;
+
 /*** client functions ***/
 
+// routeraddr is a host name, "unix:" or "unix:/path" for the router's
+// unix datagram socket, or "shm" or "shm:/path" for shared memory
 int sqlights_client_initialize(char * routeraddr);
 
 void sqlights_client_seton(char * name, char seton);
 void sqlights_client_brightness(char * name, float brightness);
 void sqlights_client_rgb(char * name, float r, float g, float b);
 void sqlights_client_hsi(char * name, float h, float s, float i);
+// sends a light message already made, such as one read back from a
+// recording; length should be sqlights_msg_size() of its type
+void sqlights_client_send(const void * msg, size_t length);
+
+// has the router fade a light to a value over ms milliseconds
+void sqlights_client_fade_brightness(char * name, float brightness,
+				     uint32_t ms);
+void sqlights_client_fade_rgb(char * name, float r, float g, float b,
+			      uint32_t ms);
+void sqlights_client_fade_hsi(char * name, float h, float s, float i,
+			      uint32_t ms);
+// has the router run effect, an sq_effect_e, on the lights matching
+// group, as for struct sq_effect
+void sqlights_client_effect(char * group, int effect, uint32_t period_ms,
+			    float level, float param);
+// has the router keep the state of the lights matching group as scene,
+// or forget scene if group is ""
+void sqlights_client_scene_capture(char * scene, char * group);
+// has the router set the lights to scene, fading over fade_ms
+void sqlights_client_scene_recall(char * scene, uint32_t fade_ms);
+
+// Sends normally happen in the calling thread.  After this, they're
+// queued instead, and a sender thread passes them to the kernel every
+// interval_us microseconds, as many to a system call as it can.  A
+// full queue or a transient send error (ENOBUFS and the like) loses
+// the update rather than blocking or exiting.  Returns 0, or -1 if the
+// thread couldn't be started.
+int sqlights_client_async(int interval_us);
+// sends every update the rate limit is holding back, and waits until
+// everything sent so far has been passed to the kernel
+void sqlights_client_flush(void);
+
+struct sq_client_stats {
+  long sent;         // updates passed to the kernel (or the shm ring)
+  long queue_full;   // lost to a full async queue
+  long send_errors;  // lost to transient errors, or a full shm ring
+  long suppressed;   // dropped by a light's epsilon as no change
+  long rate_limited; // held back by a light's rate, then replaced
+};
+void sqlights_client_stats(struct sq_client_stats * stats);
+
+// the clock scheduled updates are timed by: CLOCK_REALTIME, in ns
+uint64_t sqlights_time(void);
+// Updates this thread sends from now on are held by the router until
+// at, a time as from sqlights_time(), rather than passed on as they
+// arrive; so a whole bar can be sent ahead, and land with the router's
+// timing instead of the network's.  0 goes back to sending them
+// straight away.  Holding back by sqlights_client_limit() times by
+// sending, not by at, so the two don't mix.
+void sqlights_client_at(uint64_t at);
+
+// with on set, stamps each update sent for tracing
+void sqlights_client_trace(char on);
+
+// asks the router for its statistics, and passes each message of the
+// reply to handler as it comes, the last being SQ_STATS_END.  Returns
+// 0, or -1 if the reply didn't finish within timeout_ms.
+int sqlights_client_query_stats(void (*handler)(void * msg, int len,
+						void * arg),
+				void * arg, int timeout_ms);
+
+// opens a handle on a light, for the functions below.  Lights needn't
+// exist yet, and handles can be opened before initializing.
+sq_client_light_t * sqlights_client_open(char * name);
+void sqlights_client_close(sq_client_light_t * light);
+
+void sqlights_client_light_seton(sq_client_light_t * light, char seton);
+void sqlights_client_light_brightness(sq_client_light_t * light,
+				      float brightness);
+void sqlights_client_light_rgb(sq_client_light_t * light,
+			       float r, float g, float b);
+void sqlights_client_light_hsi(sq_client_light_t * light,
+			       float h, float s, float i);
+
+// from now on, drops updates to light which change no value by more
+// than epsilon (on/off by any change), unless the last was over a
+// second ago, and sends at most max_rate updates a second (0 for no
+// limit).  The latest update held back by the rate goes out with the
+// next one allowed, or from sqlights_client_send_due().
+void sqlights_client_limit(sq_client_light_t * light, float epsilon,
+			   float max_rate);
+// sends the held-back updates whose time has come, for calling once a
+// frame or so
+void sqlights_client_send_due(void);
 
 /*** light functions ***/
 
-// initializes the light system for this process
+// A light's new state, as a frame handler gets it.  With a frame
+// handler set, the light messages drained in one
+// sqlights_lights_handle() call go to it in one call, rather than to
+// each light's handlers one by one, so a driver can push them to the
+// hardware in one go.  Redundant ones are dropped: a color (rgb or
+// hsi) replaces whatever else the light had, and a level (on/off or
+// brightness) the level before it, so each light has at most a color
+// then a level.
+struct sq_light_update {
+  light_t * light;
+  sq_msg_type type;  // SQ_LIGHT_ONOFF, _BRIGHTNESS, _RGB or _HSI
+  float value[3];    // on as 0 or 1, the brightness, r g b or h s i
+};
+
+// sets the process's frame handler, which gets data back with the
+// updates, or with NULL goes back to the lights' own handlers.  With
+// tracing, the handler hop then ends when a message is gathered, not
+// when the frame handler has run.
+void sqlights_set_frame_handler(void (*handler)(struct sq_light_update *
+						updates, int n, void * data),
+				void * data);
+
+// initializes the light system for this process.  routeraddr is as for
+// sqlights_client_initialize().
 int sqlights_light_initialize(char * routeraddr);
 
 // adds a light, returns the light structure.
@@ -130,9 +463,24 @@ void sqlights_lights_run(void);
 // or, do one iteration of running the lights.  If wait is true, then
 // do a blocking call.  Returns 0 if handled something, -1 otherwise.
 int sqlights_lights_handle(char wait);
+// the socket lights receive on, for drivers which select() on it
+// alongside their own timers before calling sqlights_lights_handle(0)
+int sqlights_lights_fd(void);
 
 /** helpful functions **/
 
+// adds a sample, in ns, to a hop's histogram.  The first one makes
+// SIGUSR1 dump the histograms to stderr, from sqlights_trace_check().
+void sqlights_trace_record(int hop, uint64_t ns);
+// dumps the histograms if SIGUSR1 has come; sqlights_lights_handle()
+// calls this
+void sqlights_trace_check(void);
+void sqlights_trace_dump(FILE * fp);
+// the histogram of a hop, as in histogram.h, or NULL if nothing has
+// been traced
+struct sq_hist;
+const struct sq_hist * sqlights_trace_hist(int hop);
+
 void dieperr(const char *msg);
 void die(const char *msg);
 void tryp(int ret, const char * msg);
@@ -0,0 +1,63 @@
+// record.h
+// Recording the router's traffic.  Every datagram the router takes in
+// goes into a preallocated ring, stamped with the monotonic clock, and
+// a writer thread appends the ring's contents to a log file.  Putting a
+// message in the ring is a copy and never waits: if the writer falls
+// behind and the ring fills, the message is dropped from the log (and
+// counted), not from the show.  The log is read back by the replayer.
+//
+// A log is a header, then entries, each an sq_record_entry followed by
+// its message padded to a multiple of 8 bytes.
+
+#ifndef _squidlights_record_h
+#define _squidlights_record_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SQ_RECORD_MAGIC "sqrecord"
+#define SQ_RECORD_VERSION 1
+#define SQ_RECORD_RING (8 << 20)  // bytes; a power of two
+
+struct sq_record_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t started;       // CLOCK_REALTIME ns when recording began
+  uint64_t started_mono;  // and CLOCK_MONOTONIC ns, as the entries are
+};
+
+// where a message came in
+enum sq_record_source_e {
+  SQ_RECORD_UDP = 1,
+  SQ_RECORD_UNIX,
+  SQ_RECORD_SHM
+};
+
+struct sq_record_entry {
+  uint64_t t;       // CLOCK_MONOTONIC ns when the router took it in
+  uint32_t len;     // of the message which follows
+  uint16_t source;
+  uint16_t reserved;
+};
+
+// starts recording to path, truncating it.  Returns 0, or -1 if the
+// file or the thread couldn't be made.
+int sq_record_start(const char * path);
+// adds a message to the log, if recording.  Only one thread may call
+// this.
+void sq_record(const void * msg, size_t len, int source, uint64_t t);
+// writes out what's left in the ring and closes the log
+void sq_record_stop(void);
+// how many messages have been logged, and lost to a full ring
+void sq_record_counts(uint64_t * recorded, uint64_t * dropped);
+
+// reads a log's header.  Returns 0, or -1 if fp doesn't hold a log.
+int sq_record_read_header(FILE * fp, struct sq_record_header * header);
+// reads the next entry, with as much of its message as fits in size
+// bytes into msg.  Returns the message's length, or -1 at the end.
+int sq_record_read(FILE * fp, struct sq_record_entry * entry, void * msg,
+		   size_t size);
+
+#endif
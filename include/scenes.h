@@ -0,0 +1,55 @@
+// scenes.h
+// The scenes the router keeps (see SQ_SCENE_CAPTURE in protocol.h).
+// They can be given to it in a file, one light's state to a line:
+//
+//   # scene   light         state
+//   blue      rig-color-0   rgb 0 0 1
+//   blue      rig-fade-0    brightness 0.2
+//   dark      rig-onoff-0   off
+//
+// where the state is on | off | brightness (v) | rgb (r) (g) (b) |
+// hsi (h) (s) (i), as in the light messages.  A light given twice in a
+// scene keeps the later.  Everything after a # is a comment.
+
+#ifndef _squidlights_scenes_h
+#define _squidlights_scenes_h
+
+#include "protocol.h"
+#include <stdint.h>
+#include <stdio.h>
+
+struct sq_scene_light {
+  char name[32];
+  sq_msg_type type;  // SQ_LIGHT_ONOFF, _BRIGHTNESS, _RGB or _HSI
+  float value[3];
+};
+
+struct sq_scene {
+  struct sq_scene * next;
+  char name[33];
+  struct sq_scene_light * lights;
+  uint32_t n, size;
+  uint32_t changes;  // counts changes to lights
+  // for whoever recalls it: the light each of lights is, as of changes
+  // and whatever version of its own it keeps
+  void ** resolved;
+  uint32_t resolved_changes, resolved_version;
+};
+
+// the scene called name (up to 32 characters), or NULL
+struct sq_scene * sq_scene_find(struct sq_scene * scenes, const char * name);
+// the same, adding it to *scenes, empty, if it isn't there
+struct sq_scene * sq_scene_get(struct sq_scene ** scenes, const char * name);
+// removes it from *scenes and frees it, if it's there
+void sq_scene_forget(struct sq_scene ** scenes, const char * name);
+// empties it
+void sq_scene_clear(struct sq_scene * scene);
+// sets light's state in scene, replacing any it had there
+void sq_scene_set(struct sq_scene * scene, const char * light,
+		  sq_msg_type type, const float * value);
+
+// adds the scenes in the scene file fp, called path in messages, to
+// *scenes.  Returns 0, or -1 having printed every line that's wrong.
+int sq_scenes_parse(FILE * fp, const char * path, struct sq_scene ** scenes);
+
+#endif
@@ -0,0 +1,90 @@
+// shm.h
+// Shared-memory transport between the router and the clients and
+// lights running on the same host.  A process connects to the router's
+// unix socket and gets back a memfd holding two rings of messages, one
+// in each direction, and an eventfd for each.  From then on a message
+// is a copy into a ring slot, and the kernel is only entered to wake a
+// side which has gone to sleep waiting for one.
+//
+// The rings take several producers and one consumer, so any number of
+// threads in a client may send at once, but only one may receive.
+
+#ifndef _squidlights_shm_h
+#define _squidlights_shm_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SQ_SHM_SOCKET "/tmp/sqlights.sock"
+#define SQ_SHM_VERSION 2
+#define SQ_SHM_SLOTS 1024     // per ring; a power of two
+#define SQ_SHM_SLOT_SIZE 1024  // largest message, SQ_BATCH_SIZE
+#define SQ_SHM_UP_SIZE 256     // largest to the router, as over udp
+
+struct sq_ring_slot {
+  uint32_t seq;
+  uint32_t len;
+  char data[SQ_SHM_SLOT_SIZE];
+};
+
+// head and tail are on their own cache lines so producers and the
+// consumer don't fight over one
+struct sq_ring {
+  uint32_t tail __attribute__((aligned(64)));  // next slot to claim
+  uint32_t head __attribute__((aligned(64)));  // next slot to read
+  uint32_t waiting __attribute__((aligned(64))); // consumer is asleep
+  struct sq_ring_slot slots[SQ_SHM_SLOTS] __attribute__((aligned(64)));
+};
+
+// the memfd's contents
+struct sq_shm_region {
+  struct sq_ring up;    // to the router
+  struct sq_ring down;  // from the router
+};
+
+// the rings work as well in one process's memory, as a queue between
+// threads.  push returns -1 if the ring is full, pop the length it
+// copied (the message cut to size bytes) or -1 if it's empty.
+void sq_ring_init(struct sq_ring * r);
+int sq_ring_push(struct sq_ring * r, const void * msg, size_t len);
+int sq_ring_pop(struct sq_ring * r, void * msg, size_t size);
+
+// one end of a connection
+struct sq_shm_link {
+  int sock;                    // unix socket; hangup means the other end left
+  int rx_fd;                   // eventfd, readable when rx may have messages
+  int tx_fd;                   // eventfd of the other end
+  struct sq_shm_region * region;
+  struct sq_ring * rx;
+  struct sq_ring * tx;
+  long dropped;                // sends lost to a full ring
+};
+
+// connects to the router listening at path.  Returns 0 on success, -1
+// if there's no router there (or no shared memory on this system).
+int sq_shm_connect(struct sq_shm_link * link, const char * path);
+
+// router side: listens at path, replacing any stale socket.  Returns
+// the listening socket, or -1.
+int sq_shm_listen(const char * path);
+// accepts a connection and sets up its rings.  Returns 0 on success.
+int sq_shm_accept(struct sq_shm_link * link, int listensock);
+
+void sq_shm_close(struct sq_shm_link * link);
+
+// queues a message of len bytes for the other end, waking it if it's
+// asleep.  Returns -1 (and counts a drop) if the ring is full, or if
+// it's longer than the other end takes: SQ_SHM_UP_SIZE to the router,
+// SQ_SHM_SLOT_SIZE from it.
+int sq_shm_send(struct sq_shm_link * link, const void * msg, size_t len);
+
+// takes the next message into msg, cut to size bytes.  Returns the
+// length copied, or -1 if there is none, in which case the link is
+// armed so the next send makes rx_fd readable; it's then safe to sleep
+// on rx_fd.
+int sq_shm_recv(struct sq_shm_link * link, void * msg, size_t size);
+
+// 1 if the other end has closed the connection
+int sq_shm_hungup(struct sq_shm_link * link);
+
+#endif
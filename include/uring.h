@@ -0,0 +1,74 @@
+// uring.h
+// Just enough io_uring for the router, on the kernel interface in
+// <linux/io_uring.h> so there's no library to install: the submission
+// and completion rings, and a ring of provided buffers for multishot
+// receives.  SQ_HAVE_URING is defined when the headers are new enough
+// (multishot recvmsg came in Linux 6.0); whether the running kernel
+// has it is only known once the first receive completes.
+
+#ifndef _squidlights_uring_h
+#define _squidlights_uring_h
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  ifdef IORING_RECV_MULTISHOT
+#   define SQ_HAVE_URING 1
+#  endif
+# endif
+#endif
+
+#ifdef SQ_HAVE_URING
+
+struct sq_uring {
+  int fd;
+  unsigned entries;
+  // submission ring
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  struct io_uring_sqe * sqes;
+  unsigned sqe_tail;       // next sqe to fill
+  unsigned sqe_submitted;  // sqes handed to the kernel
+  // completion ring
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+  // provided buffers, all of buf_size bytes, in group 0
+  struct io_uring_buf_ring * br;
+  unsigned br_entries;
+  unsigned buf_size;
+  char * bufs;
+  long enters;             // io_uring_enter() calls so far
+};
+
+// sets up a ring of entries sqes with room for cq_entries completions,
+// and nbufs buffers of buf_size for receives.  All are powers of two.
+// Returns 0, or -1 if the kernel won't.
+int sq_uring_init(struct sq_uring * u, unsigned entries, unsigned cq_entries,
+		  unsigned nbufs, unsigned buf_size);
+void sq_uring_exit(struct sq_uring * u);
+
+// a cleared sqe to fill in, submitting what's queued first if the ring
+// is full.  Never NULL.
+struct io_uring_sqe * sq_uring_sqe(struct sq_uring * u);
+
+// submits everything queued and, if wait_ms isn't 0, waits up to that
+// long (or forever if it's -1) for a completion, or until a signal.
+// Returns 0 or -errno.
+int sq_uring_submit(struct sq_uring * u, int wait_ms);
+
+// the next completion, or NULL.  Call sq_uring_cqe_seen() when done
+// with it.
+struct io_uring_cqe * sq_uring_cqe(struct sq_uring * u);
+void sq_uring_cqe_seen(struct sq_uring * u);
+
+// the provided buffer a completion used, and giving it back
+char * sq_uring_buf(struct sq_uring * u, struct io_uring_cqe * cqe);
+void sq_uring_buf_return(struct sq_uring * u, struct io_uring_cqe * cqe);
+
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+/* colorbench.c
+   checks the HSI to RGB conversion of color.h against the trig it
+   replaced, the way the light handlers did it per message: how far
+   apart they are across the wheel and saturations, then how long
+   each takes per color, one at a time and as a batch.  Needs no
+   router. */
+
+#include "protocol.h"
+#include "color.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_COUNT 1000000
+#define ROUNDS 20
+
+static inline float deg_to_rad(float d) {
+  return d*M_PI/180.0;
+}
+
+// as default_hsi_handler() had it
+static void trig_hsi_to_rgb(float h, float s, float * rp, float * gp,
+			    float * bp) {
+  float r, g, b;
+  h = fmod(h, 360.0);
+  if(h < 120) {
+    r = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
+    g = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
+    b = (1-s)/3;
+  } else if(h < 240) {
+    h = h - 120;
+    g = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
+    b = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
+    r = (1-s)/3;
+  } else {
+    h = h - 240;
+    b = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
+    r = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
+    g = (1-s)/3;
+  }
+  *rp = r;
+  *gp = g;
+  *bp = b;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [-n (colors)]\n"
+	 "\t-n (colors)\tconverted per round when timing (default %d)\n",
+	 prgname, DEFAULT_COUNT);
+}
+
+int main(int argc, char** argv) {
+  int n = DEFAULT_COUNT;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch(opt) {
+    case 'n': n = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(n <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // accuracy, over the wheel in steps of 1/64 degree
+  double worst = 0, total = 0;
+  float worst_h = 0, worst_s = 0;
+  long compared = 0;
+  for(int j = 0; j <= 360 * 64; j++) {
+    for(int k = 0; k <= 4; k++) {
+      float h = j / 64.0, s = k / 4.0;
+      float r0, g0, b0, r1, g1, b1;
+      if(h >= 360) {
+	// the trig one never wrapped exactly 360
+	break;
+      }
+      trig_hsi_to_rgb(h, s, &r0, &g0, &b0);
+      sq_hsi_to_rgb(h, s, &r1, &g1, &b1);
+      double e = fmax(fabs(r1 - r0), fmax(fabs(g1 - g0), fabs(b1 - b0)));
+      total += e;
+      compared++;
+      if(e > worst) {
+	worst = e;
+	worst_h = h;
+	worst_s = s;
+      }
+    }
+  }
+  printf("%ld colors compared: mean error %.2g, worst %.2g (h %g, s %g)\n",
+	 compared, total / compared, worst, worst_h, worst_s);
+
+  // speed, on colors as kshow and the fades make them
+  float * h = malloc(n * sizeof(float));
+  float * s = malloc(n * sizeof(float));
+  float * r = malloc(n * sizeof(float));
+  float * g = malloc(n * sizeof(float));
+  float * b = malloc(n * sizeof(float));
+  if(!h || !s || !r || !g || !b) {
+    die("out of memory");
+  }
+  srand(1);
+  for(int i = 0; i < n; i++) {
+    h[i] = rand() / (RAND_MAX + 1.0) * 360;
+    s[i] = rand() / (RAND_MAX + 1.0);
+  }
+  const char * names[] = {"trig", "color.h, one at a time", "color.h, batch"};
+  double sink = 0;
+  for(int method = 0; method < 3; method++) {
+    uint64_t best = UINT64_MAX;
+    for(int round = 0; round < ROUNDS; round++) {
+      uint64_t t0 = sqlights_time();
+      switch(method) {
+      case 0:
+	for(int i = 0; i < n; i++) {
+	  trig_hsi_to_rgb(h[i], s[i], &r[i], &g[i], &b[i]);
+	}
+	break;
+      case 1:
+	for(int i = 0; i < n; i++) {
+	  sq_hsi_to_rgb(h[i], s[i], &r[i], &g[i], &b[i]);
+	}
+	break;
+      case 2:
+	sq_hsi_to_rgb_n(n, h, s, r, g, b);
+	break;
+      }
+      uint64_t t = sqlights_time() - t0;
+      best = t < best ? t : best;
+      sink += r[round % n] + g[round % n] + b[round % n];
+    }
+    printf("%-24s %8.2f ns a color\n", names[method], (double)best / n);
+  }
+  // so the conversions can't be optimized away
+  if(sink < 0) {
+    printf("%g\n", sink);
+  }
+  free(h);
+  free(s);
+  free(r);
+  free(g);
+  free(b);
+  return 0;
+}
@@ -0,0 +1,71 @@
+/* cuec.c
+   compiles a cue file, as described in cues.h, into the sorted table
+   cueplay plays, reporting every line that's wrong.  -k sets how far
+   apart the keyframes a player seeks from are.  With -d, prints a
+   compiled table back out as a cue file instead. */
+
+#include "cues.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void print_usage(char * prgname) {
+  printf("usage: %s [-k (seconds)] (cue file) (table)\n"
+	 "       %s -d (table)\n"
+	 "\t-k (seconds)\tbetween keyframes (default %d)\n"
+	 "\t-d\t\tprint a table as the cue file it came from would be\n",
+	 prgname, prgname, SQ_CUES_KEY_MS / 1000);
+}
+
+int main(int argc, char** argv) {
+  int dump = 0;
+  double key_s = SQ_CUES_KEY_MS / 1000;
+  int opt;
+
+  while((opt = getopt(argc, argv, "k:dh")) != -1) {
+    switch(opt) {
+    case 'k': key_s = atof(optarg); break;
+    case 'd': dump = 1; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind + (dump ? 1 : 2) != argc || key_s < 0.001 || key_s > 3600) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct sq_cue_table table;
+  if(dump) {
+    char line[128];
+    if(sq_cues_load(argv[optind], &table)) {
+      printf("%s isn't a cue table\n", argv[optind]);
+      return 1;
+    }
+    for(uint32_t i = 0; i < table.header.ncues; i++) {
+      sq_cue_format(&table.cues[i], line, sizeof(line));
+      printf("%s\n", line);
+    }
+    sq_cues_free(&table);
+    return 0;
+  }
+
+  FILE * fp = fopen(argv[optind], "r");
+  if(fp == NULL) {
+    dieperr(argv[optind]);
+  }
+  if(sq_cues_parse(fp, argv[optind], key_s * 1000, &table)) {
+    return 1;
+  }
+  fclose(fp);
+  if(sq_cues_write(argv[optind + 1], &table)) {
+    dieperr(argv[optind + 1]);
+  }
+  printf("%u cues in %u tracks, %u keyframes\n", table.header.ncues,
+	 table.header.ntracks, table.header.nkeys);
+  sq_cues_free(&table);
+  return 0;
+}
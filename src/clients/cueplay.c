@@ -0,0 +1,131 @@
+/* cueplay.c
+   plays a track of a compiled cue table (see cues.h and cuec) on its
+   own clock, from the start or some way in.  A cursor walks the
+   track's cues in order, so the player sleeps until the next one is
+   due and firing it is a send; nothing is rechecked each frame.  With
+   -a, each cue is sent that far ahead for the router to hold until
+   its time, so network delays don't move it.  Starting part way in
+   first sets the lights as the cues before would have left them. */
+
+#include "protocol.h"
+#include "cues.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while(clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL)) {
+  }
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] (table) [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-t (track)\tplay this track (default the first)\n"
+	 "\t-s (seconds)\tstart this far into it\n"
+	 "\t-a (ms)\t\tsend each cue this far ahead, for the router to\n"
+	 "\t\t\thold until its time\n"
+	 "\t-v\t\tprint each cue as it's sent\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  char * routeraddr = "localhost";
+  long track = -1;
+  double start_s = 0, ahead_ms = 0;
+  int verbose = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "t:s:a:vh")) != -1) {
+    switch(opt) {
+    case 't': track = atol(optarg); break;
+    case 's': start_s = atof(optarg); break;
+    case 'a': ahead_ms = atof(optarg); break;
+    case 'v': verbose = 1; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind >= argc || start_s < 0 || ahead_ms < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind + 1 < argc) {
+    routeraddr = argv[optind + 1];
+  }
+
+  struct sq_cue_table table;
+  if(sq_cues_load(argv[optind], &table)) {
+    printf("%s isn't a cue table; compile it with cuec\n", argv[optind]);
+    return 1;
+  }
+  if(track < 0) {
+    track = table.header.ntracks ? table.tracks[0].track : 0;
+  }
+  struct sq_cue_cursor cursor;
+  uint64_t offset = start_s * 1e9;
+  if(sq_cue_seek(&cursor, &table, track, offset)) {
+    printf("no cues for track %ld\n", track);
+    return 1;
+  }
+  sqlights_client_initialize(routeraddr);
+  if(offset > 0) {
+    struct sq_cue_state state;
+    sq_cue_state_init(&state);
+    sq_cue_state_at(&state, &table, track, offset);
+    sq_cue_state_send(&state, &table, offset, sqlights_client_send);
+    sq_cue_state_free(&state);
+  }
+
+  uint64_t ahead = ahead_ms * 1e6;
+  // the track's start, on the clock the router schedules by
+  uint64_t start = sqlights_time() - offset;
+  struct sq_hist late;
+  long sent = 0;
+  char line[128];
+  sq_hist_init(&late);
+  printf("playing track %ld from %.3f s\n", track, start_s);
+  fflush(stdout);
+  while(cursor.next < cursor.end) {
+    uint64_t due = start + sq_cue_next_time(&cursor);
+    sleep_until(due > ahead ? due - ahead : 0);
+    uint64_t now = sqlights_time();
+    // everything due by now, in the order they were written
+    const struct sq_cue * cue;
+    while(NULL != (cue = sq_cue_due(&cursor, now - start + ahead))) {
+      due = start + cue->t;
+      if(ahead) {
+	sqlights_client_at(due);
+      } else {
+	sq_hist_record(&late, now > due ? now - due : 0);
+      }
+      sqlights_client_send(cue->msg, cue->len);
+      sent++;
+      if(verbose) {
+	sq_cue_format(cue, line, sizeof(line));
+	printf("%s\n", line);
+      }
+    }
+  }
+  sqlights_client_at(0);
+
+  struct sq_client_stats stats;
+  sqlights_client_stats(&stats);
+  printf("sent %ld cues in %.2f s\n", sent,
+	 (sqlights_time() - start) * 1e-9 - start_s);
+  if(stats.send_errors) {
+    printf("%ld lost sending\n", stats.send_errors);
+  }
+  if(!ahead && late.count) {
+    printf("late, in us:");
+    sq_hist_print(stdout, &late, 1000);
+  }
+  sq_cues_free(&table);
+  return 0;
+}
@@ -0,0 +1,185 @@
+/* cuesync.c
+   plays a compiled cue table (see cues.h and cuec) in step with a
+   playhead kept somewhere else: /time messages over OSC from a media
+   player, the JACK transport, or a file another program keeps
+   rewriting.  Every frame it works out where the playhead is and fires
+   the cues it has passed since the last, so a late frame makes cues
+   late but never loses them.  When the playhead jumps (a seek, a new
+   track, a rewind) the lights are set as the cues would have left them
+   there, from the nearest keyframe, and it carries on from there. */
+
+#include "protocol.h"
+#include "cues.h"
+#include "histogram.h"
+#include "playhead.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopping = 0;
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while(clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL)
+	&& !stopping) {
+  }
+}
+
+void stop(int sig) {
+  stopping = 1;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] (table) [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-o [port]\tfollow OSC /time messages (the default, port %s)\n"
+	 "\t-j\t\tfollow the JACK transport\n"
+	 "\t-c (file)\tfollow a file holding [track] seconds [rolling]\n"
+	 "\t-t (track)\tthe track, for sources which don't say\n"
+	 "\t\t\t(default the first)\n"
+	 "\t-f (fps)\tlook at the playhead this often (default 100)\n"
+	 "\t-J (ms)\t\ta jump bigger than this is a seek (default 250)\n"
+	 "\t-a (ms)\t\tsend cues this far ahead, for the router to hold\n"
+	 "\t\t\tuntil their time\n"
+	 "\t-v\t\tprint each cue and seek\n",
+	 prgname, SQ_PLAYHEAD_OSC_PORT);
+}
+
+int main(int argc, char** argv) {
+  char * routeraddr = "localhost";
+  int source = SQ_PLAYHEAD_OSC, verbose = 0;
+  char * source_arg = NULL;
+  long track = -1;
+  double fps = 100, jump_ms = 250, ahead_ms = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o::jc:t:f:J:a:vh")) != -1) {
+    switch(opt) {
+    case 'o': source = SQ_PLAYHEAD_OSC; source_arg = optarg; break;
+    case 'j': source = SQ_PLAYHEAD_JACK; source_arg = "cuesync"; break;
+    case 'c': source = SQ_PLAYHEAD_FILE; source_arg = optarg; break;
+    case 't': track = atol(optarg); break;
+    case 'f': fps = atof(optarg); break;
+    case 'J': jump_ms = atof(optarg); break;
+    case 'a': ahead_ms = atof(optarg); break;
+    case 'v': verbose = 1; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind >= argc || fps <= 0 || jump_ms < 0 || ahead_ms < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind + 1 < argc) {
+    routeraddr = argv[optind + 1];
+  }
+
+  struct sq_cue_table table;
+  if(sq_cues_load(argv[optind], &table)) {
+    printf("%s isn't a cue table; compile it with cuec\n", argv[optind]);
+    return 1;
+  }
+  uint32_t default_track = track >= 0 ? track
+    : table.header.ntracks ? table.tracks[0].track : 0;
+  sqlights_client_initialize(routeraddr);
+  if(sq_playhead_open(source, source_arg, default_track)) {
+    return 1;
+  }
+  fflush(stdout);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  uint64_t frame = 1e9 / fps;
+  uint64_t jump = jump_ms * 1e6;
+  uint64_t ahead = ahead_ms * 1e6;
+  struct sq_cue_state state;
+  struct sq_cue_cursor cursor;
+  struct sq_hist seek_time;
+  struct sq_playhead ph;
+  int placed = 0;           // whether the cursor's been put anywhere
+  uint32_t cur_track = 0;
+  uint64_t expected = 0;    // where the playhead should be by now
+  uint64_t last_now = 0;
+  long fired = 0, seeks = 0;
+  char line[128];
+  sq_cue_state_init(&state);
+  sq_hist_init(&seek_time);
+  memset(&cursor, 0, sizeof(cursor));
+
+  uint64_t next = sqlights_time();
+  while(!stopping) {
+    uint64_t now = sqlights_time();
+    sq_playhead_read(&ph, now);
+    if(placed && last_now && ph.rolling) {
+      expected += now - last_now;
+    }
+    last_now = now;
+    if(!ph.known) {
+      next += frame;
+      sleep_until(next);
+      continue;
+    }
+
+    if(!placed || ph.track != cur_track || ph.pos + jump < expected
+       || ph.pos > expected + jump) {
+      // somewhere new: set the lights as they'd be there
+      uint64_t t0 = sqlights_time();
+      if(sq_cue_state_at(&state, &table, ph.track, ph.pos) == 0) {
+	sq_cue_state_send(&state, &table, ph.pos, sqlights_client_send);
+      }
+      sq_cue_seek(&cursor, &table, ph.track, ph.pos);
+      sq_hist_record(&seek_time, sqlights_time() - t0);
+      if(verbose) {
+	printf("at track %u %.3f s, %u cues standing\n", ph.track,
+	       ph.pos * 1e-9, state.n);
+      }
+      placed = 1;
+      seeks++;
+      cur_track = ph.track;
+    }
+    expected = ph.pos;
+
+    if(ph.rolling) {
+      // everything the playhead's passed, and with -a what it's about to
+      const struct sq_cue * cue;
+      while(NULL != (cue = sq_cue_due(&cursor, ph.pos + ahead))) {
+	if(ahead) {
+	  sqlights_client_at(cue->t > ph.pos ? now + (cue->t - ph.pos) : 0);
+	}
+	sqlights_client_send(cue->msg, cue->len);
+	fired++;
+	if(verbose) {
+	  sq_cue_format(cue, line, sizeof(line));
+	  printf("%s\n", line);
+	}
+      }
+      sqlights_client_at(0);
+    }
+    if(verbose) {
+      fflush(stdout);
+    }
+
+    next += frame;
+    if(next < now) {
+      // too far behind to catch up frame by frame
+      next = now + frame;
+    }
+    sleep_until(next);
+  }
+
+  printf("fired %ld cues, %ld seeks\n", fired, seeks);
+  if(seek_time.count) {
+    printf("seeks, in us:");
+    sq_hist_print(stdout, &seek_time, 1000);
+  }
+  sq_playhead_close();
+  sq_cue_state_free(&state);
+  sq_cues_free(&table);
+  return 0;
+}
@@ -0,0 +1,507 @@
+// analyze.c
+// implementation of analyze.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fftw3.h>
+#include <math.h>
+#include "protocol.h"
+#include "analyze.h"
+
+/*
+ Light definitions
+*/
+
+struct kshow_map kshow_default_map = {
+  .n = { 2, 2, 2, 2, 1, 1, 1, 2, 1, 1 },
+  .names = {
+    [KSHOW_LONG_VOL]     = {"red-center", "green-lantern"},
+    [KSHOW_SHORT_VOL]    = {"cyan-back", "green-bulbs"},
+    [KSHOW_INSENS_BEAT]  = {"hanging-terahertz", "traffic-cone"},
+    [KSHOW_SENS_BEAT]    = {"blue-front", "eit-sign"},
+    [KSHOW_SUPSENS_BEAT] = {"yellow-yield"},
+    [KSHOW_SD]           = {"yellow-back"},
+    [KSHOW_BASS]         = {"traffic-light"},
+    [KSHOW_TENOR]        = {"purple-mantle", "blue-neons"},
+    [KSHOW_HUE1]         = {"elmo0"},
+    [KSHOW_HUE2]         = {"elmo1"},
+  }
+};
+
+static const char * kshow_group_names[KSHOW_NUM_GROUPS] = {
+  "long_vol", "short_vol", "insens_beat", "sens_beat", "supsens_beat",
+  "sd", "bass", "tenor", "hue1", "hue2"
+};
+
+double kshow_latency = 0.040;
+float kshow_epsilon = -1;
+float kshow_max_rate = 0;
+
+static FILE * kshow_out = NULL;
+
+static double stage_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char * kshow_bands_group = "bands";
+
+static int kshow_add_band_light(struct kshow_map * map, char * name, int band,
+				float decays, float triggers) {
+  if(map->nband_lights >= KSHOW_BANDS_MAX) {
+    return -1;
+  }
+  if(map->nband_lights % 64 == 0) {
+    map->band_lights = realloc(map->band_lights, (map->nband_lights + 64)
+			       * sizeof(struct kshow_band_light));
+    if(map->band_lights == NULL) {
+      return -1;
+    }
+  }
+  struct kshow_band_light * l = &map->band_lights[map->nband_lights++];
+  l->name = strdup(name);
+  l->light = NULL;
+  l->band = band;
+  l->turn_off_decays = decays;
+  l->target_triggers = triggers;
+  return 0;
+}
+
+int kshow_load_map(char * filename, struct kshow_map * maps, int nchans) {
+  FILE * fp = fopen(filename, "r");
+  if(fp == NULL) {
+    printf("couldn't open file %s\n", filename);
+    return -1;
+  }
+  memset(maps, 0, nchans * sizeof(struct kshow_map));
+
+  char line[256], group[64], name[33];
+  int chan, ret, g, band;
+  float decays, triggers;
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    band = -1;
+    decays = BANDS_DEFAULT_DECAYS;
+    triggers = BANDS_DEFAULT_TRIGGERS;
+    ret = sscanf(line, "%d %63s %32s %d %f %f", &chan, group, name,
+		 &band, &decays, &triggers);
+    if(ret == EOF) {
+      continue;
+    }
+    if(ret < 3) {
+      printf("parsing error for %s\n", filename);
+      fclose(fp);
+      return -1;
+    }
+    if(strcmp(group, kshow_bands_group) == 0) {
+      g = KSHOW_NUM_GROUPS;
+    } else {
+      for(g = 0; g < KSHOW_NUM_GROUPS; g++) {
+	if(strcmp(group, kshow_group_names[g]) == 0) {
+	  break;
+	}
+      }
+      if(g == KSHOW_NUM_GROUPS) {
+	printf("unknown group \"%s\" in %s\n", group, filename);
+	fclose(fp);
+	return -1;
+      }
+    }
+    if(chan < 0 || chan >= nchans) {
+      printf("ignoring %s: no input channel %d\n", name, chan);
+      continue;
+    }
+    struct kshow_map * map = &maps[chan];
+    if(g == KSHOW_NUM_GROUPS) {
+      if(band >= BANDS_NUM
+	 || kshow_add_band_light(map, name, band, decays, triggers)) {
+	printf("ignoring band light %s of channel %d\n", name, chan);
+      }
+      continue;
+    }
+    if(map->n[g] >= KSHOW_GROUP_MAX) {
+      printf("too many lights in group %s of channel %d\n", group, chan);
+      continue;
+    }
+    map->names[g][map->n[g]++] = strdup(name);
+  }
+  fclose(fp);
+  return 0;
+}
+
+void frame_add(struct kshow_frame * frame, sq_client_light_t * light,
+	       int type, float v0, float v1, float v2) {
+  if(frame->ncmds >= KSHOW_MAX_CMDS) {
+    return;
+  }
+  struct kshow_cmd * cmd = &frame->cmds[frame->ncmds++];
+  cmd->light = light;
+  cmd->type = type;
+  cmd->v[0] = v0;
+  cmd->v[1] = v1;
+  cmd->v[2] = v2;
+}
+
+void set_leits(struct kshow_chan * chan, struct kshow_frame * frame,
+	       int group, float val) {
+  struct kshow_map * map = chan->map;
+  for(int i = 0; i < map->n[group]; i++) {
+    frame_add(frame, map->lights[group][i], KSHOW_BRIGHTNESS, val, 0, 0);
+  }
+}
+
+void set_hues(struct kshow_chan * chan, struct kshow_frame * frame,
+	      int group, float hue) {
+  struct kshow_map * map = chan->map;
+  for(int i = 0; i < map->n[group]; i++) {
+    frame_add(frame, map->lights[group][i], KSHOW_HSI, hue, 1.0, 1.0);
+  }
+}
+
+static sq_client_light_t * kshow_open(char * name) {
+  sq_client_light_t * light = sqlights_client_open(name);
+  try(light != NULL, "out of memory");
+  if(kshow_epsilon >= 0 || kshow_max_rate > 0) {
+    sqlights_client_limit(light, kshow_epsilon > 0 ? kshow_epsilon : 0,
+			  kshow_max_rate);
+  }
+  return light;
+}
+
+// opens a client handle for each light in map that doesn't have one
+static void kshow_map_open(struct kshow_map * map) {
+  for(int g = 0; g < KSHOW_NUM_GROUPS; g++) {
+    for(int i = 0; i < map->n[g]; i++) {
+      if(map->lights[g][i] == NULL) {
+	map->lights[g][i] = kshow_open(map->names[g][i]);
+      }
+    }
+  }
+  for(int i = 0; i < map->nband_lights; i++) {
+    struct kshow_band_light * l = &map->band_lights[i];
+    if(l->light == NULL) {
+      l->light = kshow_open(l->name);
+    }
+  }
+}
+
+double kshow_time(struct kshow_chan * chan) {
+  return (double)chan->windows * WINDOW_SIZE / chan->rate;
+}
+
+void kshow_chan_init(struct kshow_chan * chan, int index, int rate,
+		     struct kshow_map * map, unsigned int seed) {
+  memset(chan, 0, sizeof(*chan));
+  chan->index = index;
+  chan->rate = rate;
+  chan->map = map;
+  chan->seed = seed;
+  kshow_map_open(map);
+  onset_init(&chan->onsets, rate, WINDOW_SIZE);
+  chan->in = (double*) fftw_malloc(sizeof(double) * WINDOW_SIZE);
+  chan->out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * WINDOW_SIZE);
+  chan->plan = fftw_plan_dft_r2c_1d(WINDOW_SIZE, chan->in, chan->out,
+				    FFTW_DESTROY_INPUT);
+
+  if(map->nband_lights > 0) {
+    if(bands_init(&chan->bands, map->nband_lights, seed)) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for(int i = 0; i < map->nband_lights; i++) {
+      struct kshow_band_light * l = &map->band_lights[i];
+      if(l->band >= 0) {
+	chan->bands.band[i] = l->band;
+      }
+      chan->bands.turn_off_decays[i] = l->turn_off_decays;
+      chan->bands.target_triggers[i] = l->target_triggers;
+    }
+  }
+}
+
+static void frame_add_bands(struct kshow_chan * chan, struct kshow_frame * frame) {
+  struct bands_state * st = &chan->bands;
+  for(int i = 0; i < st->nlights; i++) {
+    if(st->changed[i]) {
+      frame_add(frame, chan->map->band_lights[i].light, KSHOW_BRIGHTNESS,
+		st->intensity[i], 0, 0);
+    }
+  }
+}
+
+static void frame_send(struct kshow_frame * frame, double t);
+
+static void kshow_bands_changed(struct bands_state * st, void * arg) {
+  struct kshow_chan * chan = arg;
+  chan->bands_frame->ncmds = 0;
+  frame_add_bands(chan, chan->bands_frame);
+  frame_send(chan->bands_frame, kshow_time(chan));
+}
+
+int kshow_chan_bands_thread(struct kshow_chan * chan) {
+  if(chan->bands.nlights == 0) {
+    return 0;
+  }
+  chan->bands_frame = malloc(sizeof(struct kshow_frame));
+  chan->bands_runner = malloc(sizeof(struct bands_runner));
+  if(chan->bands_frame == NULL || chan->bands_runner == NULL) {
+    return -1;
+  }
+  return bands_runner_start(chan->bands_runner, &chan->bands,
+			    kshow_bands_changed, chan);
+}
+
+void kshow_set_output(FILE * fp) {
+  kshow_out = fp;
+}
+
+int kshow_extract(struct kshow_chan * chan, struct kshow_features * feat) {
+  double sum = 0, sd = 0;
+  int i;
+  double volume = 0;
+  double * in = chan->in;
+  fftw_complex * out = chan->out;
+  struct onset_state * onsets = &chan->onsets;
+
+  double t0, t1;
+  double now;
+
+  chan->windows++;
+  now = kshow_time(chan);
+  t0 = stage_clock();
+
+  // Volume following
+  volume = 0;
+  for(i = 0; i < WINDOW_SIZE; i++) {
+    volume = in[i] > volume ? in[i] : volume;
+  }
+  feat->volume = volume;
+  if (volume < 0.0001) {
+    chan->stage_time[KSHOW_STAGE_VOLUME] += stage_clock() - t0;
+    return -1;
+  }
+
+  t1 = stage_clock();
+  chan->stage_time[KSHOW_STAGE_VOLUME] += t1 - t0;
+  t0 = t1;
+
+  fftw_execute(chan->plan);
+
+  t1 = stage_clock();
+  chan->stage_time[KSHOW_STAGE_FFT] += t1 - t0;
+  t0 = t1;
+
+  // "Beat following": tracked beats are fired ahead of time to make up
+  // for kshow_latency; until the tracker locks on, strong onsets stand
+  // in for them.
+  onset_update(onsets, out, WINDOW_SIZE, now);
+  feat->flux = onsets->flux;
+  feat->threshold = onsets->threshold;
+  feat->onset = onsets->onset;
+  for(i = 0; i < ONSET_BANDS; i++) {
+    feat->band_energy[i] = onsets->band_energy[i];
+  }
+  feat->beat = onset_beat_due(onsets, kshow_latency);
+  if(onsets->confidence < 0.5 && onsets->onset
+     && onsets->flux > 2.0 * onsets->threshold) {
+    feat->beat = 1;
+  }
+
+  t1 = stage_clock();
+  chan->stage_time[KSHOW_STAGE_ONSET] += t1 - t0;
+  t0 = t1;
+
+  sum = 0;
+  for(i = 0; i < WINDOW_SIZE/2; i++) {
+    sum += (out[i][0]*out[i][0]+out[i][1]*out[i][1]);
+  }
+  sum /= WINDOW_SIZE/2;
+  sd = 0;
+  for(i = 0; i < WINDOW_SIZE/2; i++) {
+    double diff = out[i][0]*out[i][0]+out[i][1]*out[i][1] - sum;
+    sd += diff * diff;
+  }
+  feat->sd = sd / (WINDOW_SIZE/2);
+
+  // bass
+  sum = 0;
+  for(i = 0; i < 60; i++) {
+    sum += out[i][0]*out[i][0]+out[i][1]*out[i][1];
+  }
+  feat->bass = sum / 60;
+
+  // tenor
+  sum = 0;
+  for(i = 60; i < 140; i++) {
+    sum += out[i][0]*out[i][0]+out[i][1]*out[i][1];
+  }
+  feat->tenor = sum / (140-60);
+
+  bands_reduce(feat->bands, out, WINDOW_SIZE);
+
+  chan->stage_time[KSHOW_STAGE_SPECTRUM] += stage_clock() - t0;
+  return 0;
+}
+
+static void kshow_next_hue(struct kshow_chan * chan, float * hue) {
+  *hue += rand_r(&chan->seed)*240.0 + 60.0;
+  *hue = fmod(*hue, 360.0);
+}
+
+void kshow_render(struct kshow_chan * chan, struct kshow_features * feat,
+		  struct kshow_frame * frame) {
+  float short_vol_change = 0, long_vol_change = 0;
+  float sens_beat_light = 0;
+  float insens_beat_light = 0;
+  float supsens_beat_light = 0;
+  double strength = feat->onset ? feat->flux / feat->threshold : 0;
+  double t0 = stage_clock();
+
+  frame->ncmds = 0;
+
+  chan->short_avgvolume = (24 * chan->short_avgvolume + feat->volume) / 25;
+  chan->longer_avgvolume = (49 * chan->longer_avgvolume + feat->volume) / 50;
+  short_vol_change = 0.5+0.5*(feat->volume - chan->short_avgvolume)/chan->short_avgvolume;
+  long_vol_change = 0.5 + 0.5*(feat->volume - chan->longer_avgvolume)/chan->longer_avgvolume;
+
+  set_leits(chan, frame, KSHOW_LONG_VOL, long_vol_change);
+  set_leits(chan, frame, KSHOW_SHORT_VOL, short_vol_change);
+
+  // each trigger keeps its lights on for this window and the next two
+  if(feat->beat) {
+    chan->insens_beat_on_for = 3;
+    kshow_next_hue(chan, &chan->hue1);
+  }
+  if(feat->beat || strength > 1.5) {
+    chan->sens_beat_on_for = 3;
+    kshow_next_hue(chan, &chan->hue2);
+  }
+  if(feat->onset) {
+    chan->supsens_beat_on_for = 3;
+  }
+  if(chan->insens_beat_on_for > 0) {
+    chan->insens_beat_on_for--;
+    insens_beat_light = 1.0;
+  }
+  if(chan->sens_beat_on_for > 0) {
+    chan->sens_beat_on_for--;
+    sens_beat_light = 1.0;
+  }
+  if(chan->supsens_beat_on_for > 0) {
+    chan->supsens_beat_on_for--;
+    supsens_beat_light = 1.0;
+  }
+  set_leits(chan, frame, KSHOW_INSENS_BEAT, insens_beat_light);
+  set_leits(chan, frame, KSHOW_SENS_BEAT, sens_beat_light);
+  if(!insens_beat_light && !sens_beat_light) {
+    set_leits(chan, frame, KSHOW_SUPSENS_BEAT, supsens_beat_light);
+  } else {
+    set_leits(chan, frame, KSHOW_SUPSENS_BEAT, 0);
+  }
+
+  set_hues(chan, frame, KSHOW_HUE1, chan->hue1);
+  set_hues(chan, frame, KSHOW_HUE2, chan->hue2);
+
+  chan->avg_sd = (24 * chan->avg_sd + feat->sd) / 25;
+  set_leits(chan, frame, KSHOW_SD, (feat->sd-1.8*chan->avg_sd+111)/254);
+
+  chan->avg_bass_volume = (24*chan->avg_bass_volume + feat->bass)/25;
+  set_leits(chan, frame, KSHOW_BASS, (feat->bass-1.2*chan->avg_bass_volume+111)/254);
+
+  chan->avg_tenor_volume = (24*chan->avg_tenor_volume + feat->tenor)/25;
+  set_leits(chan, frame, KSHOW_TENOR, (feat->tenor-1.2*chan->avg_tenor_volume+111)/254);
+
+  if(chan->bands_runner) {
+    bands_runner_submit(chan->bands_runner, feat->bands);
+  } else if(chan->bands.nlights > 0 && bands_update(&chan->bands, feat->bands)) {
+    frame_add_bands(chan, frame);
+  }
+
+  chan->stage_time[KSHOW_STAGE_RENDER] += stage_clock() - t0;
+}
+
+void kshow_render_beat(struct kshow_chan * chan, struct kshow_frame * frame) {
+  frame->ncmds = 0;
+  // on for the rest of this window and the next three
+  chan->insens_beat_on_for = 3;
+  chan->sens_beat_on_for = 3;
+  kshow_next_hue(chan, &chan->hue1);
+  kshow_next_hue(chan, &chan->hue2);
+  set_leits(chan, frame, KSHOW_INSENS_BEAT, 1.0);
+  set_leits(chan, frame, KSHOW_SENS_BEAT, 1.0);
+  set_leits(chan, frame, KSHOW_SUPSENS_BEAT, 0);
+  set_hues(chan, frame, KSHOW_HUE1, chan->hue1);
+  set_hues(chan, frame, KSHOW_HUE2, chan->hue2);
+}
+
+int kshow_analyze(struct kshow_chan * chan, struct kshow_frame * frame) {
+  struct kshow_features feat;
+  if(kshow_extract(chan, &feat)) {
+    frame->ncmds = 0;
+    return -1;
+  }
+  kshow_render(chan, &feat, frame);
+  return 0;
+}
+
+static void frame_send(struct kshow_frame * frame, double t) {
+  for(int i = 0; i < frame->ncmds; i++) {
+    struct kshow_cmd * cmd = &frame->cmds[i];
+    switch(cmd->type) {
+    case KSHOW_BRIGHTNESS:
+      if(kshow_out) {
+	fprintf(kshow_out, "%.6f brightness %s %f\n", t, cmd->light->name,
+		cmd->v[0]);
+      } else {
+	sqlights_client_light_brightness(cmd->light, cmd->v[0]);
+      }
+      break;
+    case KSHOW_HSI:
+      if(kshow_out) {
+	fprintf(kshow_out, "%.6f hsi %s %f %f %f\n", t, cmd->light->name,
+		cmd->v[0], cmd->v[1], cmd->v[2]);
+      } else {
+	sqlights_client_light_hsi(cmd->light, cmd->v[0], cmd->v[1], cmd->v[2]);
+      }
+      break;
+    }
+  }
+  if(!kshow_out) {
+    sqlights_client_send_due();
+  }
+}
+
+void kshow_emit(struct kshow_chan * chan, struct kshow_frame * frame,
+		double t) {
+  double t0 = stage_clock();
+  frame_send(frame, t);
+  chan->stage_time[KSHOW_STAGE_EMIT] += stage_clock() - t0;
+}
+
+void kshow_print_timings(FILE * fp, struct kshow_chan * chans, int nchans) {
+  static const char * stage_names[KSHOW_NUM_STAGES] = {
+    "volume", "fft", "onset", "spectrum", "render", "emit"
+  };
+  double stage_time[KSHOW_NUM_STAGES] = {0};
+  double total = 0;
+  long windows = 0;
+  for(int c = 0; c < nchans; c++) {
+    for(int i = 0; i < KSHOW_NUM_STAGES; i++) {
+      stage_time[i] += chans[c].stage_time[i];
+      total += chans[c].stage_time[i];
+    }
+    windows += chans[c].windows;
+  }
+  fprintf(fp, "%ld windows on %d channel(s), %.3f s in pipeline\n",
+	  windows, nchans, total);
+  if(windows == 0) {
+    return;
+  }
+  for(int i = 0; i < KSHOW_NUM_STAGES; i++) {
+    fprintf(fp, " %-9s %9.2f us/window %5.1f%%\n", stage_names[i],
+	    1e6 * stage_time[i] / windows,
+	    total > 0 ? 100 * stage_time[i] / total : 0);
+  }
+}
@@ -0,0 +1,189 @@
+// analyze.h
+// kshow's analysis pipeline, shared by the JACK front end (fft.c) and
+// the offline file front end (offline.c).  A window of samples goes
+// in, a frame of light commands comes out.  Each input channel has
+// its own pipeline state and its own mapping of features to lights.
+// Besides the fixed groups, a channel can drive any number of lights
+// with the adaptive-threshold band engine of bands.h.
+
+#ifndef _kshow_analyze_h
+#define _kshow_analyze_h
+
+#include <stdio.h>
+#include <fftw3.h>
+#include "protocol.h"
+#include "onset.h"
+#include "bands.h"
+
+#define WINDOW_SIZE 2048
+#define KSHOW_MAX_CHANNELS 16
+#define KSHOW_GROUP_MAX 8   // lights per group per channel
+#define KSHOW_BANDS_MAX 512 // band engine lights per channel
+
+// groups of lights driven by one feature of the analysis
+enum kshow_group_e {
+  KSHOW_LONG_VOL = 0,
+  KSHOW_SHORT_VOL,
+  KSHOW_INSENS_BEAT,
+  KSHOW_SENS_BEAT,
+  KSHOW_SUPSENS_BEAT,
+  KSHOW_SD,
+  KSHOW_BASS,
+  KSHOW_TENOR,
+  KSHOW_HUE1,         // colored lights, hue changes on beats
+  KSHOW_HUE2,         // colored lights, hue changes on sensitive beats
+  KSHOW_NUM_GROUPS
+};
+
+#define KSHOW_MAX_CMDS (KSHOW_NUM_GROUPS * KSHOW_GROUP_MAX + KSHOW_BANDS_MAX)
+
+// a light driven by the band engine; band < 0 means the default
+struct kshow_band_light {
+  char * name;
+  sq_client_light_t * light;
+  int band;
+  float turn_off_decays;
+  float target_triggers;
+};
+
+struct kshow_map {
+  int n[KSHOW_NUM_GROUPS];
+  char * names[KSHOW_NUM_GROUPS][KSHOW_GROUP_MAX];
+  // opened from the names by kshow_chan_init()
+  sq_client_light_t * lights[KSHOW_NUM_GROUPS][KSHOW_GROUP_MAX];
+  int nband_lights;
+  struct kshow_band_light * band_lights;
+};
+
+enum kshow_cmd_e {
+  KSHOW_BRIGHTNESS = 1,
+  KSHOW_HSI
+};
+
+struct kshow_cmd {
+  sq_client_light_t * light;
+  int type;
+  float v[3];
+};
+
+// all the light commands produced by one analysis window
+struct kshow_frame {
+  int ncmds;
+  struct kshow_cmd cmds[KSHOW_MAX_CMDS];
+};
+
+// what the DSP half of the pipeline extracts from one window; the
+// other half turns these into light commands.
+struct kshow_features {
+  double volume;      // peak sample
+  double flux;        // onset detection function
+  double threshold;   // adaptive onset threshold
+  double sd;          // spread of the power spectrum
+  double bass;        // mean power in bins 0-59
+  double tenor;       // mean power in bins 60-139
+  double band_energy[ONSET_BANDS];
+  unsigned char bands[BANDS_NUM]; // input to the band engine
+  int onset;         // flux crossed the threshold
+  int beat;          // a predicted beat should be fired now
+};
+
+enum kshow_stage_e {
+  KSHOW_STAGE_VOLUME = 0, // volume following
+  KSHOW_STAGE_FFT,        // fftw_execute
+  KSHOW_STAGE_ONSET,      // onset detection and beat tracking
+  KSHOW_STAGE_SPECTRUM,   // sd, bass and tenor bands
+  KSHOW_STAGE_RENDER,     // features to light commands
+  KSHOW_STAGE_EMIT,       // sending (or writing) the light commands
+  KSHOW_NUM_STAGES
+};
+
+// one channel's pipeline
+struct kshow_chan {
+  int index;
+  int rate;
+  struct kshow_map * map;
+
+  double * in;            // input window; fill WINDOW_SIZE samples
+  fftw_complex * out;
+  fftw_plan plan;
+  struct onset_state onsets;
+  unsigned int seed;      // for rand_r, so channels are independent
+
+  // running state
+  double avg_sd;
+  double short_avgvolume;
+  double longer_avgvolume;
+  double avg_bass_volume;
+  double avg_tenor_volume;
+  int sens_beat_on_for;
+  int insens_beat_on_for;
+  int supsens_beat_on_for;
+  float hue1, hue2;
+  struct bands_state bands;
+  struct bands_runner * bands_runner; // if the band engine has a thread
+  struct kshow_frame * bands_frame;   // used by that thread
+
+  // accumulated per-stage time, in seconds, and number of windows seen
+  double stage_time[KSHOW_NUM_STAGES];
+  long windows;
+};
+
+// seconds between sending a light command and the light reacting;
+// predicted beats are sent this far ahead.
+extern double kshow_latency;
+
+// if kshow_epsilon is 0 or more, light updates which change by no more
+// than it aren't sent; if kshow_max_rate is above 0, no light is sent
+// more than that many updates a second.  Set before kshow_chan_init().
+extern float kshow_epsilon;
+extern float kshow_max_rate;
+
+// the built-in single channel mapping
+extern struct kshow_map kshow_default_map;
+
+// loads "channel group lightname" lines into maps[0..nchans-1].  Lines
+// of the "bands" group may add "band turn_off_decays target_triggers"
+// for the band engine.  Returns 0 on success, -1 on error.
+int kshow_load_map(char * filename, struct kshow_map * maps, int nchans);
+
+// sets up the fft buffers and plan for input at rate Hz
+void kshow_chan_init(struct kshow_chan * chan, int index, int rate,
+		     struct kshow_map * map, unsigned int seed);
+
+// runs chan's band engine on its own thread, sending its changes as
+// they come instead of adding them to the frames.  Returns 0 on success.
+int kshow_chan_bands_thread(struct kshow_chan * chan);
+
+// stream time, in seconds, at the start of the next window
+double kshow_time(struct kshow_chan * chan);
+
+// analyzes the current window in chan->in, filling frame.  Returns 0
+// if the frame should be emitted, -1 if the window was silence.
+// Equivalent to kshow_extract() followed by kshow_render().
+int kshow_analyze(struct kshow_chan * chan, struct kshow_frame * frame);
+
+// the DSP half: fills feat from chan->in.  Returns -1 if the window
+// was silence, in which case feat is only partially filled.
+int kshow_extract(struct kshow_chan * chan, struct kshow_features * feat);
+
+// the mapping half: turns one window's features into light commands.
+void kshow_render(struct kshow_chan * chan, struct kshow_features * feat,
+		  struct kshow_frame * frame);
+
+// fires a beat between windows, for players which know exactly when
+// the beats are.  The beat lights then stay on as for a rendered beat.
+void kshow_render_beat(struct kshow_chan * chan, struct kshow_frame * frame);
+
+// sends the frame to the router, or writes it to the output file if
+// one was set with kshow_set_output().  t is the stream time in
+// seconds, only used for file output.  Emit time is charged to chan.
+void kshow_emit(struct kshow_chan * chan, struct kshow_frame * frame,
+		double t);
+
+// if fp is non-NULL, light commands are written to it as text instead
+// of being sent to the router.
+void kshow_set_output(FILE * fp);
+
+void kshow_print_timings(FILE * fp, struct kshow_chan * chans, int nchans);
+
+#endif
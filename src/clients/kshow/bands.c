@@ -0,0 +1,214 @@
+// bands.c
+// implementation of bands.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "bands.h"
+
+// band edges of xmms' 256 bin spectrum analyzer
+static const int xscale[BANDS_NUM + 1] = {
+  0, 1, 2, 3, 5, 7, 10, 14, 20, 28, 40, 54, 74, 101, 137, 187, 255
+};
+
+void bands_reduce(unsigned char * values, fftw_complex * spectrum,
+		  int window_size) {
+  double scale = (window_size / 2) / 256.0;
+  for(int b = 0; b < BANDS_NUM; b++) {
+    int lo = (int)(xscale[b] * scale);
+    int hi = (int)(xscale[b+1] * scale);
+    double peak = 0;
+    if(hi <= lo) {
+      hi = lo + 1;
+    }
+    for(int i = lo; i < hi; i++) {
+      double m = spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1];
+      peak = m > peak ? m : peak;
+    }
+    // a full scale sine comes out at 32768, like the plugin's 16 bit data
+    int y = (int)(sqrt(peak) * 65536.0 / window_size) >> 7;
+    if(y != 0) {
+      y = (int)(log(y) * (256 / log(256)));
+      if(y > 255) {
+	y = 255;
+      }
+    }
+    values[b] = y;
+  }
+}
+
+int bands_init(struct bands_state * st, int nlights, unsigned int seed) {
+  memset(st, 0, sizeof(*st));
+  st->nlights = nlights;
+  st->seed = seed;
+  st->band = calloc(nlights, sizeof(int));
+  st->threshold = calloc(nlights, sizeof(float));
+  st->intensity = calloc(nlights, sizeof(float));
+  st->turn_off_decays = calloc(nlights, sizeof(float));
+  st->num_decays = calloc(nlights, sizeof(float));
+  st->num_triggers = calloc(nlights, sizeof(float));
+  st->target_triggers = calloc(nlights, sizeof(float));
+  st->changed = calloc(nlights, 1);
+  if(!st->band || !st->threshold || !st->intensity || !st->turn_off_decays
+     || !st->num_decays || !st->num_triggers || !st->target_triggers
+     || !st->changed) {
+    return -1;
+  }
+  for(int i = 0; i < nlights; i++) {
+    st->band[i] = i % BANDS_NUM;
+    st->threshold[i] = BANDS_DEFAULT_THRESHOLD;
+    st->turn_off_decays[i] = BANDS_DEFAULT_DECAYS;
+    st->target_triggers[i] = BANDS_DEFAULT_TRIGGERS;
+  }
+  return 0;
+}
+
+// picks a semi-random band, with a greater probability of picking one
+// that has recently been loud
+static int freq_weighted_random_band(struct bands_state * st) {
+  int sorted_bands[BANDS_NUM];
+  double avg[BANDS_NUM];
+  memcpy(avg, st->avg_values, sizeof(avg));
+  for(int i = 0; i < BANDS_NUM; i++) {
+    int max_loc = 0;
+    for(int j = 0; j < BANDS_NUM; j++) {
+      if(avg[j] >= avg[max_loc]) max_loc = j;
+    }
+    avg[max_loc] = -1;
+    sorted_bands[i] = max_loc;
+  }
+
+  double x = ((double)rand_r(&st->seed) / ((double)RAND_MAX + 1)) * 256.0;
+  int y = pow(2, (x/64.0)) - 1;
+  return sorted_bands[y];
+}
+
+// Lights turn on when their band's change goes over threshold and off
+// after staying under it for long enough; busier music (a smaller
+// decay_scale) turns them off sooner.  Written without branches, and
+// with every array passed in as restrict, so that it vectorizes; gcc
+// won't if-convert the float compares unless it may assume they don't
+// trap, which they can't here.
+__attribute__((optimize("no-trapping-math")))
+static int bands_step(int n, const float * restrict differences,
+		      const int * restrict band,
+		      const float * restrict threshold,
+		      float * restrict intensity,
+		      const float * restrict turn_off_decays,
+		      float * restrict num_decays,
+		      float * restrict num_triggers,
+		      unsigned char * restrict changed,
+		      float decay_scale) {
+  int nchanged = 0;
+  for(int i = 0; i < n; i++) {
+    float d = differences[band[i]];
+    int on = intensity[i] > 0;
+    int over = d > threshold[i];
+    int under = d < threshold[i];
+    int patient = num_decays[i] < turn_off_decays[i] * decay_scale;
+    int trigger = (!on) & over;
+    int decaying = on & under & patient;
+    int off = on & under & (!patient);
+    int flip = trigger | off;
+    // a trigger only happens to a light which is off
+    num_decays[i] = (num_decays[i] + decaying) * !flip;
+    intensity[i] = intensity[i] * !off + trigger;
+    num_triggers[i] += trigger;
+    changed[i] = flip;
+    nchanged += flip;
+  }
+  return nchanged;
+}
+
+int bands_update(struct bands_state * st, unsigned char * values) {
+  int n = st->nlights;
+  int i;
+  double difference_sum = 0;
+
+  for(i = 0; i < BANDS_NUM; i++) {
+    st->differences[i] = abs(st->prev_values[i] - values[i]);
+    st->prev_values[i] = values[i];
+    difference_sum += st->differences[i];
+    st->avg_values[i] += values[i] / (double)BANDS_RESET_FRAMES;
+  }
+  st->running_avg_difference = 0.99 * st->running_avg_difference
+    + 0.01 * difference_sum;
+
+  int nchanged = bands_step(st->nlights, st->differences, st->band,
+			    st->threshold, st->intensity, st->turn_off_decays,
+			    st->num_decays, st->num_triggers, st->changed,
+			    (400.0 - st->running_avg_difference) / 300.0);
+
+  if(++st->frames < BANDS_RESET_FRAMES) {
+    return nchanged;
+  }
+  st->frames = 0;
+
+  // lower the thresholds of lights which weren't active enough, raise
+  // the rest
+  float trigger_scale = st->running_avg_difference / 300.0;
+  float * restrict threshold = st->threshold;
+  float * restrict num_triggers = st->num_triggers;
+  float * restrict target_triggers = st->target_triggers;
+  for(i = 0; i < n; i++) {
+    float t = threshold[i]
+      + (num_triggers[i] < target_triggers[i] * trigger_scale ? -5 : 5);
+    threshold[i] = t < 1 ? 1 : t > 255 ? 255 : t;
+    num_triggers[i] = 0;
+  }
+
+  // every so often, move a light to a different band
+  if(n > 0) {
+    int light = ((double)rand_r(&st->seed) / ((double)RAND_MAX + 1)) * n;
+    st->band[light] = freq_weighted_random_band(st);
+  }
+  memset(st->avg_values, 0, sizeof(st->avg_values));
+  return nchanged;
+}
+
+static void * bands_runner_thread(void * arg) {
+  struct bands_runner * r = arg;
+  unsigned char values[BANDS_NUM];
+
+  pthread_mutex_lock(&r->lock);
+  while(1) {
+    while(!r->pending) {
+      pthread_cond_wait(&r->wake, &r->lock);
+    }
+    memcpy(values, r->values, sizeof(values));
+    pthread_mutex_unlock(&r->lock);
+
+    if(bands_update(r->st, values) > 0) {
+      r->changed(r->st, r->arg);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->pending = 0;
+  }
+  return NULL;
+}
+
+int bands_runner_start(struct bands_runner * r, struct bands_state * st,
+		       void (*changed)(struct bands_state *, void *),
+		       void * arg) {
+  memset(r, 0, sizeof(*r));
+  r->st = st;
+  r->changed = changed;
+  r->arg = arg;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  return pthread_create(&r->thread, NULL, bands_runner_thread, r) ? -1 : 0;
+}
+
+void bands_runner_submit(struct bands_runner * r, unsigned char * values) {
+  pthread_mutex_lock(&r->lock);
+  if(r->pending) {
+    r->dropped++;
+  } else {
+    memcpy(r->values, values, sizeof(r->values));
+    r->pending = 1;
+    pthread_cond_signal(&r->wake);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,90 @@
+// bands.h
+// Adaptive-threshold light triggering, ported from the 23lights xmms
+// plugin (old/plugin-main.c).  The spectrum is reduced to BANDS_NUM
+// log-spaced bands; each light follows one band and turns on when the
+// frame-to-frame change in that band exceeds the light's threshold, then
+// turns off once the change has stayed below it for a while.  Every
+// BANDS_RESET_FRAMES frames each light's threshold is nudged towards
+// its target number of triggers, and one light is moved to a band
+// picked at random, weighted towards the bands that have been loudest.
+//
+// Per-light state is kept as parallel arrays rather than an array of
+// structs, so that the per-frame update is one straight loop over the
+// lights which the compiler can vectorize.
+
+#ifndef _kshow_bands_h
+#define _kshow_bands_h
+
+#include <pthread.h>
+#include <fftw3.h>
+
+#define BANDS_NUM 16
+#define BANDS_RESET_FRAMES 150
+
+// per-light defaults, as in the plugin
+#define BANDS_DEFAULT_THRESHOLD 30
+#define BANDS_DEFAULT_DECAYS 18
+#define BANDS_DEFAULT_TRIGGERS 3
+
+struct bands_state {
+  int nlights;
+
+  // per light
+  int * band;              // band the light follows, 0 (lowest) to 15
+  float * threshold;       // change needed to turn on, 1 to 255
+  float * intensity;       // 0 off, 1 on
+  float * turn_off_decays; // frames below threshold before turning off
+  float * num_decays;      // frames below threshold so far
+  float * num_triggers;    // triggers since the last reset
+  float * target_triggers; // wanted triggers per reset period
+  unsigned char * changed; // set by bands_update() if intensity changed
+
+  // per band
+  float differences[BANDS_NUM];
+  int prev_values[BANDS_NUM];
+  double avg_values[BANDS_NUM];
+
+  double running_avg_difference; // how busy the music is
+  int frames;
+  unsigned int seed;
+};
+
+// reduces an r2c spectrum of window_size samples to BANDS_NUM values
+// of 0-255, like xmms' 16 band spectrum analyzer
+void bands_reduce(unsigned char * values, fftw_complex * spectrum,
+		  int window_size);
+
+// allocates state for nlights lights with the plugin's defaults, light
+// i following band i % BANDS_NUM.  Returns 0 on success.
+int bands_init(struct bands_state * st, int nlights, unsigned int seed);
+
+// runs one frame.  Returns the number of lights whose intensity changed;
+// those have st->changed[i] set.
+int bands_update(struct bands_state * st, unsigned char * values);
+
+// runs bands_update() on its own thread, for callers which mustn't wait
+// for hundreds of lights to be updated.
+struct bands_runner {
+  struct bands_state * st;
+  void (*changed)(struct bands_state * st, void * arg);
+  void * arg;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int pending;
+  unsigned char values[BANDS_NUM];
+  long dropped;
+};
+
+// starts the thread; changed(st, arg) is called on it after each frame
+// in which some light changed.  Returns 0 on success.
+int bands_runner_start(struct bands_runner * r, struct bands_state * st,
+		       void (*changed)(struct bands_state *, void *),
+		       void * arg);
+
+// hands a frame to the thread.  Never waits for the update: if the
+// previous frame hasn't been picked up yet this one is dropped.
+void bands_runner_submit(struct bands_runner * r, unsigned char * values);
+
+#endif
@@ -0,0 +1,201 @@
+// cache.c
+// implementation of cache.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+// beats closer together than this are the same beat found twice
+#define CACHE_MIN_BEAT_GAP 0.1
+
+int kshow_cache_open(struct kshow_cache * cache, char * filename) {
+  struct stat st;
+  int fd;
+
+  memset(cache, 0, sizeof(*cache));
+  if((fd = open(filename, O_RDONLY)) < 0) {
+    perror(filename);
+    return -1;
+  }
+  if(fstat(fd, &st) < 0) {
+    perror(filename);
+    close(fd);
+    return -1;
+  }
+  if(st.st_size < sizeof(struct kshow_cache_header)) {
+    fprintf(stderr, "%s: not a kshow cache file\n", filename);
+    close(fd);
+    return -1;
+  }
+  cache->len = st.st_size;
+  cache->base = mmap(NULL, cache->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(cache->base == MAP_FAILED) {
+    perror(filename);
+    cache->base = NULL;
+    return -1;
+  }
+  // the whole file is read during the show; fault it in now
+  madvise(cache->base, cache->len, MADV_WILLNEED);
+
+  struct kshow_cache_header * hdr = cache->base;
+  if(memcmp(hdr->magic, KSHOW_CACHE_MAGIC, sizeof(hdr->magic))) {
+    fprintf(stderr, "%s: not a kshow cache file\n", filename);
+    goto fail;
+  }
+  if(hdr->version != KSHOW_CACHE_VERSION || hdr->nbands != ONSET_BANDS
+     || hdr->hop_size == 0 || hdr->rate == 0) {
+    fprintf(stderr, "%s: cache version %u with %u bands is not supported\n",
+	    filename, hdr->version, hdr->nbands);
+    goto fail;
+  }
+  // each count against what's left, so a corrupt one can't wrap the sum
+  size_t room = cache->len - sizeof(*hdr);
+  if(hdr->nhops > room / sizeof(struct kshow_cache_hop)
+     || hdr->nbeats > (room - hdr->nhops * sizeof(struct kshow_cache_hop))
+     / sizeof(double)) {
+    fprintf(stderr, "%s: truncated\n", filename);
+    goto fail;
+  }
+  cache->hdr = hdr;
+  cache->hops = (struct kshow_cache_hop *)(hdr + 1);
+  cache->beats = (double *)(cache->hops + hdr->nhops);
+  cache->hop = (double)hdr->hop_size / hdr->rate;
+  return 0;
+
+ fail:
+  kshow_cache_close(cache);
+  return -1;
+}
+
+void kshow_cache_close(struct kshow_cache * cache) {
+  if(cache->base != NULL) {
+    munmap(cache->base, cache->len);
+  }
+  memset(cache, 0, sizeof(*cache));
+}
+
+int kshow_cache_features(struct kshow_cache * cache, long i,
+			 struct kshow_features * feat) {
+  struct kshow_cache_hop * hop = &cache->hops[i];
+  feat->volume = hop->volume;
+  feat->flux = hop->flux;
+  feat->threshold = hop->threshold;
+  feat->sd = hop->sd;
+  feat->bass = hop->bass;
+  feat->tenor = hop->tenor;
+  for(int b = 0; b < ONSET_BANDS; b++) {
+    feat->band_energy[b] = hop->band_energy[b];
+  }
+  memcpy(feat->bands, hop->bands, sizeof(feat->bands));
+  feat->onset = (hop->flags & KSHOW_HOP_ONSET) != 0;
+  feat->beat = 0;
+  return hop->flags & KSHOW_HOP_SILENT ? -1 : 0;
+}
+
+long kshow_cache_beat_after(struct kshow_cache * cache, double t) {
+  long lo = 0, hi = cache->hdr->nbeats;
+  while(lo < hi) {
+    long mid = (lo + hi) / 2;
+    if(cache->beats[mid] < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+int kshow_cache_create(struct kshow_cache_writer * w, char * filename, int rate) {
+  memset(w, 0, sizeof(*w));
+  if(NULL == (w->fp = fopen(filename, "wb"))) {
+    perror(filename);
+    return -1;
+  }
+  memcpy(w->hdr.magic, KSHOW_CACHE_MAGIC, sizeof(w->hdr.magic));
+  w->hdr.version = KSHOW_CACHE_VERSION;
+  w->hdr.rate = rate;
+  w->hdr.hop_size = WINDOW_SIZE;
+  w->hdr.nbands = ONSET_BANDS;
+  // rewritten by kshow_cache_finish() once the counts are known
+  fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp);
+  return 0;
+}
+
+void kshow_cache_add_hop(struct kshow_cache_writer * w,
+			 struct kshow_features * feat, int silent) {
+  struct kshow_cache_hop hop;
+  memset(&hop, 0, sizeof(hop));
+  hop.volume = feat->volume;
+  if(silent) {
+    hop.flags = KSHOW_HOP_SILENT;
+  } else {
+    hop.flux = feat->flux;
+    hop.threshold = feat->threshold;
+    hop.sd = feat->sd;
+    hop.bass = feat->bass;
+    hop.tenor = feat->tenor;
+    for(int b = 0; b < ONSET_BANDS; b++) {
+      hop.band_energy[b] = feat->band_energy[b];
+    }
+    memcpy(hop.bands, feat->bands, sizeof(hop.bands));
+    hop.flags = feat->onset ? KSHOW_HOP_ONSET : 0;
+  }
+  fwrite(&hop, sizeof(hop), 1, w->fp);
+  w->hdr.nhops++;
+}
+
+void kshow_cache_add_beat(struct kshow_cache_writer * w, double t) {
+  if(w->hdr.nbeats == w->beats_size) {
+    w->beats_size = w->beats_size ? 2 * w->beats_size : 256;
+    w->beats = realloc(w->beats, w->beats_size * sizeof(double));
+    if(w->beats == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  w->beats[w->hdr.nbeats++] = t;
+}
+
+static int cmp_double(const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int kshow_cache_finish(struct kshow_cache_writer * w, double bpm) {
+  size_t i, n = 0;
+  int ret = 0;
+
+  // beats arrive in order of confirmation, not quite in order of time
+  if(w->hdr.nbeats > 0) {
+    qsort(w->beats, w->hdr.nbeats, sizeof(double), cmp_double);
+    n = 1;
+    for(i = 1; i < w->hdr.nbeats; i++) {
+      if(w->beats[i] - w->beats[n-1] >= CACHE_MIN_BEAT_GAP) {
+	w->beats[n++] = w->beats[i];
+      }
+    }
+  }
+  w->hdr.nbeats = n;
+  w->hdr.bpm = bpm;
+
+  if(fwrite(w->beats, sizeof(double), n, w->fp) != n
+     || fseek(w->fp, 0, SEEK_SET)
+     || fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp) != 1) {
+    perror("writing cache");
+    ret = -1;
+  }
+  if(fclose(w->fp)) {
+    perror("writing cache");
+    ret = -1;
+  }
+  free(w->beats);
+  w->beats = NULL;
+  w->fp = NULL;
+  return ret;
+}
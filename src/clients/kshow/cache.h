@@ -0,0 +1,90 @@
+// cache.h
+// Precomputed kshow analysis.  A track is analyzed once, offline, into
+// a compact timeline of per-window features plus the beat times the
+// tracker settled on.  At show time the file is memory-mapped and
+// played back against a playhead, so no DSP runs during the show and
+// beats are fired at their known times rather than predicted ones.
+//
+// File layout, in native byte order like the network protocol:
+//   struct kshow_cache_header
+//   struct kshow_cache_hop  hops[nhops]    one per window, silent or not
+//   double                  beats[nbeats]  seconds, ascending
+
+#ifndef _kshow_cache_h
+#define _kshow_cache_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "analyze.h"
+
+#define KSHOW_CACHE_MAGIC "kshowfc"
+#define KSHOW_CACHE_VERSION 2
+
+// kshow_cache_hop.flags
+#define KSHOW_HOP_SILENT 1
+#define KSHOW_HOP_ONSET  2
+
+struct kshow_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rate;       // sample rate of the analyzed audio
+  uint32_t hop_size;   // samples per window
+  uint32_t nbands;     // ONSET_BANDS when written
+  uint64_t nhops;
+  uint64_t nbeats;
+  double bpm;          // tempo estimate at the end of the track
+};
+
+struct kshow_cache_hop {
+  float volume;
+  float flux;
+  float threshold;
+  float sd;
+  float bass;
+  float tenor;
+  float band_energy[ONSET_BANDS];
+  uint8_t bands[BANDS_NUM]; // band engine input
+  uint32_t flags;
+};
+
+// a mapped cache file
+struct kshow_cache {
+  void * base;
+  size_t len;
+  struct kshow_cache_header * hdr;
+  struct kshow_cache_hop * hops;
+  double * beats;
+  double hop;          // seconds per window
+};
+
+// builds a cache file while the track is analyzed
+struct kshow_cache_writer {
+  FILE * fp;
+  struct kshow_cache_header hdr;
+  double * beats;
+  size_t beats_size;
+};
+
+// maps filename read-only.  Returns 0 on success, -1 on error (with a
+// message on stderr).
+int kshow_cache_open(struct kshow_cache * cache, char * filename);
+void kshow_cache_close(struct kshow_cache * cache);
+
+// unpacks hop i into feat, with feat->beat clear.  Returns -1 if the
+// window was silence.
+int kshow_cache_features(struct kshow_cache * cache, long i,
+			 struct kshow_features * feat);
+
+// index of the first beat at or after t
+long kshow_cache_beat_after(struct kshow_cache * cache, double t);
+
+int kshow_cache_create(struct kshow_cache_writer * w, char * filename, int rate);
+// feat may be partially filled if silent is set, as from kshow_extract()
+void kshow_cache_add_hop(struct kshow_cache_writer * w,
+			 struct kshow_features * feat, int silent);
+void kshow_cache_add_beat(struct kshow_cache_writer * w, double t);
+// writes the beat table and the final header.  Returns 0 on success.
+int kshow_cache_finish(struct kshow_cache_writer * w, double bpm);
+
+#endif
@@ -0,0 +1,294 @@
+/* kshowcache: precomputes kshow's analysis of a track and plays it
+   back.  "build" runs the DSP half of the pipeline over a WAV file and
+   writes the per-window features and beat times to a cache file;
+   "play" maps a cache file and sends the light frames to a router in
+   time with a playhead, firing each beat exactly on time.  The playhead
+   is its own clock unless it's told to follow a player's, as cuesync
+   does: then it seeks when the player does, waits while it's stopped
+   and keeps to it as the two clocks drift. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include "protocol.h"
+#include "playhead.h"
+#include "analyze.h"
+#include "cache.h"
+#include "wav.h"
+
+void print_usage(char * prgname) {
+  printf("usage: %s build [options] (file.wav | file.raw | -) (out.kfc)\n"
+	 "\t-c (channel)\tanalyze this channel of the input (default 0)\n"
+	 "\t-R (rate)\tinput is raw s16le PCM at this sample rate\n"
+	 "\t-n (channels)\tchannels in raw input (default 1)\n"
+	 "       %s play [options] (file.kfc)\n"
+	 "\t-r (host)\tsend light commands to the router on host\n"
+	 "\t-o (file)\twrite light commands to file (\"-\" for stdout)\n"
+	 "\t\t\tas fast as possible instead\n"
+	 "\t-m (file)\tlight mapping for channel 0, as for kshow -c\n"
+	 "\t-s (seconds)\tstart the playhead this far into the track\n"
+	 "\t-O [port]\tfollow OSC /time messages instead (port %s)\n"
+	 "\t-j\t\tfollow the JACK transport instead\n"
+	 "\t-c (file)\tfollow a file holding [track] seconds [rolling]\n"
+	 "\t\t\tinstead\n"
+	 "\t-J (ms)\t\twhen following, a jump bigger than this is a seek\n"
+	 "\t\t\t(default 250)\n"
+	 "\t-l (ms)\t\tlatency to send frames ahead by (default 40)\n"
+	 "\t-S (seed)\tseed for the hue randomizer (default 0)\n",
+	 prgname, prgname, SQ_PLAYHEAD_OSC_PORT);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double t) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)t;
+  ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
+
+// how often to look at a followed playhead, in s
+#define FOLLOW_POLL 0.01
+// how much of the way towards a followed playhead to move each look,
+// so that its jitter is smoothed over but drift is kept up with
+#define FOLLOW_EASE 0.1
+
+// the first window and beat due to be sent at or after pos
+static void seek(struct kshow_cache * cache, double pos, long * hi, long * bi) {
+  long nhops = cache->hdr->nhops;
+  *hi = (long)((pos + kshow_latency) / cache->hop - 0.5);
+  if(*hi < 0) {
+    *hi = 0;
+  }
+  while(*hi < nhops && (*hi + 0.5) * cache->hop - kshow_latency < pos) {
+    (*hi)++;
+  }
+  *bi = kshow_cache_beat_after(cache, pos + kshow_latency);
+}
+
+// keeps start, where the track began on our clock, on the followed
+// playhead: waits while the player's stopped, seeks if it's jumped, and
+// otherwise eases towards it
+static void follow(struct kshow_cache * cache, double jump, double * start,
+		   long * hi, long * bi) {
+  struct sq_playhead ph;
+  sq_playhead_read(&ph, sqlights_time());
+  while(!ph.known || !ph.rolling) {
+    sleep_until(now() + FOLLOW_POLL);
+    sq_playhead_read(&ph, sqlights_time());
+  }
+  double pos = ph.pos * 1e-9;
+  double off = now() - pos - *start;
+  if(!(fabs(off) <= jump)) {
+    // including the first look, start being NAN until then
+    *start = now() - pos;
+    seek(cache, pos, hi, bi);
+  } else {
+    *start += off * FOLLOW_EASE;
+  }
+}
+
+int build(int argc, char ** argv) {
+  int channel = 0;
+  int raw_rate = 0;
+  int raw_channels = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:R:n:h")) != -1) {
+    switch(opt) {
+    case 'c': channel = atoi(optarg); break;
+    case 'R': raw_rate = atoi(optarg); break;
+    case 'n': raw_channels = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind + 2 != argc || raw_channels < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct wav_file wav;
+  if(raw_rate > 0) {
+    if(wav_open_raw(&wav, argv[optind], WAV_S16, raw_channels, raw_rate)) {
+      return 1;
+    }
+  } else if(wav_open(&wav, argv[optind])) {
+    return 1;
+  }
+
+  struct kshow_cache_writer w;
+  if(kshow_cache_create(&w, argv[optind+1], wav.rate)) {
+    return 1;
+  }
+
+  // the features don't depend on the mapping, only the rendering does
+  static struct kshow_chan chan;
+  struct kshow_features feat;
+  kshow_chan_init(&chan, 0, wav.rate, &kshow_default_map, 0);
+  double start = now();
+  while(wav_read(&wav, &chan.in, &channel, 1, WINDOW_SIZE) == WINDOW_SIZE) {
+    struct onset_state * onsets = &chan.onsets;
+    int silent = kshow_extract(&chan, &feat) != 0;
+    kshow_cache_add_hop(&w, &feat, silent);
+    if(silent) {
+      continue;
+    }
+    // with the whole track at hand, beats are stored where they were
+    // confirmed instead of where they were predicted
+    if(onsets->beat_passed) {
+      kshow_cache_add_beat(&w, onsets->passed_beat);
+    }
+    if(feat.beat && onsets->confidence < 0.5) {
+      kshow_cache_add_beat(&w, onsets->now - 0.5 * onsets->hop);
+    }
+  }
+  wav_close(&wav);
+
+  long nhops = w.hdr.nhops;
+  if(kshow_cache_finish(&w, onset_bpm(&chan.onsets))) {
+    return 1;
+  }
+  fprintf(stderr, "%ld windows, %llu beats at %.1f bpm in %.3f s\n", nhops,
+	  (unsigned long long)w.hdr.nbeats, w.hdr.bpm, now() - start);
+  return 0;
+}
+
+int play(int argc, char ** argv) {
+  char * outname = NULL;
+  char * hostname = NULL;
+  char * mapfile = NULL;
+  double offset = 0, jump_ms = 250;
+  unsigned int seed = 0;
+  int source = 0;
+  char * source_arg = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "r:o:m:s:O::jc:J:l:S:h")) != -1) {
+    switch(opt) {
+    case 'r': hostname = optarg; break;
+    case 'o': outname = optarg; break;
+    case 'm': mapfile = optarg; break;
+    case 's': offset = atof(optarg); break;
+    case 'O': source = SQ_PLAYHEAD_OSC; source_arg = optarg; break;
+    case 'j': source = SQ_PLAYHEAD_JACK; source_arg = "kshowcache"; break;
+    case 'c': source = SQ_PLAYHEAD_FILE; source_arg = optarg; break;
+    case 'J': jump_ms = atof(optarg); break;
+    case 'l': kshow_latency = atof(optarg) / 1000.0; break;
+    case 'S': seed = strtoul(optarg, NULL, 0); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind + 1 != argc || (outname == NULL) == (hostname == NULL)
+     || (source && outname) || jump_ms < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct kshow_cache cache;
+  if(kshow_cache_open(&cache, argv[optind])) {
+    return 1;
+  }
+
+  FILE * out_fp = NULL;
+  if(hostname) {
+    sqlights_client_initialize(hostname);
+    if(source && sq_playhead_open(source, source_arg, 0)) {
+      return 1;
+    }
+  } else {
+    if(strcmp(outname, "-") == 0) {
+      out_fp = stdout;
+    } else if(NULL == (out_fp = fopen(outname, "w"))) {
+      dieperr(outname);
+    }
+    kshow_set_output(out_fp);
+  }
+
+  static struct kshow_map map;
+  static struct kshow_chan chan;
+  static struct kshow_frame frame;
+  struct kshow_features feat;
+  if(mapfile) {
+    if(kshow_load_map(mapfile, &map, 1)) {
+      return 1;
+    }
+  } else {
+    map = kshow_default_map;
+  }
+  kshow_chan_init(&chan, 0, cache.hdr->rate, &map, seed);
+
+  // window i is centred on (i + 0.5) * hop in the track; it and each
+  // beat are sent kshow_latency early so they land on time.
+  // Following a player, the start is wherever it turns out to be, and
+  // it carries on past the end in case the player goes back.
+  long nhops = cache.hdr->nhops;
+  long hi, bi;
+  seek(&cache, offset, &hi, &bi);
+
+  double start = now() - offset;
+  if(source) {
+    start = NAN;
+  }
+  while(source || hi < nhops) {
+    if(source) {
+      follow(&cache, jump_ms / 1000.0, &start, &hi, &bi);
+      if(hi >= nhops) {
+	// played out here, but the player may yet go back
+	sleep_until(now() + FOLLOW_POLL);
+	continue;
+      }
+    }
+    double th = (hi + 0.5) * cache.hop - kshow_latency;
+    double tb = bi < cache.hdr->nbeats ? cache.beats[bi] - kshow_latency : th + 1;
+    double t = tb < th ? tb : th;
+    if(source && start + t > now() + FOLLOW_POLL) {
+      // not due before the next look at the player
+      sleep_until(now() + FOLLOW_POLL);
+      continue;
+    }
+    if(out_fp == NULL) {
+      sleep_until(start + t);
+    }
+    if(tb < th) {
+      kshow_render_beat(&chan, &frame);
+      bi++;
+    } else {
+      if(kshow_cache_features(&cache, hi++, &feat)) {
+	continue;
+      }
+      kshow_render(&chan, &feat, &frame);
+    }
+    kshow_emit(&chan, &frame, t);
+  }
+
+  kshow_cache_close(&cache);
+  if(out_fp != NULL && out_fp != stdout) {
+    fclose(out_fp);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc >= 2 && strcmp(argv[1], "build") == 0) {
+    argv[1] = argv[0];
+    return build(argc - 1, argv + 1);
+  }
+  if(argc >= 2 && strcmp(argv[1], "play") == 0) {
+    argv[1] = argv[0];
+    return play(argc - 1, argv + 1);
+  }
+  print_usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,172 @@
+/* kshowfile: streams a WAV or raw PCM file through kshow's analysis
+   pipeline as fast as possible, writing the light commands to a file
+   or sending them to a router, then reports throughput and per-stage
+   timings.  Useful for profiling analyze() and regression-testing its
+   output without JACK. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "protocol.h"
+#include "analyze.h"
+#include "wav.h"
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] (file.wav | file.raw | -)\n"
+	 "\t-o (file)\twrite light commands to file (\"-\" for stdout)\n"
+	 "\t-r (host)\tsend light commands to the router on host\n"
+	 "\t-a (us)\t\twith -r, send from a thread every this many us\n"
+	 "\t-e (epsilon)\twith -r, don't send changes this small or smaller\n"
+	 "\t-f (rate)\twith -r, send a light at most this many times a second\n"
+	 "\t-T\t\twith -r, stamp updates for latency tracing\n"
+	 "\t-c (channel)\tanalyze this channel of the input (default 0)\n"
+	 "\t-m (file)\tlight mapping, lines of \"channel group lightname\";\n"
+	 "\t\t\tanalyzes every channel of the input\n"
+	 "\t-s (seed)\tseed for the hue randomizer (default 0)\n"
+	 "\t-l (ms)\t\tlatency to fire predicted beats ahead by (default 40)\n"
+	 "\t-R (rate)\tinput is raw s16le PCM at this sample rate\n"
+	 "\t-n (channels)\tchannels in raw input (default 1)\n"
+	 "with neither -o nor -r, light commands are discarded.\n",
+	 prgname);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+  char * outname = NULL;
+  char * hostname = NULL;
+  char * mapfile = NULL;
+  int channel = 0;
+  int raw_rate = 0;
+  int raw_channels = 1;
+  unsigned int seed = 0;
+  int async_us = 0;
+  int trace = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:r:a:e:f:Tc:m:s:l:R:n:h")) != -1) {
+    switch(opt) {
+    case 'o': outname = optarg; break;
+    case 'r': hostname = optarg; break;
+    case 'a': async_us = atoi(optarg); break;
+    case 'e': kshow_epsilon = atof(optarg); break;
+    case 'f': kshow_max_rate = atof(optarg); break;
+    case 'T': trace = 1; break;
+    case 'c': channel = atoi(optarg); break;
+    case 'm': mapfile = optarg; break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'l': kshow_latency = atof(optarg) / 1000.0; break;
+    case 'R': raw_rate = atoi(optarg); break;
+    case 'n': raw_channels = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind >= argc || (outname && hostname) || raw_channels < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct wav_file wav;
+  if(raw_rate > 0) {
+    if(wav_open_raw(&wav, argv[optind], WAV_S16, raw_channels, raw_rate)) {
+      return 1;
+    }
+  } else if(wav_open(&wav, argv[optind])) {
+    return 1;
+  }
+
+  FILE * out_fp = NULL;
+  if(hostname) {
+    sqlights_client_initialize(hostname);
+    sqlights_client_trace(trace);
+    if(async_us > 0 && sqlights_client_async(async_us)) {
+      fprintf(stderr, "couldn't start the sender thread\n");
+      return 1;
+    }
+  } else {
+    if(outname == NULL) {
+      outname = "/dev/null";
+    }
+    if(strcmp(outname, "-") == 0) {
+      out_fp = stdout;
+    } else if(NULL == (out_fp = fopen(outname, "w"))) {
+      dieperr(outname);
+    }
+    kshow_set_output(out_fp);
+  }
+
+  static struct kshow_chan chans[KSHOW_MAX_CHANNELS];
+  static struct kshow_map maps[KSHOW_MAX_CHANNELS];
+  double * ins[KSHOW_MAX_CHANNELS];
+  int channels[KSHOW_MAX_CHANNELS];
+  int nchans = 1;
+  if(mapfile) {
+    nchans = wav.channels < KSHOW_MAX_CHANNELS ? wav.channels : KSHOW_MAX_CHANNELS;
+    if(kshow_load_map(mapfile, maps, nchans)) {
+      return 1;
+    }
+  } else {
+    maps[0] = kshow_default_map;
+  }
+
+  // the analysis is deterministic given the seed, so output files
+  // can be diffed between runs
+  for(int c = 0; c < nchans; c++) {
+    kshow_chan_init(&chans[c], c, wav.rate, &maps[c], seed + c);
+    ins[c] = chans[c].in;
+    channels[c] = mapfile ? c : channel;
+  }
+
+  static struct kshow_frame frames[KSHOW_MAX_CHANNELS];
+  int ok[KSHOW_MAX_CHANNELS];
+  long samples = 0;
+  long windows = 0;
+  int got;
+  double start = now();
+  while((got = wav_read(&wav, ins, channels, nchans, WINDOW_SIZE)) == WINDOW_SIZE) {
+    // same order as the JACK pool: analyze every channel, then send
+    for(int c = 0; c < nchans; c++) {
+      ok[c] = kshow_analyze(&chans[c], &frames[c]) == 0;
+    }
+    for(int c = 0; c < nchans; c++) {
+      if(ok[c]) {
+	kshow_emit(&chans[c], &frames[c], kshow_time(&chans[c]));
+      }
+    }
+    samples += got;
+    windows++;
+  }
+  double elapsed = now() - start;
+  samples += got;
+  if(hostname) {
+    struct sq_client_stats stats;
+    sqlights_client_flush();
+    sqlights_client_stats(&stats);
+    fprintf(stderr, "%ld updates sent, %ld lost to a full queue, "
+	    "%ld to send errors\n", stats.sent, stats.queue_full,
+	    stats.send_errors);
+    fprintf(stderr, "%ld suppressed as unchanged, %ld by the rate limit\n",
+	    stats.suppressed, stats.rate_limited);
+  }
+
+  wav_close(&wav);
+  if(out_fp != NULL && out_fp != stdout) {
+    fclose(out_fp);
+  }
+
+  double audio = (double)samples / wav.rate;
+  fprintf(stderr, "%.2f s of audio at %d Hz in %.3f s: %.1f windows/s, "
+	  "%.1fx realtime\n", audio, wav.rate, elapsed,
+	  elapsed > 0 ? windows / elapsed : 0,
+	  elapsed > 0 ? audio / elapsed : 0);
+  kshow_print_timings(stderr, chans, nchans);
+  return 0;
+}
@@ -0,0 +1,221 @@
+// onset.c
+// implementation of onset.h
+
+#include <math.h>
+#include <string.h>
+#include "onset.h"
+
+// band edges in bins for a 2048 sample window (21.5 Hz per bin at
+// 44.1kHz), roughly an octave each; scaled for other window sizes.
+static const int onset_band_edges[ONSET_BANDS+1] = {
+  1, 3, 6, 12, 24, 48, 96, 192, 512
+};
+
+// threshold = ONSET_DELTA + ONSET_LAMBDA * median(recent flux)
+#define ONSET_DELTA 0.05
+#define ONSET_LAMBDA 1.5
+
+// onsets within this fraction of a period of a predicted beat confirm it
+#define BEAT_TOLERANCE 0.2
+// how far a confirming onset pulls the phase
+#define BEAT_PHASE_GAIN 0.5
+// hops of disagreement before the tracker jumps to a new tempo
+#define TEMPO_SWITCH_HOPS 16
+
+void onset_init(struct onset_state * st, int rate, int hop_size) {
+  memset(st, 0, sizeof(*st));
+  st->hop = (double)hop_size / rate;
+  st->fired_num = -1;
+}
+
+static double onset_median(double * hist, int n) {
+  double sorted[ONSET_MEDIAN_LEN];
+  int i, j;
+  for(i = 0; i < n; i++) {
+    double v = hist[i];
+    for(j = i; j > 0 && sorted[j-1] > v; j--) {
+      sorted[j] = sorted[j-1];
+    }
+    sorted[j] = v;
+  }
+  return n & 1 ? sorted[n/2] : 0.5 * (sorted[n/2-1] + sorted[n/2]);
+}
+
+// i-th most recent value of the onset curve
+static inline double onset_hist(struct onset_state * st, int i) {
+  return st->tempo_hist[(st->hops - 1 - i) % ONSET_TEMPO_LEN];
+}
+
+static double onset_autocorr(struct onset_state * st, int lag, int n) {
+  double sum = 0;
+  for(int i = 0; i < n; i++) {
+    sum += onset_hist(st, i) * onset_hist(st, i + lag);
+  }
+  return sum;
+}
+
+// re-estimates the beat period from the autocorrelation of the onset
+// curve, weighted towards 120bpm.
+static void onset_track_tempo(struct onset_state * st) {
+  int lag_min = (int)(60.0 / ONSET_MAX_BPM / st->hop);
+  int lag_max = (int)ceil(60.0 / ONSET_MIN_BPM / st->hop);
+  double r[ONSET_TEMPO_LEN];
+  int n, l, best = 0;
+  double best_score = 0;
+
+  if(lag_min < 2) {
+    lag_min = 2;
+  }
+  if(lag_max + 2 >= ONSET_TEMPO_LEN / 2) {
+    lag_max = ONSET_TEMPO_LEN / 2 - 2;
+  }
+  if(st->hops < ONSET_TEMPO_LEN) {
+    return;
+  }
+  n = ONSET_TEMPO_LEN - lag_max - 1;
+
+  for(l = lag_min - 1; l <= lag_max + 1; l++) {
+    r[l] = onset_autocorr(st, l, n);
+  }
+  for(l = lag_min; l <= lag_max; l++) {
+    double octaves = log2(l * st->hop / 0.5);
+    double score = r[l] * exp(-0.5 * octaves * octaves);
+    if(score > best_score) {
+      best_score = score;
+      best = l;
+    }
+  }
+  if(best == 0) {
+    return;
+  }
+
+  // parabolic interpolation for a fractional lag
+  double lag = best;
+  double denom = r[best-1] - 2 * r[best] + r[best+1];
+  if(denom < 0) {
+    lag += 0.5 * (r[best-1] - r[best+1]) / denom;
+  }
+  double period = lag * st->hop;
+
+  if(st->period == 0) {
+    st->period = period;
+  } else if(fabs(period - st->period) < 0.1 * st->period) {
+    st->period = 0.8 * st->period + 0.2 * period;
+    st->tempo_disagree = 0;
+  } else if(++st->tempo_disagree > TEMPO_SWITCH_HOPS) {
+    st->period = period;
+    st->tempo_disagree = 0;
+    st->confidence = 0;
+  }
+}
+
+// keeps next_beat in phase with the detected onsets.  The strongest
+// onset within BEAT_TOLERANCE of a predicted beat confirms it and pulls
+// the following prediction towards it.
+static void onset_track_phase(struct onset_state * st) {
+  double tol;
+
+  st->beat_passed = 0;
+  if(st->period == 0) {
+    return;
+  }
+  tol = BEAT_TOLERANCE * st->period;
+
+  if(st->onset) {
+    // the onset happened somewhere in the window which just ended
+    double when = st->now - 0.5 * st->hop;
+    double strength = st->flux / st->threshold;
+    if(fabs(when - st->next_beat) < tol) {
+      if(strength > st->match_strength) {
+	st->match_strength = strength;
+	st->match_time = when;
+      }
+    } else if(st->confidence < 0.25 && strength > 2.0) {
+      // not locked: re-anchor on this onset
+      st->next_beat = when + st->period;
+      st->beat_num++;
+      st->match_strength = 0;
+    }
+  }
+
+  // step over beats which have passed
+  while(st->now > st->next_beat + tol) {
+    if(st->confidence >= 0.5) {
+      st->beat_passed = 1;
+      st->passed_beat = st->match_strength > 0 ? st->match_time : st->next_beat;
+    }
+    if(st->match_strength > 0) {
+      st->next_beat += BEAT_PHASE_GAIN * (st->match_time - st->next_beat);
+      st->confidence += 0.25;
+      if(st->confidence > 1) {
+	st->confidence = 1;
+      }
+    } else {
+      st->confidence -= 0.125;
+      if(st->confidence < 0) {
+	st->confidence = 0;
+      }
+    }
+    st->next_beat += st->period;
+    st->beat_num++;
+    st->match_strength = 0;
+  }
+}
+
+void onset_update(struct onset_state * st, fftw_complex * spectrum,
+		  int window_size, double now) {
+  double scale = window_size / 2048.0;
+  double flux = 0;
+  int b, i;
+
+  for(b = 0; b < ONSET_BANDS; b++) {
+    int lo = (int)(onset_band_edges[b] * scale);
+    int hi = (int)(onset_band_edges[b+1] * scale);
+    double energy = 0;
+    if(hi <= lo) {
+      hi = lo + 1;
+    }
+    for(i = lo; i < hi; i++) {
+      energy += spectrum[i][0]*spectrum[i][0] + spectrum[i][1]*spectrum[i][1];
+    }
+    energy = log1p(energy / (hi - lo));
+    st->band_flux[b] = energy > st->band_energy[b] ? energy - st->band_energy[b] : 0;
+    st->band_energy[b] = energy;
+    flux += st->band_flux[b];
+  }
+  flux /= ONSET_BANDS;
+  if(st->hops == 0) {
+    flux = 0; // no previous spectrum to difference against
+  }
+
+  int nmed = st->hops < ONSET_MEDIAN_LEN ? st->hops : ONSET_MEDIAN_LEN;
+  st->threshold = ONSET_DELTA
+    + (nmed ? ONSET_LAMBDA * onset_median(st->median_hist, nmed) : 0);
+  st->onset = nmed > 0 && flux > st->threshold && flux > st->last_flux;
+
+  st->median_hist[st->hops % ONSET_MEDIAN_LEN] = flux;
+  st->tempo_hist[st->hops % ONSET_TEMPO_LEN] = flux;
+  st->last_flux = st->flux = flux;
+  st->hops++;
+  st->now = now;
+
+  onset_track_tempo(st);
+  onset_track_phase(st);
+}
+
+int onset_beat_due(struct onset_state * st, double latency) {
+  if(st->period == 0 || st->confidence < 0.5) {
+    return 0;
+  }
+  // fire in whichever hop gets the arrival time closest to the beat
+  double fire_at = st->next_beat - latency;
+  if(fire_at < st->now + 0.5 * st->hop && st->beat_num != st->fired_num) {
+    st->fired_num = st->beat_num;
+    return 1;
+  }
+  return 0;
+}
+
+double onset_bpm(struct onset_state * st) {
+  return st->period > 0 ? 60.0 / st->period : 0;
+}
@@ -0,0 +1,67 @@
+// onset.h
+// Spectral-flux onset detection and beat tracking for kshow.
+//
+// Each hop, onset_update() takes the magnitude spectrum, computes the
+// half-wave rectified log-energy flux in ONSET_BANDS log-spaced bands
+// and compares their mean against an adaptive median threshold.  The
+// resulting onset strength feeds a tempo tracker (autocorrelation of
+// the onset curve) and a phase tracker which predicts when the next
+// beat will land, so that lights can be fired ahead of it.
+
+#ifndef _kshow_onset_h
+#define _kshow_onset_h
+
+#include <fftw3.h>
+
+#define ONSET_BANDS 8
+#define ONSET_MEDIAN_LEN 16  // hops of history for the adaptive threshold
+#define ONSET_TEMPO_LEN 128  // hops of onset curve kept for tempo (~6s)
+#define ONSET_MIN_BPM 70
+#define ONSET_MAX_BPM 180
+
+struct onset_state {
+  double hop;                     // seconds per hop
+  double now;                     // stream time at the end of this hop
+
+  double band_energy[ONSET_BANDS];  // log energies of this hop
+  double band_flux[ONSET_BANDS];    // rectified increase since last hop
+  double flux;                      // mean of band_flux
+  double threshold;                 // adaptive threshold for flux
+  int onset;                        // 1 if this hop is an onset
+
+  // history for the threshold and the tempo estimate
+  double median_hist[ONSET_MEDIAN_LEN];
+  double tempo_hist[ONSET_TEMPO_LEN];
+  long hops;
+  double last_flux;
+
+  // beat tracking
+  double period;      // seconds per beat, 0 until estimated
+  int tempo_disagree; // hops the raw estimate has disagreed with period
+  double next_beat;   // predicted time of the next beat
+  long beat_num;      // index of next_beat
+  double match_strength; // strongest onset near next_beat so far
+  double match_time;     // and when it happened
+  long fired_num;     // last beat handed out by onset_beat_due()
+  double confidence;  // 0..1
+  int beat_passed;    // a locked beat was stepped over this hop...
+  double passed_beat; // ...at this time (its onset, if one matched)
+};
+
+// rate is the sample rate, hop_size the number of samples per hop
+void onset_init(struct onset_state * st, int rate, int hop_size);
+
+// spectrum has window_size/2+1 bins from an r2c transform; now is the
+// stream time at the end of the analyzed window.
+void onset_update(struct onset_state * st, fftw_complex * spectrum,
+		  int window_size, double now);
+
+// returns 1 if a predicted beat should be fired during this hop so
+// that, after `latency' seconds of network/driver delay, it lands on
+// the beat.  Each predicted beat is returned at most once.
+int onset_beat_due(struct onset_state * st, double latency);
+
+// current tempo estimate, 0 if unknown
+double onset_bpm(struct onset_state * st);
+
+#endif
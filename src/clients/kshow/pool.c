@@ -0,0 +1,147 @@
+// pool.c
+// implementation of pool.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "analyze.h"
+#include "pool.h"
+
+// samples of slack per channel; must be a power of two
+#define RING_SIZE (8 * WINDOW_SIZE)
+
+struct kshow_ring {
+  float buf[RING_SIZE];
+  unsigned long head; // only written by the audio thread
+  unsigned long tail; // only written by the channel's worker
+};
+
+struct kshow_worker {
+  pthread_t thread;
+  sem_t ready;  // posted once per buffered window
+  int id;
+};
+
+// per channel results, double buffered by window parity so a worker
+// can start the next window while the previous one is being sent.
+struct kshow_result {
+  struct kshow_frame frame;
+  int ok;
+  double t;
+};
+
+static struct kshow_chan * pool_chans;
+static int pool_nchans;
+static int pool_nworkers;
+static struct kshow_ring * rings;
+static struct kshow_result (*results)[2];
+static struct kshow_worker * workers;
+static pthread_barrier_t pool_barrier;
+
+// audio thread state
+static long pending;
+static long overruns;
+
+void kshow_pool_push(float ** bufs, int nframes) {
+  int c, i;
+  unsigned long head = rings[0].head;
+
+  for(c = 0; c < pool_nchans; c++) {
+    unsigned long tail = __atomic_load_n(&rings[c].tail, __ATOMIC_ACQUIRE);
+    if(head + nframes - tail > RING_SIZE) {
+      __atomic_store_n(&overruns, overruns + nframes, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  for(c = 0; c < pool_nchans; c++) {
+    struct kshow_ring * ring = &rings[c];
+    for(i = 0; i < nframes; i++) {
+      ring->buf[(head + i) & (RING_SIZE - 1)] = bufs[c][i];
+    }
+    __atomic_store_n(&ring->head, head + nframes, __ATOMIC_RELEASE);
+  }
+
+  pending += nframes;
+  while(pending >= WINDOW_SIZE) {
+    pending -= WINDOW_SIZE;
+    for(i = 0; i < pool_nworkers; i++) {
+      sem_post(&workers[i].ready);
+    }
+  }
+}
+
+long kshow_pool_overruns(void) {
+  return __atomic_load_n(&overruns, __ATOMIC_RELAXED);
+}
+
+static void pool_pop_window(struct kshow_chan * chan, struct kshow_ring * ring) {
+  unsigned long tail = ring->tail;
+  for(int i = 0; i < WINDOW_SIZE; i++) {
+    chan->in[i] = ring->buf[(tail + i) & (RING_SIZE - 1)];
+  }
+  __atomic_store_n(&ring->tail, tail + WINDOW_SIZE, __ATOMIC_RELEASE);
+}
+
+static void * pool_worker(void * arg) {
+  struct kshow_worker * self = arg;
+  long window = 0;
+  int c;
+
+  while(1) {
+    while(sem_wait(&self->ready) != 0) ; // EINTR
+    int parity = window & 1;
+
+    for(c = self->id; c < pool_nchans; c += pool_nworkers) {
+      struct kshow_chan * chan = &pool_chans[c];
+      struct kshow_result * res = &results[c][parity];
+      pool_pop_window(chan, &rings[c]);
+      res->ok = kshow_analyze(chan, &res->frame) == 0;
+      res->t = kshow_time(chan);
+    }
+
+    // every channel has analyzed this window; one thread sends it
+    if(pthread_barrier_wait(&pool_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      for(c = 0; c < pool_nchans; c++) {
+	struct kshow_result * res = &results[c][parity];
+	if(res->ok) {
+	  kshow_emit(&pool_chans[c], &res->frame, res->t);
+	}
+      }
+    }
+    window++;
+  }
+  return NULL;
+}
+
+int kshow_pool_start(struct kshow_chan * chans, int nchans, int nworkers) {
+  int i;
+
+  if(nworkers > nchans) {
+    nworkers = nchans;
+  }
+  if(nworkers < 1) {
+    nworkers = 1;
+  }
+  pool_chans = chans;
+  pool_nchans = nchans;
+  pool_nworkers = nworkers;
+
+  rings = calloc(nchans, sizeof(struct kshow_ring));
+  results = calloc(nchans, sizeof(*results));
+  workers = calloc(nworkers, sizeof(struct kshow_worker));
+  if(rings == NULL || results == NULL || workers == NULL) {
+    return -1;
+  }
+  if(pthread_barrier_init(&pool_barrier, NULL, nworkers)) {
+    return -1;
+  }
+  for(i = 0; i < nworkers; i++) {
+    workers[i].id = i;
+    sem_init(&workers[i].ready, 0, 0);
+    if(pthread_create(&workers[i].thread, NULL, pool_worker, &workers[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,24 @@
+// pool.h
+// Runs kshow's per-channel pipelines on a small pool of worker
+// threads.  The JACK process callback pushes each port's samples into
+// a lock-free single-producer/single-consumer ring per channel and
+// wakes the workers once a full window is buffered.  Each worker
+// analyzes the channels it owns; after a per-window barrier one worker
+// sends the combined light frame of all channels.
+
+#ifndef _kshow_pool_h
+#define _kshow_pool_h
+
+#include "analyze.h"
+
+// starts nworkers threads for chans[0..nchans-1].  Returns 0 on success.
+int kshow_pool_start(struct kshow_chan * chans, int nchans, int nworkers);
+
+// called from the audio thread with one buffer per channel.  Never
+// blocks; if the workers fall behind, the samples are dropped.
+void kshow_pool_push(float ** bufs, int nframes);
+
+// samples dropped because the rings were full
+long kshow_pool_overruns(void);
+
+#endif
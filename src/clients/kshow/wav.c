@@ -0,0 +1,178 @@
+// wav.c
+// implementation of wav.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "wav.h"
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_CHUNK_FRAMES 1024
+
+static uint32_t le32(unsigned char * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint16_t le16(unsigned char * p) {
+  return p[0] | (p[1] << 8);
+}
+
+static int wav_bytes_per_sample(int format) {
+  switch(format) {
+  case WAV_S16: return 2;
+  case WAV_S24: return 3;
+  case WAV_S32: return 4;
+  case WAV_F32: return 4;
+  }
+  return 0;
+}
+
+int wav_open(struct wav_file * wav, char * filename) {
+  unsigned char hdr[12], chunk[8], fmt[40];
+  int have_fmt = 0;
+
+  memset(wav, 0, sizeof(*wav));
+  if(NULL == (wav->fp = fopen(filename, "rb"))) {
+    perror(filename);
+    return -1;
+  }
+  if(fread(hdr, 1, 12, wav->fp) != 12
+     || memcmp(hdr, "RIFF", 4) || memcmp(hdr+8, "WAVE", 4)) {
+    fprintf(stderr, "%s: not a RIFF/WAVE file\n", filename);
+    goto fail;
+  }
+
+  while(fread(chunk, 1, 8, wav->fp) == 8) {
+    uint32_t len = le32(chunk+4);
+    if(!memcmp(chunk, "fmt ", 4)) {
+      if(len < 16 || len > sizeof(fmt)) {
+	fprintf(stderr, "%s: bad fmt chunk\n", filename);
+	goto fail;
+      }
+      if(fread(fmt, 1, len, wav->fp) != len) {
+	goto fail;
+      }
+      int tag = le16(fmt);
+      int bits = le16(fmt+14);
+      if(tag == WAV_FORMAT_EXTENSIBLE && len >= 26) {
+	tag = le16(fmt+24);
+      }
+      wav->channels = le16(fmt+2);
+      wav->rate = le32(fmt+4);
+      if(tag == WAV_FORMAT_PCM && bits == 16) {
+	wav->format = WAV_S16;
+      } else if(tag == WAV_FORMAT_PCM && bits == 24) {
+	wav->format = WAV_S24;
+      } else if(tag == WAV_FORMAT_PCM && bits == 32) {
+	wav->format = WAV_S32;
+      } else if(tag == WAV_FORMAT_FLOAT && bits == 32) {
+	wav->format = WAV_F32;
+      } else {
+	fprintf(stderr, "%s: unsupported sample format %d/%d bits\n",
+		filename, tag, bits);
+	goto fail;
+      }
+      wav->bytes_per_frame = wav->channels * wav_bytes_per_sample(wav->format);
+      have_fmt = 1;
+      if(len & 1) {
+	fseek(wav->fp, 1, SEEK_CUR);
+      }
+    } else if(!memcmp(chunk, "data", 4)) {
+      if(!have_fmt || wav->channels < 1) {
+	fprintf(stderr, "%s: data before fmt chunk\n", filename);
+	goto fail;
+      }
+      wav->frames_left = len / wav->bytes_per_frame;
+      return 0;
+    } else {
+      fseek(wav->fp, len + (len & 1), SEEK_CUR);
+    }
+  }
+  fprintf(stderr, "%s: no data chunk\n", filename);
+
+ fail:
+  fclose(wav->fp);
+  wav->fp = NULL;
+  return -1;
+}
+
+int wav_open_raw(struct wav_file * wav, char * filename, int format,
+		 int channels, int rate) {
+  memset(wav, 0, sizeof(*wav));
+  if(strcmp(filename, "-") == 0) {
+    wav->fp = stdin;
+  } else if(NULL == (wav->fp = fopen(filename, "rb"))) {
+    perror(filename);
+    return -1;
+  }
+  wav->format = format;
+  wav->channels = channels;
+  wav->rate = rate;
+  wav->bytes_per_frame = channels * wav_bytes_per_sample(format);
+  wav->frames_left = -1;
+  return 0;
+}
+
+static double wav_sample(int format, unsigned char * p) {
+  union { uint32_t u; float f; } fu;
+  switch(format) {
+  case WAV_S16:
+    return (int16_t)le16(p) / 32768.0;
+  case WAV_S24:
+    return ((int32_t)(le32(p - 1) & 0xFFFFFF00)) / 2147483648.0;
+  case WAV_S32:
+    return (int32_t)le32(p) / 2147483648.0;
+  case WAV_F32:
+    fu.u = le32(p);
+    return fu.f;
+  }
+  return 0;
+}
+
+int wav_read(struct wav_file * wav, double ** dst, int * channels,
+	     int count, int n) {
+  unsigned char buf[WAV_CHUNK_FRAMES * 4 * 8 + 1];
+  int sample_bytes = wav_bytes_per_sample(wav->format);
+  int max_chunk = (sizeof(buf) - 1) / wav->bytes_per_frame;
+  int done = 0;
+
+  while(done < n) {
+    int want = n - done;
+    if(want > max_chunk) {
+      want = max_chunk;
+    }
+    if(wav->frames_left >= 0 && want > wav->frames_left) {
+      want = wav->frames_left;
+    }
+    if(want == 0) {
+      break;
+    }
+    // buf+1 so that 24 bit samples can be read as the top of a 32 bit word
+    int got = fread(buf+1, wav->bytes_per_frame, want, wav->fp);
+    for(int k = 0; k < count; k++) {
+      int channel = channels[k] < wav->channels ? channels[k] : wav->channels - 1;
+      for(int i = 0; i < got; i++) {
+	unsigned char * p = buf + 1 + i * wav->bytes_per_frame
+	  + channel * sample_bytes;
+	dst[k][done + i] = wav_sample(wav->format, p);
+      }
+    }
+    done += got;
+    if(wav->frames_left >= 0) {
+      wav->frames_left -= got;
+    }
+    if(got < want) {
+      break;
+    }
+  }
+  return done;
+}
+
+void wav_close(struct wav_file * wav) {
+  if(wav->fp != NULL && wav->fp != stdin) {
+    fclose(wav->fp);
+  }
+  wav->fp = NULL;
+}
@@ -0,0 +1,41 @@
+// wav.h
+// Minimal WAV and raw PCM reader for feeding files through kshow.
+
+#ifndef _kshow_wav_h
+#define _kshow_wav_h
+
+#include <stdio.h>
+
+enum wav_format_e {
+  WAV_S16 = 1,
+  WAV_S24,
+  WAV_S32,
+  WAV_F32
+};
+
+struct wav_file {
+  FILE * fp;
+  int format;
+  int channels;
+  int rate;
+  int bytes_per_frame;
+  long frames_left;   // -1 if unknown (raw input read to EOF)
+};
+
+// opens a RIFF/WAVE file.  Returns 0 on success, -1 on error (with a
+// message on stderr).
+int wav_open(struct wav_file * wav, char * filename);
+
+// opens headerless little-endian PCM ("-" for stdin).
+int wav_open_raw(struct wav_file * wav, char * filename, int format,
+		 int channels, int rate);
+
+// reads up to n frames into dst[0..count-1], dst[k] getting channel
+// channels[k], scaled to [-1, 1] like JACK samples.  Returns the
+// number of frames read, 0 at end of file.
+int wav_read(struct wav_file * wav, double ** dst, int * channels,
+	     int count, int n);
+
+void wav_close(struct wav_file * wav);
+
+#endif
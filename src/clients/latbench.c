@@ -0,0 +1,197 @@
+/* latbench.c
+   measures how long an update takes to get from a client, through the
+   router, to a light's handler, over udp, the router's unix datagram
+   socket and the shared-memory transport.  Forks a light process, then sends it one brightness
+   update at a time, waiting for each to arrive before sending the
+   next; both processes stamp CLOCK_MONOTONIC into a shared page.  The
+   router must already be running. */
+
+#include "protocol.h"
+#include "shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_COUNT 10000
+#define WARMUP 100
+#define TIMEOUT 1.0  // seconds to wait for one update before calling it lost
+
+struct bench_shared {
+  volatile int ready;
+  volatile int stop;
+  volatile int last;   // index of the last update the light handled
+  int count;
+  double * sent;
+  double * handled;
+};
+
+static struct bench_shared * shared;
+static int trace = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+void bench_handler(light_t * light, float brightness) {
+  double t = now();
+  int i = (int)brightness;
+  if(i >= 0 && i < shared->count) {
+    shared->handled[i] = t;
+    __atomic_store_n(&shared->last, i, __ATOMIC_RELEASE);
+  }
+}
+
+void run_light(char * routeraddr, char * name) {
+  if(sqlights_light_initialize(routeraddr)) {
+    exit(1);
+  }
+  light_t * light = sqlights_add_light(name, SQ_FADEABLE);
+  light->brightness_handler = &bench_handler;
+  while(!light->acked) {
+    sqlights_lights_handle(1);
+  }
+  shared->ready = 1;
+  while(!shared->stop) {
+    sqlights_lights_handle(1);
+  }
+  if(trace) {
+    sqlights_trace_dump(stdout);
+  }
+  exit(0);
+}
+
+// returns 0 if the run happened
+int run(char * label, char * routeraddr, int count) {
+  char name[32];
+  pid_t pid;
+
+  snprintf(name, sizeof(name), "latbench-%d", (int)getpid());
+  shared->ready = shared->stop = 0;
+  shared->last = -1;
+  fflush(stdout);
+  if(0 == (pid = fork())) {
+    run_light(routeraddr, name);
+  }
+  double deadline = now() + 5;
+  while(!shared->ready && now() < deadline) {
+    usleep(1000);
+  }
+  if(!shared->ready) {
+    printf("%s: light never registered; is the router running?\n", label);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+
+  sqlights_client_initialize(routeraddr);
+  sqlights_client_trace(trace);
+  int lost = 0;
+  for(int i = 0; i < count; i++) {
+    shared->sent[i] = now();
+    sqlights_client_brightness(name, i);
+    double give_up = shared->sent[i] + TIMEOUT;
+    while(__atomic_load_n(&shared->last, __ATOMIC_ACQUIRE) != i) {
+      if(now() > give_up) {
+	shared->handled[i] = -1;
+	lost++;
+	break;
+      }
+    }
+  }
+  shared->stop = 1;
+  sqlights_client_brightness(name, -1); // wake it to see stop
+  waitpid(pid, NULL, 0);
+
+  int n = 0;
+  double * lat = malloc(count * sizeof(double));
+  for(int i = WARMUP; i < count; i++) {
+    if(shared->handled[i] >= 0) {
+      lat[n++] = 1e6 * (shared->handled[i] - shared->sent[i]);
+    }
+  }
+  qsort(lat, n, sizeof(double), cmp_double);
+  if(n > 0) {
+    printf("%-4s %8d %8d %8.1f %8.1f %8.1f %8.1f %8.1f\n", label, n, lost,
+	   lat[0], lat[n/2], lat[(int)(n*0.9)], lat[(int)(n*0.99)], lat[n-1]);
+  } else {
+    printf("%-4s %8d %8d\n", label, n, lost);
+  }
+  free(lat);
+  return 0;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname]\n"
+	 "\t-n (count)\tupdates per transport (default %d)\n"
+	 "\t-t (udp|unix|shm|all)\ttransport to measure (default all)\n"
+	 "\t-u (path)\trouter's unix datagram socket (default %s)\n"
+	 "\t-s (path)\trouter's shared-memory socket (default %s)\n"
+	 "\t-T\t\ttrace the updates, and print the light's per-hop times\n",
+	 prgname, DEFAULT_COUNT, SQ_UNIX_SOCKET, SQ_SHM_SOCKET);
+}
+
+int main(int argc, char** argv) {
+  char * hostname = "localhost";
+  char * transport = "all";
+  char unixaddr[128] = "unix:";
+  char shmaddr[128] = "shm";
+  int count = DEFAULT_COUNT;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:t:u:s:Th")) != -1) {
+    switch(opt) {
+    case 'n': count = atoi(optarg); break;
+    case 't': transport = optarg; break;
+    case 'u': snprintf(unixaddr, sizeof(unixaddr), "unix:%s", optarg); break;
+    case 's': snprintf(shmaddr, sizeof(shmaddr), "shm:%s", optarg); break;
+    case 'T': trace = 1; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(count <= WARMUP || count > (1 << 24)) {
+    // the index travels as a float
+    printf("count must be between %d and %d\n", WARMUP + 1, 1 << 24);
+    return 1;
+  }
+  if(optind < argc) {
+    hostname = argv[optind];
+  }
+
+  size_t size = sizeof(struct bench_shared) + 2 * count * sizeof(double);
+  void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  tryp(mem != MAP_FAILED, "mmap");
+  shared = mem;
+  shared->count = count;
+  shared->sent = (double *)(shared + 1);
+  shared->handled = shared->sent + count;
+
+  printf("one-way latency in us, first %d updates skipped\n", WARMUP);
+  printf("        count     lost      min      p50      p90      p99      max\n");
+  int failed = 0;
+  int all = strcmp(transport, "all") == 0;
+  if(all || strcmp(transport, "udp") == 0) {
+    failed |= run("udp", hostname, count);
+  }
+  if(all || strcmp(transport, "unix") == 0) {
+    failed |= run("unix", unixaddr, count);
+  }
+  if(all || strcmp(transport, "shm") == 0) {
+    failed |= run("shm", shmaddr, count);
+  }
+  return failed ? 1 : 0;
+}
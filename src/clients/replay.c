@@ -0,0 +1,159 @@
+/* replay.c
+   plays a log recorded by the router's -R back to a router, as a
+   client would have sent it: at the recorded pace, some multiple of
+   it, or as fast as it'll go.  Only the messages clients send to
+   lights are replayed; registrations and queries are the business of
+   the processes which made them.  Scheduled messages are scheduled as
+   far ahead as they were, scaled by the speed.  Reports how closely
+   the pace was kept. */
+
+#include "protocol.h"
+#include "record.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFSIZE 256
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {
+  }
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] (log) [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-s (speed)\tplay this many times faster than recorded\n"
+	 "\t\t\t(default 1)\n"
+	 "\t-m\t\tplay as fast as possible\n"
+	 "\t-T\t\ttrace what's replayed\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  char * routeraddr = "localhost";
+  double speed = 1;
+  int trace = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "s:mTh")) != -1) {
+    switch(opt) {
+    case 's': speed = atof(optarg); break;
+    case 'm': speed = 0; break;
+    case 'T': trace = 1; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind >= argc || speed < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  char * logpath = argv[optind];
+  if(optind + 1 < argc) {
+    routeraddr = argv[optind + 1];
+  }
+
+  FILE * fp = fopen(logpath, "r");
+  struct sq_record_header header;
+  if(fp == NULL) {
+    dieperr(logpath);
+  }
+  if(sq_record_read_header(fp, &header)) {
+    printf("%s isn't a recording\n", logpath);
+    return 1;
+  }
+  sqlights_client_initialize(routeraddr);
+  sqlights_client_trace(trace);
+
+  char msg[BUFSIZE];
+  struct sq_record_entry entry;
+  struct sq_hist late;
+  long sent = 0, skipped = 0;
+  uint64_t first = 0, last = 0, start = 0;
+  int len;
+  sq_hist_init(&late);
+  while(0 <= (len = sq_record_read(fp, &entry, msg, sizeof(msg)))) {
+    if(len < (int)sizeof(sq_msg_type) || len > (int)sizeof(msg)) {
+      skipped++;
+      continue;
+    }
+    sq_msg_type flags = ((struct sq_msg *)msg)->type
+      & (SQ_TRACE_FLAG | SQ_AT_FLAG);
+    sq_msg_type type = ((struct sq_msg *)msg)->type & ~flags;
+    size_t size = sqlights_msg_size(type);
+    if(size == 0 || len < (int)size
+       || ((flags & SQ_AT_FLAG) && len < (int)(size + sizeof(struct sq_at)))) {
+      skipped++;
+      continue;
+    }
+    // any trace was the original sender's; the library adds a new one
+    ((struct sq_msg *)msg)->type = type;
+    int64_t lead = 0;
+    if(flags & SQ_AT_FLAG) {
+      struct sq_at at;
+      memcpy(&at, msg + size, sizeof(at));
+      // how far ahead of its arrival it was for
+      lead = at.at - (header.started + (entry.t - header.started_mono));
+      lead = speed > 0 ? lead / speed : lead;
+    }
+
+    if(sent == 0) {
+      first = entry.t;
+      start = now_ns();
+    }
+    last = entry.t;
+    if(speed > 0) {
+      uint64_t due = start + (uint64_t)((entry.t - first) / speed);
+      uint64_t t = now_ns();
+      if(t < due) {
+	sleep_until(due);
+	t = now_ns();
+      }
+      sq_hist_record(&late, t - due);
+    }
+    if(flags & SQ_AT_FLAG) {
+      sqlights_client_at(sqlights_time() + (lead > 0 ? lead : 0));
+      sqlights_client_send(msg, size);
+      sqlights_client_at(0);
+    } else {
+      sqlights_client_send(msg, size);
+    }
+    sent++;
+  }
+  double elapsed = sent ? (now_ns() - start) * 1e-9 : 0;
+  double span = (last - first) * 1e-9;
+  fclose(fp);
+
+  struct sq_client_stats stats;
+  sqlights_client_stats(&stats);
+  printf("replayed %ld messages spanning %.2f s in %.2f s", sent, span,
+	 elapsed);
+  if(elapsed > 0) {
+    printf(", %.0f/s", sent / elapsed);
+  }
+  printf("\n");
+  if(skipped) {
+    printf("%ld messages weren't for lights\n", skipped);
+  }
+  if(stats.send_errors) {
+    printf("%ld lost sending\n", stats.send_errors);
+  }
+  if(speed > 0) {
+    printf("late, in us:");
+    sq_hist_print(stdout, &late, 1000);
+  }
+  return 0;
+}
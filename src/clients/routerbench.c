@@ -0,0 +1,389 @@
+/* routerbench.c
+   a load generator for measuring the router.  Forks M light processes
+   which each register n lights with sqlights_add_light(), then K
+   clients which send a mix of onoff, brightness, rgb and hsi updates
+   to random lights at a set rate through the client library, with
+   tracing on.  Reports what got through, the latency of each hop from
+   the lights' trace histograms, the router's own handling time from
+   its stats, and the cpu the router used.  The router must already be
+   running; everything else runs on this host. */
+
+#include "protocol.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAX_PROCS 64
+#define MAX_CLIENTS 64
+#define BATCH 16  // updates sent between looks at the clock
+#define REG_BATCH 64  // registrations in flight, so the router keeps up
+
+struct bench_shared {
+  volatile int ready[MAX_PROCS];
+  volatile int client_ready[MAX_CLIENTS];
+  volatile int go;
+  volatile int stop;
+  volatile long received[MAX_PROCS];
+  struct sq_hist end_to_end[MAX_PROCS];
+  struct sq_hist router_light[MAX_PROCS];
+  struct sq_client_stats client[MAX_CLIENTS];
+};
+
+static struct bench_shared * shared;
+static int proc_index;
+static char * routeraddr = "localhost";
+static int nprocs = 4, nlights = 1000, nclients = 2;
+static double rate = 10000, duration = 5;
+static int mix[4] = {1, 4, 1, 1}; // onoff, brightness, rgb, hsi
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void count(void) {
+  if(!shared->stop) {
+    shared->received[proc_index]++;
+  }
+}
+void bench_onoff(light_t * light, char seton) { count(); }
+void bench_brightness(light_t * light, float b) { count(); }
+void bench_color(light_t * light, float x, float y, float z) { count(); }
+
+void run_lights(void) {
+  char name[32];
+  light_t ** lights = malloc(nlights * sizeof(light_t *));
+  if(sqlights_light_initialize(routeraddr)) {
+    exit(1);
+  }
+  for(int i = 0; i < nlights; i++) {
+    snprintf(name, sizeof(name), "bench-%d-%d", proc_index, i);
+    lights[i] = sqlights_add_light(name, SQ_COLORED);
+    lights[i]->onoff_handler = &bench_onoff;
+    lights[i]->brightness_handler = &bench_brightness;
+    lights[i]->rgb_handler = &bench_color;
+    lights[i]->hsi_handler = &bench_color;
+    if(i % REG_BATCH == REG_BATCH - 1 || i == nlights - 1) {
+      for(int j = i - i % REG_BATCH; j <= i; j++) {
+	while(!lights[j]->acked) {
+	  sqlights_lights_handle(1);
+	}
+      }
+    }
+  }
+  shared->ready[proc_index] = 1;
+  while(!shared->stop) {
+    sqlights_lights_handle(1);
+  }
+  const struct sq_hist * h;
+  if(NULL != (h = sqlights_trace_hist(SQ_HOP_END_TO_END))) {
+    shared->end_to_end[proc_index] = *h;
+  }
+  if(NULL != (h = sqlights_trace_hist(SQ_HOP_ROUTER_LIGHT))) {
+    shared->router_light[proc_index] = *h;
+  }
+  exit(0);
+}
+
+void run_client(int c) {
+  char name[32];
+  int total = nprocs * nlights;
+  int mixsum = mix[0] + mix[1] + mix[2] + mix[3];
+  unsigned int seed = c + 1;
+  sq_client_light_t ** lights = malloc(total * sizeof(sq_client_light_t *));
+
+  sqlights_client_initialize(routeraddr);
+  sqlights_client_trace(1);
+  for(int i = 0; i < total; i++) {
+    snprintf(name, sizeof(name), "bench-%d-%d", i / nlights, i % nlights);
+    lights[i] = sqlights_client_open(name);
+  }
+  shared->client_ready[c] = 1;
+  while(!shared->go) {
+    usleep(100);
+  }
+  long sent = 0;
+  double start = now(), end = start + duration;
+  while(now() < end) {
+    if(rate > 0) {
+      double wait = start + sent / rate - now();
+      if(wait > 0) {
+	usleep(wait * 1e6);
+      }
+    }
+    for(int k = 0; k < BATCH; k++, sent++) {
+      sq_client_light_t * light = lights[rand_r(&seed) % total];
+      int pick = rand_r(&seed) % mixsum;
+      float v = (rand_r(&seed) & 0xff) / 255.0;
+      if((pick -= mix[0]) < 0) {
+	sqlights_client_light_seton(light, v > 0.5);
+      } else if((pick -= mix[1]) < 0) {
+	sqlights_client_light_brightness(light, v);
+      } else if((pick -= mix[2]) < 0) {
+	sqlights_client_light_rgb(light, v, 1 - v, 0.5);
+      } else {
+	sqlights_client_light_hsi(light, v, 1, 1);
+      }
+    }
+  }
+  sqlights_client_flush();
+  sqlights_client_stats(&shared->client[c]);
+  exit(0);
+}
+
+// user and system cpu seconds pid has used, or -1
+double cpu_seconds(int pid) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE * fp = fopen(path, "r");
+  if(fp == NULL) {
+    return -1;
+  }
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = '\0';
+  char * p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			 &utime, &stime) != 2) {
+    return -1;
+  }
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// the pid of the process called "router", or 0 if there isn't
+// exactly one
+int find_router(void) {
+  DIR * dir = opendir("/proc");
+  struct dirent * de;
+  char path[300], comm[64];
+  int pid = 0, found = 0;
+  if(dir == NULL) {
+    return 0;
+  }
+  while(NULL != (de = readdir(dir))) {
+    if(de->d_name[0] < '1' || de->d_name[0] > '9') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+    FILE * fp = fopen(path, "r");
+    if(fp == NULL) {
+      continue;
+    }
+    if(fgets(comm, sizeof(comm), fp) && strcmp(comm, "router\n") == 0) {
+      pid = atoi(de->d_name);
+      found++;
+    }
+    fclose(fp);
+  }
+  closedir(dir);
+  return found == 1 ? pid : 0;
+}
+
+// what the router's stats reply says.  The per-light table which
+// follows may overflow a udp socket with thousands of lights, so only
+// the totals and histogram, which come first, are needed.
+struct router_stats {
+  int have_totals, have_hist;
+  uint64_t forwarded, dropped;
+  struct sq_hist hist;
+};
+
+void collect_stats(void * msg, int len, void * arg) {
+  struct router_stats * st = arg;
+  struct sq_stats_totals * totals = msg;
+  struct sq_stats_hist * hist = msg;
+  if(totals->type == SQ_STATS_TOTALS) {
+    st->forwarded = totals->forwarded;
+    st->dropped = totals->dropped;
+    st->have_totals = 1;
+  } else if(hist->type == SQ_STATS_HIST) {
+    for(uint32_t i = 0; i < hist->n && hist->first + i < SQ_HIST_BUCKETS; i++) {
+      st->hist.counts[hist->first + i] = hist->counts[i];
+    }
+    st->have_hist = 1;
+  }
+}
+
+int query_router(struct router_stats * st) {
+  memset(st, 0, sizeof(*st));
+  sqlights_client_query_stats(collect_stats, st, 2000);
+  return st->have_totals && st->have_hist;
+}
+
+// the messages the router handled between two queries
+void hist_since(struct sq_hist * h, struct router_stats * before,
+		struct router_stats * after) {
+  sq_hist_init(h);
+  for(int i = 0; i < SQ_HIST_BUCKETS; i++) {
+    h->counts[i] = after->hist.counts[i] - before->hist.counts[i];
+    h->count += h->counts[i];
+    if(h->counts[i]) {
+      // the reply only says which bucket
+      h->max = i + 1 < SQ_HIST_BUCKETS ? sq_hist_bucket_low(i + 1) - 1
+	: sq_hist_bucket_low(i);
+    }
+  }
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-L (procs)\tlight processes (default 4)\n"
+	 "\t-n (lights)\tlights per light process (default 1000)\n"
+	 "\t-C (clients)\tclient processes (default 2)\n"
+	 "\t-r (rate)\tupdates per second per client, 0 for flat out\n"
+	 "\t\t\t(default 10000)\n"
+	 "\t-t (seconds)\thow long the clients send (default 5)\n"
+	 "\t-m (o,b,r,h)\tmix of onoff, brightness, rgb and hsi updates\n"
+	 "\t\t\t(default 1,4,1,1)\n"
+	 "\t-p (pid)\tthe router's pid, if it isn't called router\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  int router_pid = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "L:n:C:r:t:m:p:h")) != -1) {
+    switch(opt) {
+    case 'L': nprocs = atoi(optarg); break;
+    case 'n': nlights = atoi(optarg); break;
+    case 'C': nclients = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 't': duration = atof(optarg); break;
+    case 'm':
+      if(4 != sscanf(optarg, "%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3])
+	 || mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0
+	 || mix[0] + mix[1] + mix[2] + mix[3] == 0) {
+	printf("bad mix %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'p': router_pid = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(nprocs < 1 || nprocs > MAX_PROCS || nlights < 1
+     || nclients < 1 || nclients > MAX_CLIENTS || duration <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    routeraddr = argv[optind];
+  }
+  if(router_pid == 0) {
+    router_pid = find_router();
+  }
+
+  shared = mmap(NULL, sizeof(struct bench_shared), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  tryp(shared != MAP_FAILED, "mmap");
+  pid_t light_pids[MAX_PROCS], client_pids[MAX_CLIENTS];
+  fflush(stdout);
+  for(int p = 0; p < nprocs; p++) {
+    if(0 == (light_pids[p] = fork())) {
+      proc_index = p;
+      run_lights();
+    }
+  }
+  double deadline = now() + 30;
+  for(int p = 0; p < nprocs; p++) {
+    while(!shared->ready[p] && now() < deadline) {
+      usleep(1000);
+    }
+    if(!shared->ready[p]) {
+      printf("lights never registered; is the router running?\n");
+      for(int q = 0; q < nprocs; q++) kill(light_pids[q], SIGTERM);
+      return 1;
+    }
+  }
+
+  // the clients open their handles, then all start together
+  for(int c = 0; c < nclients; c++) {
+    if(0 == (client_pids[c] = fork())) {
+      run_client(c);
+    }
+  }
+  for(int c = 0; c < nclients; c++) {
+    while(!shared->client_ready[c]) {
+      usleep(1000);
+    }
+  }
+  struct router_stats before, after;
+  sqlights_client_initialize(routeraddr);
+  int have_stats = query_router(&before);
+  double cpu0 = router_pid ? cpu_seconds(router_pid) : -1;
+  double start = now();
+  shared->go = 1;
+  for(int c = 0; c < nclients; c++) {
+    waitpid(client_pids[c], NULL, 0);
+  }
+  double elapsed = now() - start;
+  double cpu1 = router_pid ? cpu_seconds(router_pid) : -1;
+  // let the last of them through
+  usleep(500000);
+  have_stats = have_stats && query_router(&after);
+
+  shared->stop = 1;
+  for(int p = 0; p < nprocs; p++) {
+    // wake it to see stop
+    char name[32];
+    snprintf(name, sizeof(name), "bench-%d-0", p);
+    sqlights_client_brightness(name, 0);
+  }
+  long sent = 0, lost_sending = 0, received = 0;
+  struct sq_hist end_to_end, router_light, handling;
+  sq_hist_init(&end_to_end);
+  sq_hist_init(&router_light);
+  for(int p = 0; p < nprocs; p++) {
+    waitpid(light_pids[p], NULL, 0);
+    received += shared->received[p];
+    sq_hist_add(&end_to_end, &shared->end_to_end[p]);
+    sq_hist_add(&router_light, &shared->router_light[p]);
+  }
+  for(int c = 0; c < nclients; c++) {
+    sent += shared->client[c].sent;
+    lost_sending += shared->client[c].queue_full + shared->client[c].send_errors;
+  }
+
+  printf("%d light processes x %d lights, %d clients at %.0f/s, %.1f s, via %s\n",
+	 nprocs, nlights, nclients, rate, elapsed, routeraddr);
+  printf("sent       %10ld  %10.0f/s", sent, sent / elapsed);
+  if(lost_sending) {
+    printf("  (%ld more lost sending)", lost_sending);
+  }
+  printf("\nreceived   %10ld  %10.0f/s\n", received, received / elapsed);
+  printf("lost       %10ld  %10.2f%%\n", sent - received,
+	 sent ? 100.0 * (sent - received) / sent : 0);
+  if(have_stats) {
+    printf("router forwarded %llu, dropped %llu\n",
+	   (unsigned long long)(after.forwarded - before.forwarded),
+	   (unsigned long long)(after.dropped - before.dropped));
+  }
+  if(cpu0 >= 0 && cpu1 >= 0) {
+    printf("router cpu %9.2f s  %9.1f%%  %.2f us/update\n", cpu1 - cpu0,
+	   100 * (cpu1 - cpu0) / elapsed,
+	   received ? 1e6 * (cpu1 - cpu0) / received : 0);
+  }
+  printf("latency in us:\n");
+  printf("end to end     ");
+  sq_hist_print(stdout, &end_to_end, 1000);
+  printf("router to light");
+  sq_hist_print(stdout, &router_light, 1000);
+  if(have_stats) {
+    hist_since(&handling, &before, &after);
+    printf("router handling");
+    sq_hist_print(stdout, &handling, 1000);
+  }
+  return 0;
+}
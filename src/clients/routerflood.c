@@ -0,0 +1,249 @@
+/* routerflood.c
+   floods the router with brightness updates for lights in forked
+   light processes, and reports how many got through, at what rate, and
+   how much cpu the router spent doing it.  Updates go out with
+   sendmmsg() so the sender isn't what runs out first.  Run it against a
+   router started with and without -i to compare the select() and
+   io_uring loops. */
+
+#define _GNU_SOURCE // sendmmsg
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#define MAX_PROCS 64
+#define MAX_BATCH 1024
+
+struct flood_shared {
+  volatile int ready[MAX_PROCS];
+  volatile long received[MAX_PROCS];
+};
+
+static struct flood_shared * shared;
+static int proc_index;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void flood_handler(light_t * light, float brightness) {
+  shared->received[proc_index]++;
+}
+
+void run_lights(char * routeraddr, int nlights) {
+  char name[32];
+  light_t ** lights = malloc(nlights * sizeof(light_t *));
+  if(sqlights_light_initialize(routeraddr)) {
+    exit(1);
+  }
+  for(int i = 0; i < nlights; i++) {
+    snprintf(name, sizeof(name), "flood-%d-%d", proc_index, i);
+    lights[i] = sqlights_add_light(name, SQ_FADEABLE);
+    lights[i]->brightness_handler = &flood_handler;
+  }
+  for(int i = 0; i < nlights; i++) {
+    while(!lights[i]->acked) {
+      sqlights_lights_handle(1);
+    }
+  }
+  shared->ready[proc_index] = 1;
+  while(1) {
+    sqlights_lights_handle(1);
+  }
+}
+
+// user and system cpu seconds pid has used, or -1
+double cpu_seconds(int pid) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE * fp = fopen(path, "r");
+  if(fp == NULL) {
+    return -1;
+  }
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = '\0';
+  // fields after the parenthesized command name, which may hold spaces
+  char * p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			 &utime, &stime) != 2) {
+    return -1;
+  }
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// opens a socket to the router at routeraddr, as lights.c would
+int router_socket(char * routeraddr, struct sockaddr_storage * addr,
+		  socklen_t * addrlen) {
+  int sock;
+  memset(addr, 0, sizeof(*addr));
+  if(strncmp(routeraddr, "unix:", 5) == 0) {
+    struct sockaddr_un * sun = (struct sockaddr_un *)addr;
+    sun->sun_family = AF_UNIX;
+    strncpy(sun->sun_path, routeraddr[5] ? routeraddr + 5 : SQ_UNIX_SOCKET,
+	    sizeof(sun->sun_path) - 1);
+    *addrlen = sizeof(struct sockaddr_un);
+    tryp(0 <= (sock = socket(AF_UNIX, SOCK_DGRAM, 0)), "socket");
+    return sock;
+  }
+  struct sockaddr_in * sin = (struct sockaddr_in *)addr;
+  struct hostent * host;
+  try(NULL != (host = gethostbyname(routeraddr)), "Invalid host name");
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(SQ_PORT);
+  memmove(&sin->sin_addr, host->h_addr, host->h_length);
+  *addrlen = sizeof(struct sockaddr_in);
+  tryp(0 <= (sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)), "socket");
+  return sock;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname|unix:[path]]\n"
+	 "\t-P (procs)\tlight processes (default 2)\n"
+	 "\t-n (lights)\tlights per process (default 16)\n"
+	 "\t-t (seconds)\thow long to send (default 5)\n"
+	 "\t-r (rate)\tupdates per second, or 0 for flat out (default 0)\n"
+	 "\t-b (batch)\tupdates per sendmmsg() (default 64)\n"
+	 "\t-p (pid)\tthe router's pid, to report its cpu use\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  char * routeraddr = "localhost";
+  int nprocs = 2, nlights = 16, batch = 64, router_pid = 0;
+  double duration = 5, rate = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "P:n:t:r:b:p:h")) != -1) {
+    switch(opt) {
+    case 'P': nprocs = atoi(optarg); break;
+    case 'n': nlights = atoi(optarg); break;
+    case 't': duration = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    case 'p': router_pid = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(nprocs < 1 || nprocs > MAX_PROCS || nlights < 1
+     || batch < 1 || batch > MAX_BATCH) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    routeraddr = argv[optind];
+  }
+
+  shared = mmap(NULL, sizeof(struct flood_shared), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  tryp(shared != MAP_FAILED, "mmap");
+  pid_t pids[MAX_PROCS];
+  fflush(stdout);
+  for(int p = 0; p < nprocs; p++) {
+    if(0 == (pids[p] = fork())) {
+      proc_index = p;
+      run_lights(routeraddr, nlights);
+    }
+  }
+  double deadline = now() + 10;
+  for(int p = 0; p < nprocs; p++) {
+    while(!shared->ready[p] && now() < deadline) {
+      usleep(1000);
+    }
+    if(!shared->ready[p]) {
+      printf("lights never registered; is the router running?\n");
+      for(int q = 0; q < nprocs; q++) kill(pids[q], SIGTERM);
+      return 1;
+    }
+  }
+
+  // one message per light, sent round robin
+  int nmsgs = nprocs * nlights;
+  struct sq_light_brightness * msgs = calloc(nmsgs, sizeof(*msgs));
+  for(int i = 0; i < nmsgs; i++) {
+    msgs[i].type = SQ_LIGHT_BRIGHTNESS;
+    snprintf(msgs[i].name, sizeof(msgs[i].name), "flood-%d-%d",
+	     i / nlights, i % nlights);
+    msgs[i].brightness = 0.5;
+  }
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int sock = router_socket(routeraddr, &addr, &addrlen);
+  struct mmsghdr mmsgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+
+  long sent = 0, send_errors = 0;
+  double cpu0 = router_pid ? cpu_seconds(router_pid) : -1;
+  double start = now(), end = start + duration;
+  int next = 0;
+  while(now() < end) {
+    if(rate > 0) {
+      double due = start + sent / rate;
+      double wait = due - now();
+      if(wait > 0) {
+	usleep(wait * 1e6);
+      }
+    }
+    memset(mmsgs, 0, batch * sizeof(struct mmsghdr));
+    for(int i = 0; i < batch; i++) {
+      iovs[i].iov_base = &msgs[next];
+      iovs[i].iov_len = sizeof(struct sq_light_brightness);
+      mmsgs[i].msg_hdr.msg_name = &addr;
+      mmsgs[i].msg_hdr.msg_namelen = addrlen;
+      mmsgs[i].msg_hdr.msg_iov = &iovs[i];
+      mmsgs[i].msg_hdr.msg_iovlen = 1;
+      next = (next + 1) % nmsgs;
+    }
+    int n = sendmmsg(sock, mmsgs, batch, 0);
+    if(n < 0) {
+      if(errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+	dieperr("sendmmsg");
+      }
+      send_errors++;
+      continue;
+    }
+    sent += n;
+  }
+  double elapsed = now() - start;
+  double cpu1 = router_pid ? cpu_seconds(router_pid) : -1;
+  // let the last of them through
+  usleep(500000);
+
+  long received = 0;
+  for(int p = 0; p < nprocs; p++) {
+    received += shared->received[p];
+    kill(pids[p], SIGTERM);
+    waitpid(pids[p], NULL, 0);
+  }
+
+  printf("%d light processes, %d lights, %.1f s\n", nprocs, nmsgs, elapsed);
+  printf("sent      %10ld  %10.0f/s\n", sent, sent / elapsed);
+  printf("received  %10ld  %10.0f/s\n", received, received / elapsed);
+  printf("lost      %10ld  %10.2f%%\n", sent - received,
+	 sent ? 100.0 * (sent - received) / sent : 0);
+  if(send_errors) {
+    printf("sendmmsg() refused %ld times\n", send_errors);
+  }
+  if(cpu0 >= 0 && cpu1 >= 0) {
+    printf("router cpu %9.2f s  %9.1f%%  %.2f us/update\n", cpu1 - cpu0,
+	   100 * (cpu1 - cpu0) / elapsed,
+	   received ? 1e6 * (cpu1 - cpu0) / received : 0);
+  }
+  return 0;
+}
@@ -0,0 +1,184 @@
+/* schedbench.c
+   measures how closely updates land on time.  Forks a light process,
+   then has it sent a brightness update every period, two ways: live,
+   the client sleeping until each update's time and sending it then;
+   and scheduled, the client sending a whole bar's worth ahead with
+   sqlights_client_at() and the router releasing each at its time.
+   The light stamps CLOCK_REALTIME as each arrives, and the report is
+   how late they were.  The router must already be running. */
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_COUNT 1000
+#define BAR 16  // updates sent ahead at once when scheduling
+
+struct bench_shared {
+  volatile int ready;
+  volatile int stop;
+  int count;
+  uint64_t * due;
+  uint64_t * handled;
+};
+
+static struct bench_shared * shared;
+
+static int cmp_double(const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while(clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL)) {
+  }
+}
+
+void bench_handler(light_t * light, float brightness) {
+  uint64_t t = sqlights_time();
+  int i = (int)brightness;
+  if(i >= 0 && i < shared->count) {
+    shared->handled[i] = t;
+  }
+}
+
+void run_light(char * routeraddr, char * name) {
+  if(sqlights_light_initialize(routeraddr)) {
+    exit(1);
+  }
+  light_t * light = sqlights_add_light(name, SQ_FADEABLE);
+  light->brightness_handler = &bench_handler;
+  while(!light->acked) {
+    sqlights_lights_handle(1);
+  }
+  shared->ready = 1;
+  while(!shared->stop) {
+    sqlights_lights_handle(1);
+  }
+  exit(0);
+}
+
+void report(char * label, int count) {
+  int n = 0, lost = 0;
+  double * late = malloc(count * sizeof(double));
+  for(int i = 0; i < count; i++) {
+    if(shared->handled[i] == 0) {
+      lost++;
+    } else {
+      late[n++] = 1e-3 * (int64_t)(shared->handled[i] - shared->due[i]);
+    }
+  }
+  qsort(late, n, sizeof(double), cmp_double);
+  if(n > 0) {
+    printf("%-10s %7d %6d %9.1f %9.1f %9.1f %9.1f %9.1f\n", label, n, lost,
+	   late[0], late[n/2], late[(int)(n*0.9)], late[(int)(n*0.99)],
+	   late[n-1]);
+  } else {
+    printf("%-10s %7d %6d\n", label, n, lost);
+  }
+  free(late);
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-n (count)\tupdates each way (default %d)\n"
+	 "\t-p (ms)\t\tbetween updates (default 10)\n",
+	 prgname, DEFAULT_COUNT);
+}
+
+int main(int argc, char** argv) {
+  char * routeraddr = "localhost";
+  int count = DEFAULT_COUNT;
+  double period_ms = 10;
+  char name[32];
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:p:h")) != -1) {
+    switch(opt) {
+    case 'n': count = atoi(optarg); break;
+    case 'p': period_ms = atof(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(count < 1 || count > (1 << 24) || period_ms <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    routeraddr = argv[optind];
+  }
+
+  size_t size = sizeof(struct bench_shared) + 2 * count * sizeof(uint64_t);
+  void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  tryp(mem != MAP_FAILED, "mmap");
+  shared = mem;
+  shared->count = count;
+  shared->due = (uint64_t *)(shared + 1);
+  shared->handled = shared->due + count;
+
+  snprintf(name, sizeof(name), "schedbench-%d", (int)getpid());
+  pid_t pid;
+  fflush(stdout);
+  if(0 == (pid = fork())) {
+    run_light(routeraddr, name);
+  }
+  for(int waited = 0; !shared->ready && waited < 5000; waited++) {
+    usleep(1000);
+  }
+  if(!shared->ready) {
+    printf("light never registered; is the router running?\n");
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  sqlights_client_initialize(routeraddr);
+  uint64_t period = period_ms * 1e6;
+
+  printf("lateness in us, an update every %.1f ms\n", period_ms);
+  printf("             count   lost       min       p50       p90       p99       max\n");
+
+  // live: each sent at its time
+  memset(shared->handled, 0, count * sizeof(uint64_t));
+  uint64_t start = sqlights_time() + period;
+  for(int i = 0; i < count; i++) {
+    shared->due[i] = start + i * period;
+    sleep_until(shared->due[i]);
+    sqlights_client_brightness(name, i);
+  }
+  usleep(100000);
+  report("live", count);
+
+  // scheduled: a bar at a time, a bar ahead
+  memset(shared->handled, 0, count * sizeof(uint64_t));
+  start = sqlights_time() + BAR * period;
+  for(int i = 0; i < count; i++) {
+    shared->due[i] = start + i * period;
+  }
+  for(int i = 0; i < count; i++) {
+    if(i % BAR == 0 && i >= BAR) {
+      sleep_until(shared->due[i - BAR]);
+    }
+    sqlights_client_at(shared->due[i]);
+    sqlights_client_brightness(name, i);
+  }
+  sqlights_client_at(0);
+  sleep_until(shared->due[count - 1]);
+  usleep(100000);
+  report("scheduled", count);
+
+  shared->stop = 1;
+  sqlights_client_brightness(name, -1); // wake it to see stop
+  waitpid(pid, NULL, 0);
+  return 0;
+}
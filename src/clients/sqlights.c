@@ -1,6 +1,7 @@
 /* light control by the command line */
 
 #include "protocol.h"
+#include "histogram.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,8 +10,16 @@
 void print_usage(char* prgname) {
     printf("usage: %s\n"
 	   "\tlist\n"
+	   "\tstats\n"
 	   "\ton (lightname)\n"
 	   "\toff (lightname)\n"
+	   "\tfade (lightname) (ms) (brightness)\n"
+	   "\tfadergb (lightname) (ms) (r) (g) (b)\n"
+	   "\tfadehsi (lightname) (ms) (h) (s) (i)\n"
+	   "\teffect (group) chase|wheel|strobe|stop (period ms) (level) (param)\n"
+	   "\tcapture (scene) [group]\n"
+	   "\trecall (scene) [fade ms]\n"
+	   "\tforget (scene)\n"
 	   //	   "\tset (lightname) (brightness)\n"
 	   //	   "\trgb (lightname) (r) (g) (b)\n"
 	   //	   "\thsi (lightname) (h) (s) (i)\n\n"
@@ -25,12 +34,150 @@ float read_arg_float(int argc, char** argv, int i) {
   return (float)atof(argv[i]);
 }
 
+static const char * msg_type_names[SQ_NUM_MSG_TYPES] = {
+  [SQ_REG_LIGHT] = "reg_light", [SQ_ACK_REG] = "ack_reg",
+  [SQ_CHECK_LIGHT] = "check_light", [SQ_ACK_CHECK] = "ack_check",
+  [SQ_LIGHT_ONOFF] = "onoff", [SQ_LIGHT_BRIGHTNESS] = "brightness",
+  [SQ_LIGHT_RGB] = "rgb", [SQ_LIGHT_HSI] = "hsi", [SQ_DIE] = "die",
+  [SQ_STATS_QUERY] = "stats_query", [SQ_FADE] = "fade",
+  [SQ_EFFECT] = "effect", [SQ_SCENE_CAPTURE] = "scene_capture",
+  [SQ_SCENE_RECALL] = "scene_recall"
+};
+
+static const char * effect_names[] = {
+  [SQ_FX_STOP] = "stop", [SQ_FX_CHASE] = "chase",
+  [SQ_FX_COLOR_WHEEL] = "wheel", [SQ_FX_STROBE] = "strobe"
+};
+
+struct stats_reply {
+  struct sq_hist hist;
+  int nlights;
+};
+
+void print_stats_msg(void * msg, int len, void * arg) {
+  struct stats_reply * reply = arg;
+  struct sq_stats_totals * totals = msg;
+  struct sq_stats_hist * hist = msg;
+  struct sq_stats_lights * lights = msg;
+  struct sq_stats_end * end = msg;
+  char name[33];
+
+  switch(totals->type) {
+  case SQ_STATS_TOTALS:
+    printf("%u lights, %u shared-memory peers\n", totals->lights,
+	   totals->peers);
+    printf("received:");
+    for(int t = 1; t < SQ_NUM_MSG_TYPES; t++) {
+      if(totals->in[t] && msg_type_names[t]) {
+	printf(" %s %llu", msg_type_names[t],
+	       (unsigned long long)totals->in[t]);
+      }
+    }
+    printf("\nforwarded %llu, dropped %llu, for unknown lights %llu, bad %llu\n",
+	   (unsigned long long)totals->forwarded,
+	   (unsigned long long)totals->dropped,
+	   (unsigned long long)totals->unknown_dest,
+	   (unsigned long long)totals->bad);
+    if(totals->scheduled || totals->schedule_full) {
+      printf("scheduled %llu, %u held now, %llu refused as too many\n",
+	     (unsigned long long)totals->scheduled, totals->held,
+	     (unsigned long long)totals->schedule_full);
+    }
+    if(totals->rendered || totals->fading || totals->effects) {
+      printf("rendered %llu in %llu datagrams, %u fading and %u effects now\n",
+	     (unsigned long long)totals->rendered,
+	     (unsigned long long)totals->batches, totals->fading,
+	     totals->effects);
+    }
+    if(totals->scenes) {
+      printf("%u scenes\n", totals->scenes);
+    }
+    break;
+  case SQ_STATS_HIST:
+    for(uint32_t i = 0; i < hist->n && hist->first + i < SQ_HIST_BUCKETS; i++) {
+      uint32_t b = hist->first + i;
+      reply->hist.counts[b] = hist->counts[i];
+      reply->hist.count += hist->counts[i];
+      if(hist->counts[i]) {
+	// the max is only known to the bucket
+	uint64_t high = b + 1 < SQ_HIST_BUCKETS ? sq_hist_bucket_low(b + 1) - 1
+	  : sq_hist_bucket_low(b);
+	reply->hist.max = high > reply->hist.max ? high : reply->hist.max;
+      }
+    }
+    break;
+  case SQ_STATS_LIGHTS:
+    if(reply->nlights == 0) {
+      printf("time to handle a message, in us:\n");
+      sq_hist_print(stdout, &reply->hist, 1000);
+      printf("%-32s %12s %12s %12s\n", "light", "messages", "forwarded",
+	     "dropped");
+    }
+    for(uint32_t i = 0; i < lights->n && i < SQ_STATS_LIGHTS_PER_MSG; i++) {
+      strncpy(name, lights->lights[i].name, 32);
+      name[32] = '\0';
+      printf("%-32s %12llu %12llu %12llu\n", name,
+	     (unsigned long long)lights->lights[i].in,
+	     (unsigned long long)lights->lights[i].forwarded,
+	     (unsigned long long)lights->lights[i].dropped);
+      reply->nlights++;
+    }
+    break;
+  case SQ_STATS_END:
+    if(reply->nlights == 0) {
+      printf("time to handle a message, in us:\n");
+      sq_hist_print(stdout, &reply->hist, 1000);
+    }
+    if(end->nlights > reply->nlights) {
+      printf("(%u lights lost from the reply)\n", end->nlights - reply->nlights);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
 // assumes enough arguments.
 void handle_command(int argc, char** argv) {
-  if(strcmp(argv[2], "on")==0) {
+  if(strcmp(argv[2], "stats")==0) {
+    struct stats_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    if(sqlights_client_query_stats(print_stats_msg, &reply, 2000)) {
+      printf("no reply from the router\n");
+    }
+  } else if(strcmp(argv[2], "on")==0) {
     sqlights_client_seton(argv[3], 1);
   } else if(strcmp(argv[2], "off")==0) {
     sqlights_client_seton(argv[3], 0);
+  } else if(strcmp(argv[2], "fade")==0) {
+    sqlights_client_fade_brightness(argv[3], read_arg_float(argc, argv, 5),
+				    read_arg_float(argc, argv, 4));
+  } else if(strcmp(argv[2], "fadergb")==0) {
+    sqlights_client_fade_rgb(argv[3], read_arg_float(argc, argv, 5),
+			     read_arg_float(argc, argv, 6),
+			     read_arg_float(argc, argv, 7),
+			     read_arg_float(argc, argv, 4));
+  } else if(strcmp(argv[2], "fadehsi")==0) {
+    sqlights_client_fade_hsi(argv[3], read_arg_float(argc, argv, 5),
+			     read_arg_float(argc, argv, 6),
+			     read_arg_float(argc, argv, 7),
+			     read_arg_float(argc, argv, 4));
+  } else if(strcmp(argv[2], "effect")==0 && argc > 4) {
+    int effect;
+    for(effect = SQ_FX_STROBE; effect > SQ_FX_STOP; effect--) {
+      if(strcmp(argv[4], effect_names[effect])==0) {
+	break;
+      }
+    }
+    sqlights_client_effect(argv[3], effect, read_arg_float(argc, argv, 5),
+			   read_arg_float(argc, argv, 6),
+			   read_arg_float(argc, argv, 7));
+  } else if(strcmp(argv[2], "capture")==0) {
+    sqlights_client_scene_capture(argv[3], argc > 4 ? argv[4] : "*");
+  } else if(strcmp(argv[2], "recall")==0) {
+    sqlights_client_scene_recall(argv[3], read_arg_float(argc, argv, 4));
+  } else if(strcmp(argv[2], "forget")==0) {
+    sqlights_client_scene_capture(argv[3], "");
   }
   /* else if(strcmp(argv[1], "set")==0) { */
   /*   float b = read_arg_float(argc, argv, 3); */
@@ -0,0 +1,53 @@
+// color.c
+// implementation of color.h
+
+#include "color.h"
+
+// Written without branches, and with the arrays restrict, so that it
+// vectorizes, and built at -O3 so that it does whatever the rest is;
+// as in kshow's bands, gcc won't if-convert the float compares unless
+// it may assume they don't trap.
+__attribute__((optimize("O3", "no-trapping-math")))
+static void sq_hsi_to_rgb_loop(int n, const float * restrict hue,
+			       const float * restrict sat,
+			       float * restrict red, float * restrict green,
+			       float * restrict blue) {
+  for(int i = 0; i < n; i++) {
+    float h = hue[i], s = sat[i];
+    // which third of the wheel, and where in it from its middle.  The
+    // floors are by hand, as truncation, since floorf won't vectorize
+    // everywhere.
+    float turns = h * (1.0f / 360);
+    float t = (float)(int)turns;
+    t -= t > turns;
+    h -= 360 * t;
+    float k = (float)(int)(h * (1.0f / 120));
+    k = k > 2 ? 2 : k;
+    float x = (h - 120 * k - 60) * (float)(3.14159265358979 / 180);
+
+    // sin and cos of |x| <= pi/3, to x^9 and x^10
+    float x2 = x * x;
+    float sn = x * (1 + x2 * (-1.0f / 6 + x2 * (1.0f / 120
+			     + x2 * (-1.0f / 5040 + x2 * (1.0f / 362880)))));
+    float cs = 1 + x2 * (-1.0f / 2 + x2 * (1.0f / 24 + x2 * (-1.0f / 720
+			 + x2 * (1.0f / 40320 + x2 * (-1.0f / 3628800)))));
+    float f = 0.5f - 0.8660254f * sn / cs;
+
+    // the third's leading, trailing and missing components
+    float lead = (1 + s * f) * (1.0f / 3);
+    float trail = (1 + s * (1 - f)) * (1.0f / 3);
+    float none = (1 - s) * (1.0f / 3);
+    red[i] = k == 0 ? lead : k == 1 ? none : trail;
+    green[i] = k == 0 ? trail : k == 1 ? lead : none;
+    blue[i] = k == 0 ? none : k == 1 ? trail : lead;
+  }
+}
+
+void sq_hsi_to_rgb(float h, float s, float * r, float * g, float * b) {
+  sq_hsi_to_rgb_loop(1, &h, &s, r, g, b);
+}
+
+void sq_hsi_to_rgb_n(int n, const float * h, const float * s,
+		     float * r, float * g, float * b) {
+  sq_hsi_to_rgb_loop(n, h, s, r, g, b);
+}
@@ -0,0 +1,653 @@
+// cues.c
+// implementation of cues.h
+
+#include "cues.h"
+#include "protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LINESIZE 512
+#define MAX_ARGS 8
+// longer than any show, and well within uint64_t ns
+#define MAX_SECONDS 1e10
+
+static const char * effect_names[] = {
+  [SQ_FX_STOP] = "stop", [SQ_FX_CHASE] = "chase",
+  [SQ_FX_COLOR_WHEEL] = "wheel", [SQ_FX_STROBE] = "strobe"
+};
+
+// parses [[h:]m:]s[.fraction] into ns.  Returns 0, or -1 if it isn't one.
+static int sq_cues_parse_time(const char * s, uint64_t * t) {
+  double total = 0;
+  char * end;
+  while(1) {
+    double part = strtod(s, &end);
+    // which also keeps out inf, nan and the like
+    if(end == s || !(part >= 0 && part < MAX_SECONDS)) {
+      return -1;
+    }
+    total += part;
+    if(*end != ':') {
+      break;
+    }
+    if(part != (long)part) {
+      return -1;
+    }
+    total *= 60;
+    s = end + 1;
+  }
+  if(*end != '\0' || !(total < MAX_SECONDS)) {
+    return -1;
+  }
+  *t = total * 1e9 + 0.5;
+  return 0;
+}
+
+static int sq_cues_parse_floats(char ** args, int n, float * v) {
+  for(int i = 0; i < n; i++) {
+    char * end;
+    v[i] = strtof(args[i], &end);
+    if(end == args[i] || *end != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// makes action, with its nargs arguments, on target into the cue's
+// message.  Returns 0, or -1 with why in err.
+static int sq_cues_parse_action(struct sq_cue * cue, const char * target,
+				const char * action, char ** args, int nargs,
+				const char ** err) {
+  float v[5];
+  memset(cue->msg, 0, sizeof(cue->msg));
+  if(0 == strcmp(action, "on") || 0 == strcmp(action, "off")) {
+    struct sq_light_onoff * msg = (struct sq_light_onoff *)cue->msg;
+    if(nargs != 0) {
+      *err = "on and off take no values";
+      return -1;
+    }
+    msg->type = SQ_LIGHT_ONOFF;
+    strncpy(msg->name, target, 32);
+    msg->seton = action[1] == 'n';
+  } else if(0 == strcmp(action, "brightness")) {
+    struct sq_light_brightness * msg = (struct sq_light_brightness *)cue->msg;
+    if(nargs != 1 || sq_cues_parse_floats(args, 1, v)) {
+      *err = "brightness takes a value";
+      return -1;
+    }
+    msg->type = SQ_LIGHT_BRIGHTNESS;
+    strncpy(msg->name, target, 32);
+    msg->brightness = v[0];
+  } else if(0 == strcmp(action, "rgb") || 0 == strcmp(action, "hsi")) {
+    struct sq_light_color * msg = (struct sq_light_color *)cue->msg;
+    if(nargs != 3 || sq_cues_parse_floats(args, 3, v)) {
+      *err = "rgb and hsi take three values";
+      return -1;
+    }
+    msg->type = action[0] == 'r' ? SQ_LIGHT_RGB : SQ_LIGHT_HSI;
+    strncpy(msg->name, target, 32);
+    msg->color.rgb.r = v[0];
+    msg->color.rgb.g = v[1];
+    msg->color.rgb.b = v[2];
+  } else if(0 == strcmp(action, "fade") || 0 == strcmp(action, "fadergb")
+	    || 0 == strcmp(action, "fadehsi")) {
+    struct sq_fade * msg = (struct sq_fade *)cue->msg;
+    int n = action[4] == '\0' ? 1 : 3;
+    if(nargs != n + 1 || sq_cues_parse_floats(args, n + 1, v) || v[n] < 0) {
+      *err = n == 1 ? "fade takes a value and ms"
+	: "fadergb and fadehsi take three values and ms";
+      return -1;
+    }
+    msg->type = SQ_FADE;
+    strncpy(msg->name, target, 32);
+    msg->to = n == 1 ? SQ_LIGHT_BRIGHTNESS
+      : action[4] == 'r' ? SQ_LIGHT_RGB : SQ_LIGHT_HSI;
+    memcpy(msg->value, v, n * sizeof(float));
+    msg->ms = v[n];
+  } else if(0 == strcmp(action, "effect")) {
+    struct sq_effect * msg = (struct sq_effect *)cue->msg;
+    int effect;
+    for(effect = SQ_FX_STROBE; effect >= SQ_FX_STOP; effect--) {
+      if(nargs > 0 && 0 == strcmp(args[0], effect_names[effect])) {
+	break;
+      }
+    }
+    v[2] = 0;
+    if(effect < 0) {
+      *err = "effect is chase, wheel, strobe or stop";
+      return -1;
+    }
+    if(effect != SQ_FX_STOP
+       && (nargs < 3 || nargs > 4 || sq_cues_parse_floats(args + 1, nargs - 1, v)
+	   || v[0] < 1)) {
+      *err = "effect takes a period in ms, a level and maybe a parameter";
+      return -1;
+    }
+    msg->type = SQ_EFFECT;
+    strncpy(msg->group, target, 32);
+    msg->effect = effect;
+    if(effect != SQ_FX_STOP) {
+      msg->period_ms = v[0];
+      msg->level = v[1];
+      msg->param = v[2];
+    }
+  } else if(0 == strcmp(action, "recall")) {
+    struct sq_scene_recall * msg = (struct sq_scene_recall *)cue->msg;
+    if(nargs > 1 || sq_cues_parse_floats(args, nargs, v)
+       || (nargs && v[0] < 0)) {
+      *err = "recall takes a scene, and maybe ms to fade to it over";
+      return -1;
+    }
+    msg->type = SQ_SCENE_RECALL;
+    strncpy(msg->scene, target, 32);
+    msg->fade_ms = nargs ? v[0] : 0;
+  } else {
+    *err = "unknown action";
+    return -1;
+  }
+  cue->len = sqlights_msg_size(((struct sq_msg *)cue->msg)->type);
+  return 0;
+}
+
+static int sq_cue_cmp(const void * a, const void * b) {
+  const struct sq_cue * x = a, * y = b;
+  if(x->track != y->track) {
+    return x->track < y->track ? -1 : 1;
+  }
+  if(x->t != y->t) {
+    return x->t < y->t ? -1 : 1;
+  }
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// sorts the cues and makes the track table from them, then keyframes
+// every key_ms of each track
+static void sq_cues_index(struct sq_cue_table * table, uint32_t key_ms) {
+  uint32_t n = table->header.ncues;
+  qsort(table->cues, n, sizeof(struct sq_cue), sq_cue_cmp);
+  table->header.ntracks = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    if(i == 0 || table->cues[i].track != table->cues[i - 1].track) {
+      table->header.ntracks++;
+    }
+  }
+  table->tracks = calloc(table->header.ntracks + 1, sizeof(struct sq_cue_track));
+  struct sq_cue_track * track = table->tracks - 1;
+  for(uint32_t i = 0; i < n; i++) {
+    if(i == 0 || table->cues[i].track != table->cues[i - 1].track) {
+      track++;
+      track->track = table->cues[i].track;
+      track->first = i;
+    }
+    track->n++;
+    track->last = table->cues[i].t;
+  }
+
+  struct sq_cue_state state;
+  uint32_t keys_size = 0, keycues_size = 0;
+  key_ms = key_ms ? key_ms : SQ_CUES_KEY_MS;
+  uint64_t key_ns = (uint64_t)key_ms * 1000000;
+  table->header.key_ms = key_ms;
+  table->header.nkeys = table->header.nkeycues = 0;
+  sq_cue_state_init(&state);
+  for(track = table->tracks; track < table->tracks + table->header.ntracks;
+      track++) {
+    uint32_t i = track->first, end = track->first + track->n;
+    state.n = 0;
+    track->firstkey = table->header.nkeys;
+    for(uint64_t t = 0; ; t += key_ns) {
+      while(i < end && table->cues[i].t < t) {
+	sq_cue_state_apply(&state, table, i++);
+      }
+      if(table->header.nkeys == keys_size) {
+	keys_size = keys_size ? 2 * keys_size : 64;
+	table->keys = realloc(table->keys, keys_size * sizeof(struct sq_cue_key));
+      }
+      while(table->header.nkeycues + state.n > keycues_size) {
+	keycues_size = keycues_size ? 2 * keycues_size : 1024;
+	table->keycues = realloc(table->keycues,
+				 keycues_size * sizeof(uint32_t));
+      }
+      struct sq_cue_key * key = &table->keys[table->header.nkeys++];
+      memset(key, 0, sizeof(*key));
+      key->t = t;
+      key->next = i;
+      key->first = table->header.nkeycues;
+      key->n = state.n;
+      if(state.n) {
+	memcpy(table->keycues + key->first, state.cues,
+	       state.n * sizeof(uint32_t));
+      }
+      table->header.nkeycues += state.n;
+      if(t + key_ns > track->last) {
+	break;
+      }
+    }
+    track->nkeys = table->header.nkeys - track->firstkey;
+  }
+  sq_cue_state_free(&state);
+}
+
+int sq_cues_parse(FILE * fp, const char * path, uint32_t key_ms,
+		  struct sq_cue_table * table) {
+  char line[LINESIZE];
+  uint32_t size = 0;
+  int lineno = 0, bad = 0;
+  memset(table, 0, sizeof(*table));
+  memcpy(table->header.magic, SQ_CUES_MAGIC, sizeof(table->header.magic));
+  table->header.version = SQ_CUES_VERSION;
+
+  while(fgets(line, sizeof(line), fp)) {
+    char * words[4 + MAX_ARGS];
+    int nwords = 0;
+    const char * err = NULL;
+    char * end;
+    lineno++;
+    if(NULL != (end = strchr(line, '#'))) {
+      *end = '\0';
+    }
+    for(char * w = strtok(line, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+      if(nwords < 4 + MAX_ARGS) {
+	words[nwords] = w;
+      }
+      nwords++;
+    }
+    if(nwords == 0) {
+      continue;
+    }
+    if(table->header.ncues == size) {
+      size = size ? 2 * size : 256;
+      table->cues = realloc(table->cues, size * sizeof(struct sq_cue));
+    }
+    struct sq_cue * cue = &table->cues[table->header.ncues];
+    memset(cue, 0, sizeof(*cue));
+    cue->line = lineno;
+    long track = strtol(words[0], &end, 10);
+    if(nwords < 4) {
+      err = "wants a track, a time, a target and an action";
+    } else if(nwords > 4 + MAX_ARGS) {
+      err = "too many values";
+    } else if(*end != '\0' || end == words[0] || track < 0
+	      || track > UINT32_MAX) {
+      err = "the track isn't a number";
+    } else if(sq_cues_parse_time(words[1], &cue->t)) {
+      err = "the time isn't [[h:]m:]s[.fraction]";
+    } else if(strlen(words[2]) > 32) {
+      err = "the target's name is longer than 32";
+    } else {
+      cue->track = track;
+      sq_cues_parse_action(cue, words[2], words[3], words + 4, nwords - 4,
+			   &err);
+    }
+    if(err) {
+      printf("%s:%d: %s\n", path, lineno, err);
+      bad = 1;
+      continue;
+    }
+    table->header.ncues++;
+  }
+  sq_cues_index(table, key_ms);
+  if(bad) {
+    sq_cues_free(table);
+    return -1;
+  }
+  return 0;
+}
+
+int sq_cues_write(const char * path, const struct sq_cue_table * table) {
+  FILE * fp = fopen(path, "w");
+  if(fp == NULL) {
+    return -1;
+  }
+  if(1 != fwrite(&table->header, sizeof(table->header), 1, fp)
+     || table->header.ntracks != fwrite(table->tracks,
+					sizeof(struct sq_cue_track),
+					table->header.ntracks, fp)
+     || table->header.ncues != fwrite(table->cues, sizeof(struct sq_cue),
+				      table->header.ncues, fp)
+     || table->header.nkeys != fwrite(table->keys, sizeof(struct sq_cue_key),
+				      table->header.nkeys, fp)
+     || table->header.nkeycues != fwrite(table->keycues, sizeof(uint32_t),
+					 table->header.nkeycues, fp)) {
+    fclose(fp);
+    return -1;
+  }
+  return fclose(fp) ? -1 : 0;
+}
+
+int sq_cues_load(const char * path, struct sq_cue_table * table) {
+  FILE * fp = fopen(path, "r");
+  memset(table, 0, sizeof(*table));
+  if(fp == NULL) {
+    return -1;
+  }
+  struct sq_cue_header * h = &table->header;
+  if(1 != fread(h, sizeof(*h), 1, fp)
+     || memcmp(h->magic, SQ_CUES_MAGIC, sizeof(h->magic))
+     || h->version != SQ_CUES_VERSION
+     || h->ntracks > h->ncues || h->ncues > (1 << 26)
+     || h->nkeys > (1 << 26) || h->nkeycues > (1 << 28)) {
+    fclose(fp);
+    return -1;
+  }
+  table->tracks = malloc((h->ntracks + 1) * sizeof(struct sq_cue_track));
+  table->cues = malloc((h->ncues + 1) * sizeof(struct sq_cue));
+  table->keys = malloc((h->nkeys + 1) * sizeof(struct sq_cue_key));
+  table->keycues = malloc((h->nkeycues + 1) * sizeof(uint32_t));
+  int bad = h->ntracks != fread(table->tracks, sizeof(struct sq_cue_track),
+				h->ntracks, fp)
+    || h->ncues != fread(table->cues, sizeof(struct sq_cue), h->ncues, fp)
+    || h->nkeys != fread(table->keys, sizeof(struct sq_cue_key), h->nkeys, fp)
+    || h->nkeycues != fread(table->keycues, sizeof(uint32_t), h->nkeycues, fp);
+  fclose(fp);
+  // cursors and seeks trust these, so check them now
+  for(uint32_t i = 0; !bad && i < h->ntracks; i++) {
+    struct sq_cue_track * track = &table->tracks[i];
+    bad = track->first > h->ncues || track->n > h->ncues - track->first
+      || track->firstkey > h->nkeys || track->nkeys > h->nkeys - track->firstkey
+      || track->nkeys == 0 || table->keys[track->firstkey].t != 0;
+    for(uint32_t k = 0; !bad && k < track->nkeys; k++) {
+      struct sq_cue_key * key = &table->keys[track->firstkey + k];
+      bad = key->next < track->first || key->next > track->first + track->n
+	|| key->first > h->nkeycues || key->n > h->nkeycues - key->first;
+    }
+  }
+  for(uint32_t i = 0; !bad && i < h->ncues; i++) {
+    bad = table->cues[i].len > SQ_CUE_MSG_SIZE;
+  }
+  for(uint32_t i = 0; !bad && i < h->nkeycues; i++) {
+    bad = table->keycues[i] >= h->ncues;
+  }
+  if(bad) {
+    sq_cues_free(table);
+    return -1;
+  }
+  return 0;
+}
+
+void sq_cues_free(struct sq_cue_table * table) {
+  free(table->tracks);
+  free(table->cues);
+  free(table->keys);
+  free(table->keycues);
+  table->tracks = NULL;
+  table->cues = NULL;
+  table->keys = NULL;
+  table->keycues = NULL;
+  table->header.ntracks = table->header.ncues = 0;
+  table->header.nkeys = table->header.nkeycues = 0;
+}
+
+const struct sq_cue_track * sq_cues_track(const struct sq_cue_table * table,
+					  uint32_t track) {
+  uint32_t lo = 0, hi = table->header.ntracks;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(table->tracks[mid].track < track) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if(lo < table->header.ntracks && table->tracks[lo].track == track) {
+    return &table->tracks[lo];
+  }
+  return NULL;
+}
+
+void sq_cue_format(const struct sq_cue * cue, char * buf, size_t size) {
+  const struct sq_msg * msg = (const struct sq_msg *)cue->msg;
+  const struct sq_light_color * color = (const struct sq_light_color *)msg;
+  const struct sq_fade * fade = (const struct sq_fade *)msg;
+  const struct sq_effect * effect = (const struct sq_effect *)msg;
+  const struct sq_scene_recall * recall = (const struct sq_scene_recall *)msg;
+  char name[33];
+  uint64_t ms = cue->t / 1000000;
+  int n = snprintf(buf, size, "%u %llu:%02llu.%03llu ", cue->track,
+		   (unsigned long long)(ms / 60000),
+		   (unsigned long long)(ms / 1000 % 60),
+		   (unsigned long long)(ms % 1000));
+  if(n < 0 || (size_t)n >= size) {
+    return;
+  }
+  buf += n;
+  size -= n;
+  // the name, group or scene is in the same place in each
+  memcpy(name, color->name, 32);
+  name[32] = '\0';
+  switch(msg->type) {
+  case SQ_LIGHT_ONOFF:
+    snprintf(buf, size, "%s %s", name,
+	     ((const struct sq_light_onoff *)msg)->seton ? "on" : "off");
+    break;
+  case SQ_LIGHT_BRIGHTNESS:
+    snprintf(buf, size, "%s brightness %g", name,
+	     ((const struct sq_light_brightness *)msg)->brightness);
+    break;
+  case SQ_LIGHT_RGB:
+  case SQ_LIGHT_HSI:
+    snprintf(buf, size, "%s %s %g %g %g", name,
+	     msg->type == SQ_LIGHT_RGB ? "rgb" : "hsi", color->color.rgb.r,
+	     color->color.rgb.g, color->color.rgb.b);
+    break;
+  case SQ_FADE:
+    if(fade->to == SQ_LIGHT_BRIGHTNESS) {
+      snprintf(buf, size, "%s fade %g %u", name, fade->value[0], fade->ms);
+    } else {
+      snprintf(buf, size, "%s %s %g %g %g %u", name,
+	       fade->to == SQ_LIGHT_RGB ? "fadergb" : "fadehsi",
+	       fade->value[0], fade->value[1], fade->value[2], fade->ms);
+    }
+    break;
+  case SQ_EFFECT:
+    if(effect->effect > SQ_FX_STROBE) {
+      snprintf(buf, size, "%s effect %u", name, effect->effect);
+    } else if(effect->effect == SQ_FX_STOP) {
+      snprintf(buf, size, "%s effect stop", name);
+    } else {
+      snprintf(buf, size, "%s effect %s %u %g %g", name,
+	       effect_names[effect->effect], effect->period_ms, effect->level,
+	       effect->param);
+    }
+    break;
+  case SQ_SCENE_RECALL:
+    snprintf(buf, size, "%s recall %u", name, recall->fade_ms);
+    break;
+  default:
+    snprintf(buf, size, "%s (message type %d)", name, msg->type);
+    break;
+  }
+}
+
+int sq_cue_seek(struct sq_cue_cursor * cursor,
+		const struct sq_cue_table * table, uint32_t track, uint64_t t) {
+  const struct sq_cue_track * tr = sq_cues_track(table, track);
+  if(tr == NULL) {
+    cursor->cues = table->cues;
+    cursor->next = cursor->end = 0;
+    return -1;
+  }
+  // the first at or after t
+  uint32_t lo = tr->first, hi = tr->first + tr->n;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(table->cues[mid].t < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cursor->cues = table->cues;
+  cursor->next = lo;
+  cursor->end = tr->first + tr->n;
+  return 0;
+}
+
+const struct sq_cue * sq_cue_due(struct sq_cue_cursor * cursor, uint64_t t) {
+  if(cursor->next < cursor->end && cursor->cues[cursor->next].t <= t) {
+    return &cursor->cues[cursor->next++];
+  }
+  return NULL;
+}
+
+uint64_t sq_cue_next_time(const struct sq_cue_cursor * cursor) {
+  return cursor->next < cursor->end ? cursor->cues[cursor->next].t
+    : UINT64_MAX;
+}
+
+// what of its target a cue sets, so which cues a later one overrides
+enum sq_cue_kind_e {
+  KIND_ONOFF,
+  KIND_LEVEL,
+  KIND_COLOR,
+  KIND_EFFECT,
+  KIND_SCENE,
+  KIND_OTHER
+};
+
+static int sq_cue_kind(const struct sq_cue * cue) {
+  const struct sq_fade * fade = (const struct sq_fade *)cue->msg;
+  switch(fade->type) {
+  case SQ_LIGHT_ONOFF:
+    return KIND_ONOFF;
+  case SQ_LIGHT_BRIGHTNESS:
+    return KIND_LEVEL;
+  case SQ_LIGHT_RGB:
+  case SQ_LIGHT_HSI:
+    return KIND_COLOR;
+  case SQ_FADE:
+    return fade->to == SQ_LIGHT_BRIGHTNESS ? KIND_LEVEL : KIND_COLOR;
+  case SQ_EFFECT:
+    return KIND_EFFECT;
+  case SQ_SCENE_RECALL:
+    return KIND_SCENE;
+  default:
+    return KIND_OTHER;
+  }
+}
+
+// the light, group or scene a cue is for, which is in the same place in each
+static const char * sq_cue_target(const struct sq_cue * cue) {
+  return ((const struct sq_fade *)cue->msg)->name;
+}
+
+void sq_cue_state_init(struct sq_cue_state * state) {
+  memset(state, 0, sizeof(*state));
+}
+
+void sq_cue_state_free(struct sq_cue_state * state) {
+  free(state->cues);
+  sq_cue_state_init(state);
+}
+
+void sq_cue_state_apply(struct sq_cue_state * state,
+			const struct sq_cue_table * table, uint32_t i) {
+  const struct sq_cue * cue = &table->cues[i];
+  const struct sq_effect * effect = (const struct sq_effect *)cue->msg;
+  int kind = sq_cue_kind(cue);
+  int stop = kind == KIND_EFFECT && effect->effect == SQ_FX_STOP;
+  // as the router has it, stopping "*" stops everything
+  int all = stop && 0 == strncmp(effect->group, "*", 32);
+  uint32_t kept = 0;
+  for(uint32_t j = 0; j < state->n; j++) {
+    const struct sq_cue * old = &table->cues[state->cues[j]];
+    if(sq_cue_kind(old) != kind
+       || (!all && strncmp(sq_cue_target(old), sq_cue_target(cue), 32))) {
+      state->cues[kept++] = state->cues[j];
+    }
+  }
+  state->n = kept;
+  if(stop) {
+    return;
+  }
+  if(state->n == state->size) {
+    state->size = state->size ? 2 * state->size : 64;
+    state->cues = realloc(state->cues, state->size * sizeof(uint32_t));
+  }
+  state->cues[state->n++] = i;
+}
+
+int sq_cue_state_at(struct sq_cue_state * state,
+		    const struct sq_cue_table * table, uint32_t track,
+		    uint64_t t) {
+  const struct sq_cue_track * tr = sq_cues_track(table, track);
+  if(tr == NULL) {
+    return -1;
+  }
+  // the last keyframe at or before t; the first is at 0
+  uint32_t lo = tr->firstkey + 1, hi = tr->firstkey + tr->nkeys;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(table->keys[mid].t <= t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct sq_cue_key * key = &table->keys[lo - 1];
+  if(key->n > state->size) {
+    state->size = key->n;
+    state->cues = realloc(state->cues, state->size * sizeof(uint32_t));
+  }
+  memcpy(state->cues, table->keycues + key->first, key->n * sizeof(uint32_t));
+  state->n = key->n;
+  for(uint32_t i = key->next; i < tr->first + tr->n && table->cues[i].t < t;
+      i++) {
+    sq_cue_state_apply(state, table, i);
+  }
+  return 0;
+}
+
+void sq_cue_state_send(const struct sq_cue_state * state,
+		       const struct sq_cue_table * table, uint64_t t,
+		       void (*send)(const void * msg, size_t length)) {
+  struct sq_effect stop;
+  memset(&stop, 0, sizeof(stop));
+  stop.type = SQ_EFFECT;
+  strcpy(stop.group, "*");
+  stop.effect = SQ_FX_STOP;
+  send(&stop, sizeof(stop));
+
+  for(uint32_t j = 0; j < state->n; j++) {
+    const struct sq_cue * cue = &table->cues[state->cues[j]];
+    struct sq_fade fade;
+    if(((const struct sq_msg *)cue->msg)->type == SQ_SCENE_RECALL) {
+      // the rest of its fade, if any
+      struct sq_scene_recall recall;
+      memcpy(&recall, cue->msg, sizeof(recall));
+      uint64_t end = cue->t + (uint64_t)recall.fade_ms * 1000000;
+      recall.fade_ms = t < end ? (end - t + 999999) / 1000000 : 0;
+      send(&recall, sizeof(recall));
+      continue;
+    }
+    if(((const struct sq_msg *)cue->msg)->type != SQ_FADE) {
+      send(cue->msg, cue->len);
+      continue;
+    }
+    memcpy(&fade, cue->msg, sizeof(fade));
+    uint64_t end = cue->t + (uint64_t)fade.ms * 1000000;
+    if(t < end) {
+      // the rest of it, from wherever the light is
+      fade.ms = (end - t + 999999) / 1000000;
+      send(&fade, sizeof(fade));
+    } else if(fade.to == SQ_LIGHT_BRIGHTNESS) {
+      struct sq_light_brightness msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.type = SQ_LIGHT_BRIGHTNESS;
+      memcpy(msg.name, fade.name, 32);
+      msg.brightness = fade.value[0];
+      send(&msg, sizeof(msg));
+    } else {
+      struct sq_light_color msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.type = fade.to;
+      memcpy(msg.name, fade.name, 32);
+      msg.color.rgb.r = fade.value[0];
+      msg.color.rgb.g = fade.value[1];
+      msg.color.rgb.b = fade.value[2];
+      send(&msg, sizeof(msg));
+    }
+  }
+}
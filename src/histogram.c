@@ -0,0 +1,75 @@
+// histogram.c
+// implementation of histogram.h
+
+#include "histogram.h"
+#include <string.h>
+
+void sq_hist_init(struct sq_hist * h) {
+  memset(h, 0, sizeof(*h));
+}
+
+int sq_hist_bucket(uint64_t value) {
+  if(value < SQ_HIST_SUB) {
+    return value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  if(msb >= SQ_HIST_MAX_BITS) {
+    return SQ_HIST_BUCKETS - 1;
+  }
+  int shift = msb - SQ_HIST_SUB_BITS;
+  return (shift + 1) * SQ_HIST_SUB + (int)(value >> shift) - SQ_HIST_SUB;
+}
+
+uint64_t sq_hist_bucket_low(int bucket) {
+  if(bucket < SQ_HIST_SUB) {
+    return bucket;
+  }
+  int shift = bucket / SQ_HIST_SUB - 1;
+  return (uint64_t)(SQ_HIST_SUB + bucket % SQ_HIST_SUB) << shift;
+}
+
+void sq_hist_record(struct sq_hist * h, uint64_t value) {
+  h->counts[sq_hist_bucket(value)]++;
+  h->count++;
+  if(value > h->max) {
+    h->max = value;
+  }
+}
+
+void sq_hist_add(struct sq_hist * dst, const struct sq_hist * src) {
+  for(int i = 0; i < SQ_HIST_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->count += src->count;
+  if(src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t sq_hist_percentile(const struct sq_hist * h, double p) {
+  if(h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5);
+  if(rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for(int i = 0; i < SQ_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if(seen >= rank) {
+      uint64_t high = i + 1 < SQ_HIST_BUCKETS ? sq_hist_bucket_low(i + 1) - 1
+	: h->max;
+      return high < h->max ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+void sq_hist_print(FILE * fp, const struct sq_hist * h, double scale) {
+  fprintf(fp, "%10llu  p50 %9.2f  p90 %9.2f  p99 %9.2f  p99.9 %9.2f  max %9.2f\n",
+	  (unsigned long long)h->count,
+	  sq_hist_percentile(h, 50) / scale, sq_hist_percentile(h, 90) / scale,
+	  sq_hist_percentile(h, 99) / scale, sq_hist_percentile(h, 99.9) / scale,
+	  h->max / scale);
+}
@@ -1,9 +1,15 @@
 // lights.c
 // implementation of protocol.h
 
+#define _GNU_SOURCE // sendmmsg
 #include "protocol.h"
+#include "shm.h"
+#include "histogram.h"
+#include "color.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +30,7 @@
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <sys/un.h>
 
 #endif
 
@@ -31,6 +38,7 @@
 #include <errno.h>
 
 #define BUFSIZE 256
+_Static_assert(BUFSIZE >= SQ_STATS_REPLY_SIZE, "stats replies won't fit");
 #define notok(x) ((x) < 0)
 
 void dieperr(const char *msg) {
@@ -72,32 +80,15 @@ void default_rgb_handler(light_t * light, float r, float g, float b) {
   float brightness = (r + g + b)/3;
   light->brightness_handler(light, brightness);
 }
-static inline float deg_to_rad(float d) {
-  return d*M_PI/180.0;
-}
 void default_hsi_handler(light_t * light, float h, float s, float i) {
   float r, g, b;
-  h = fmod(h, 360.0);
-  if(h < 120) {
-    r = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    g = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    b = (1-s)/3;
-  } else if(h < 240) {
-    h = h - 120;
-    g = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    b = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    r = (1-s)/3;
-  } else {
-    h = h - 240;
-    b = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    r = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    g = (1-s)/3;
-  }
+  sq_hsi_to_rgb(h, s, &r, &g, &b);
   light->rgb_handler(light, r, g, b);
 }
 
 struct light_list_s {
   struct light_list_s * next_light;
+  struct light_list_s * next_hashed; // in its bucket of light_hash
   light_t light;
 };
 
@@ -117,34 +108,193 @@ char * sqlights_name_cpy(char * dest, char * src) {
   return strncpy(dest, src, 32);
 }
 
+size_t sqlights_msg_size(sq_msg_type type) {
+  switch(type) {
+  case SQ_LIGHT_ONOFF:
+    return sizeof(struct sq_light_onoff);
+  case SQ_LIGHT_BRIGHTNESS:
+    return sizeof(struct sq_light_brightness);
+  case SQ_LIGHT_RGB:
+  case SQ_LIGHT_HSI:
+    return sizeof(struct sq_light_color);
+  case SQ_FADE:
+    return sizeof(struct sq_fade);
+  case SQ_EFFECT:
+    return sizeof(struct sq_effect);
+  case SQ_SCENE_CAPTURE:
+    return sizeof(struct sq_scene_capture);
+  case SQ_SCENE_RECALL:
+    return sizeof(struct sq_scene_recall);
+  default:
+    return 0;
+  }
+}
+
+/* tracing */
+
+static struct sq_hist * trace_hists = NULL; // SQ_NUM_HOPS of them
+static volatile sig_atomic_t trace_dump_wanted = 0;
+
+static void sq_trace_sigusr1(int sig) {
+  trace_dump_wanted = 1;
+}
+
+static uint64_t sq_trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sqlights_trace_record(int hop, uint64_t ns) {
+  if(trace_hists == NULL) {
+    try(NULL != (trace_hists = calloc(SQ_NUM_HOPS, sizeof(struct sq_hist))),
+	"out of memory");
+    // unless the program has its own use for it
+    struct sigaction sa;
+    sigaction(SIGUSR1, NULL, &sa);
+    if(sa.sa_handler == SIG_DFL) {
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = sq_trace_sigusr1;
+      sigaction(SIGUSR1, &sa, NULL);
+    }
+  }
+  // a sample from another host's clock can come out negative
+  if((int64_t)ns >= 0) {
+    sq_hist_record(&trace_hists[hop], ns);
+  }
+}
+
+void sqlights_trace_dump(FILE * fp) {
+  static const char * hop_names[SQ_NUM_HOPS] = {
+    "client to router", "in router", "router to light", "in handler",
+    "end to end", "schedule late"
+  };
+  if(trace_hists == NULL) {
+    return;
+  }
+  fprintf(fp, "traced latency in us:\n");
+  for(int hop = 0; hop < SQ_NUM_HOPS; hop++) {
+    if(trace_hists[hop].count) {
+      fprintf(fp, "%-16s", hop_names[hop]);
+      sq_hist_print(fp, &trace_hists[hop], 1000);
+    }
+  }
+  fflush(fp);
+}
+
+const struct sq_hist * sqlights_trace_hist(int hop) {
+  return trace_hists ? &trace_hists[hop] : NULL;
+}
+
+void sqlights_trace_check(void) {
+  if(trace_dump_wanted) {
+    trace_dump_wanted = 0;
+    sqlights_trace_dump(stderr);
+  }
+}
+
+// A router address of "shm", or "shm:" followed by the router's socket
+// path, asks for the shared-memory transport.  Returns the socket path,
+// or NULL for an ordinary host name.
+static const char * sq_shm_path(const char * routeraddr) {
+  if(strncmp(routeraddr, "shm", 3) != 0
+     || (routeraddr[3] != '\0' && routeraddr[3] != ':')) {
+    return NULL;
+  }
+  if(routeraddr[3] == ':' && routeraddr[4] != '\0') {
+    return routeraddr + 4;
+  }
+  return SQ_SHM_SOCKET;
+}
+
+// Opens a socket to reach the router at routeraddr, and fills in its
+// address: "unix:" or "unix:/path" is the router's unix datagram
+// socket, anything else a host name for udp.
+static int sq_router_socket(char * routeraddr, struct sockaddr_storage * addr,
+			    socklen_t * addrlen) {
+  int sock;
+  memset(addr, 0, sizeof(*addr));
+#ifndef __WIN32__
+  if(strncmp(routeraddr, "unix:", 5) == 0) {
+    struct sockaddr_un * sun = (struct sockaddr_un *)addr;
+    const char * path = routeraddr[5] != '\0' ? routeraddr + 5 : SQ_UNIX_SOCKET;
+    try(strlen(path) < sizeof(sun->sun_path), "Router socket path too long");
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    *addrlen = sizeof(struct sockaddr_un);
+    tryp(0 <= (sock = socket(AF_UNIX, SOCK_DGRAM, 0)),
+	 "Failed to create unix socket");
+    // bind to an autogenerated abstract name, so the router has
+    // somewhere to send replies
+    sa_family_t family = AF_UNIX;
+    tryp(0 <= bind(sock, (struct sockaddr *)&family, sizeof(family)),
+	 "Failed to bind unix socket");
+    return sock;
+  }
+#endif
+  struct sockaddr_in * sin = (struct sockaddr_in *)addr;
+  struct hostent *host;
+  tryp(0 <= (sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
+       "Failed to create udp socket");
+  //fctl(udpsock, F_SETFL, O_NONBLOCK);
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(SQ_PORT);
+  try(NULL != (host = gethostbyname(routeraddr)),
+      "Invalid host name");
+  memmove(&sin->sin_addr, host->h_addr, host->h_length);
+  *addrlen = sizeof(struct sockaddr_in);
+  return sock;
+}
+
+// a datagram lost to a full socket, or a router that isn't there yet,
+// is like one lost on the network
+static int sq_send_lost(int err) {
+  return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS
+    || err == ECONNREFUSED || err == ENOENT;
+}
+
 static struct light_list_s * lights = NULL;
-static struct sockaddr_in servaddr;
+static struct light_list_s * lights_tail = NULL;
+// lights by name, so a driver with thousands of them finds each
+// message's light without walking the list
+#define SQ_LIGHT_HASH_SIZE 4096 // a power of two
+static struct light_list_s * light_hash[SQ_LIGHT_HASH_SIZE];
+static struct sockaddr_storage servaddr;
+static socklen_t servaddrlen;
 static int udpsock;
 static time_t ack_next;
 static time_t reack_next;
+static struct sq_shm_link lshm;
+static const char * lshm_path = NULL; // set when lshm is in use
 
 // initializes the light system for this process
 int sqlights_light_initialize(char * routeraddr) {
-  struct hostent *host;
-  
-  tryp(0 <= (udpsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
-       "Failed to create udp socket");
-  //fctl(udpsock, F_SETFL, O_NONBLOCK);
-  memset(&servaddr, 0, sizeof(servaddr));
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_port = htons(SQ_PORT);
-  try(NULL != (host = gethostbyname(routeraddr)),
-      "Invalid host name");
-  memmove(&servaddr.sin_addr, host->h_addr, host->h_length);
   ack_next = time(NULL) + ACK_DELAY;
   reack_next = time(NULL) + REACK_DELAY;
+  if(NULL != (lshm_path = sq_shm_path(routeraddr))) {
+    if(0 == sq_shm_connect(&lshm, lshm_path)) {
+      return 0;
+    }
+    fprintf(stderr, "no router at %s, using udp to localhost\n", lshm_path);
+    lshm_path = NULL;
+    routeraddr = "localhost";
+  }
+
+  udpsock = sq_router_socket(routeraddr, &servaddr, &servaddrlen);
   return 0;
 }
 
 int sqlights_light_sendto(int udpsock, const void * msg, size_t length) {
-  tryp(0 <= sendto(udpsock, msg, length, 0,
-		   (struct sockaddr *) &servaddr, sizeof(servaddr)),
-       "sqlights_light_send_packet()");
+  if(lshm_path) {
+    // a full ring is a lost datagram, as it would be over udp
+    sq_shm_send(&lshm, msg, length);
+    return 0;
+  }
+  if(0 > sendto(udpsock, msg, length, MSG_DONTWAIT,
+		(struct sockaddr *) &servaddr, servaddrlen)
+     && !sq_send_lost(errno)) {
+    dieperr("sqlights_light_send_packet()");
+  }
   return 0;
 }
 
@@ -163,21 +313,19 @@ void sqlights_light_send_ack(light_t * light) {
   sqlights_light_sendto(udpsock, (void*)&msg, sizeof(msg));
 }
 
-struct light_list_s * sq_light_last_ptr(void) {
-  struct light_list_s * curr = lights;
-  while(curr != NULL) {
-    if(curr->next_light == NULL) {
-      return curr;
-    }
-    curr = curr->next_light;
+// fnv-1a over the name, up to its end or 32 characters
+static struct light_list_s ** sq_light_bucket(char * name) {
+  uint32_t h = 2166136261u;
+  for(int i = 0; i < 32 && name[i] != '\0'; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
   }
-  return NULL;
+  return &light_hash[h & (SQ_LIGHT_HASH_SIZE - 1)];
 }
 
 // adds a light, returns the light id.
 light_t * sqlights_add_light(char * name, sq_light_type capabilities) {
   struct light_list_s * new_light_list;
-  struct light_list_s * last_light_ptr = sq_light_last_ptr();
+  struct light_list_s ** bucket;
   light_t * light;
   
   new_light_list = malloc(sizeof(struct light_list_s));
@@ -185,20 +333,25 @@ light_t * sqlights_add_light(char * name, sq_light_type capabilities) {
   light = &new_light_list->light;
 
   sqlights_name_cpy(light->name, name);
+  light->light_type = capabilities;
   light->extra_data = NULL;
   light->acked = 0;
   light->onoff_handler = &default_onoff_handler;
   light->brightness_handler = &default_brightness_handler;
   light->rgb_handler = &default_rgb_handler;
   light->hsi_handler = &default_hsi_handler;
+  light->frame_color = light->frame_level = -1;
 
-  // insert it into the list "lights"
-  if(last_light_ptr == NULL) {
-    lights = last_light_ptr = new_light_list;
+  // insert it into the list "lights", and the hash
+  if(lights_tail == NULL) {
+    lights = lights_tail = new_light_list;
   } else {
-    last_light_ptr->next_light = new_light_list;
-    last_light_ptr = new_light_list;
+    lights_tail->next_light = new_light_list;
+    lights_tail = new_light_list;
   }
+  bucket = sq_light_bucket(light->name);
+  new_light_list->next_hashed = *bucket;
+  *bucket = new_light_list;
 
   sqlights_light_send_reg(light);
   return light;
@@ -206,12 +359,12 @@ light_t * sqlights_add_light(char * name, sq_light_type capabilities) {
 
 // gets a light by name
 light_t * sqlights_get_light(char * name) {
-  struct light_list_s * currlight = lights;
+  struct light_list_s * currlight = *sq_light_bucket(name);
   while(currlight != NULL) {
     if(sqlights_eq_name(name, currlight->light.name)) {
       return &currlight->light;
     }
-    currlight = currlight->next_light;
+    currlight = currlight->next_hashed;
   }
   return NULL;
 }
@@ -227,6 +380,14 @@ void sqlights_del_light(char * name) {
       } else {
 	lastlight->next_light = currlight->next_light;
       }
+      if(lights_tail == currlight) {
+	lights_tail = lastlight;
+      }
+      struct light_list_s ** hashed = sq_light_bucket(currlight->light.name);
+      while(*hashed != currlight) {
+	hashed = &(*hashed)->next_hashed;
+      }
+      *hashed = currlight->next_hashed;
       return;
     }
     lastlight = currlight;
@@ -260,20 +421,43 @@ void sqlights_lights_run(void) {
   }
 }
 
-// or, do one iteration of running the lights.  If wait is true, then
-// do a blocking call (with a timeout of 1 sec)
-int sqlights_lights_handle(char wait) {
-  char msg[BUFSIZE];
-  int ret;
-  time_t currtime = time(NULL);
-  
-  if(currtime >= reack_next) {
-    reack_next = time(NULL) + REACK_DELAY;
-    sqlights_clear_acks();
+int sqlights_lights_fd(void) {
+  return lshm_path ? lshm.rx_fd : udpsock;
+}
+
+// the router went away; if it's back, move to its new rings, keeping
+// the descriptor number drivers are waiting on
+static void sqlights_light_shm_reconnect(void) {
+  struct sq_shm_link link;
+  if(sq_shm_connect(&link, lshm_path)) {
+    return;
   }
-  if(currtime >= ack_next) {
-    ack_next = time(NULL) + ACK_DELAY;
-    sqlights_reg_unacked_lights();
+  dup2(link.rx_fd, lshm.rx_fd);
+  close(link.rx_fd);
+  link.rx_fd = lshm.rx_fd;
+  lshm.rx_fd = -1;
+  sq_shm_close(&lshm);
+  lshm = link;
+  sqlights_clear_acks();
+}
+
+// gets the next message into msg, SQ_BATCH_SIZE bytes, waiting up to a
+// second for one if wait is set.  Returns its length or -1.
+static int sqlights_light_recv(char * msg, char wait) {
+  int ret;
+  if(lshm_path) {
+    ret = sq_shm_recv(&lshm, msg, SQ_BATCH_SIZE);
+    if(ret < 0 && wait) {
+      fd_set fds;
+      struct timeval tv;
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      FD_ZERO(&fds);
+      FD_SET(lshm.rx_fd, &fds);
+      select(lshm.rx_fd+1, &fds, NULL, NULL, &tv);
+      ret = sq_shm_recv(&lshm, msg, SQ_BATCH_SIZE);
+    }
+    return ret;
   }
 
   if(wait) {
@@ -286,7 +470,7 @@ int sqlights_lights_handle(char wait) {
     select(udpsock+1, &fds, NULL, NULL, &tv);
   }
 
-  ret = recv(udpsock, msg, BUFSIZE, MSG_DONTWAIT);
+  ret = recv(udpsock, msg, SQ_BATCH_SIZE, MSG_DONTWAIT);
   if(ret < 0) {
     if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
       return -1;
@@ -294,12 +478,141 @@ int sqlights_lights_handle(char wait) {
       dieperr("sqlights_light_handle recv");
     }
   }
+  return ret;
+}
+
+// the frame handler, and the updates gathered for it so far.  Each
+// light's frame_color and frame_level are where its own are.
+#define SQ_LIGHT_MAX_DRAIN 64  // datagrams taken in one go
+static void (*frame_handler)(struct sq_light_update *, int, void *) = NULL;
+static void * frame_data;
+static struct sq_light_update * light_updates = NULL;
+static int light_nupdates = 0, light_updates_size = 0;
+
+void sqlights_set_frame_handler(void (*handler)(struct sq_light_update *
+						updates, int n, void * data),
+				void * data) {
+  frame_handler = handler;
+  frame_data = data;
+}
+
+// passes the gathered updates to the frame handler, leaving out the
+// ones a color dropped
+static void sq_light_flush_updates(void) {
+  int n = 0;
+  if(light_nupdates == 0) {
+    return;
+  }
+  for(int i = 0; i < light_nupdates; i++) {
+    light_t * light = light_updates[i].light;
+    light->frame_color = light->frame_level = -1;
+    if(light_updates[i].type) {
+      light_updates[n++] = light_updates[i];
+    }
+  }
+  light_nupdates = 0;
+  frame_handler(light_updates, n, frame_data);
+}
+
+// a new slot at the end of the updates
+static struct sq_light_update * sq_light_new_update(light_t * light) {
+  if(light_nupdates == light_updates_size) {
+    light_updates_size = light_updates_size ? 2 * light_updates_size : 256;
+    light_updates = realloc(light_updates, light_updates_size
+			    * sizeof(struct sq_light_update));
+    if(light_updates == NULL) {
+      die("out of memory for frame updates");
+    }
+  }
+  light_updates[light_nupdates].light = light;
+  return &light_updates[light_nupdates++];
+}
 
+// gathers a change for the frame handler, in place of any it overrides
+static void sq_light_update(light_t * light, sq_msg_type type,
+			    float v0, float v1, float v2) {
+  struct sq_light_update * u;
+  if(type == SQ_LIGHT_ONOFF || type == SQ_LIGHT_BRIGHTNESS) {
+    // after the light's color, if it has one
+    if(light->frame_level < 0) {
+      light->frame_level = sq_light_new_update(light) - light_updates;
+    }
+    u = &light_updates[light->frame_level];
+  } else if(light->frame_color >= 0) {
+    u = &light_updates[light->frame_color];
+    if(light->frame_level >= 0) {
+      // dropped, but its place kept for the next level, after this
+      light_updates[light->frame_level].type = 0;
+    }
+  } else if(light->frame_level >= 0) {
+    // it goes where the level was, and replaces it
+    light->frame_color = light->frame_level;
+    light->frame_level = -1;
+    u = &light_updates[light->frame_color];
+  } else {
+    light->frame_color = sq_light_new_update(light) - light_updates;
+    u = &light_updates[light->frame_color];
+  }
+  u->type = type;
+  u->value[0] = v0;
+  u->value[1] = v1;
+  u->value[2] = v2;
+}
+
+// or, do one iteration of running the lights.  If wait is true, then
+// do a blocking call (with a timeout of 1 sec)
+static void sq_light_dispatch(char * msg, sq_msg_type type);
+static void sq_light_dispatch_traced(char * msg, int len, sq_msg_type type);
+static void sq_light_dispatch_batch(char * msg, int len);
+
+int sqlights_lights_handle(char wait) {
+  char msg[SQ_BATCH_SIZE];
+  int ret;
+  time_t currtime = time(NULL);
+
+  sqlights_trace_check();
+  
+  if(currtime >= reack_next) {
+    reack_next = time(NULL) + REACK_DELAY;
+    sqlights_clear_acks();
+    if(lshm_path && sq_shm_hungup(&lshm)) {
+      sqlights_light_shm_reconnect();
+    }
+  }
+  if(currtime >= ack_next) {
+    ack_next = time(NULL) + ACK_DELAY;
+    sqlights_reg_unacked_lights();
+  }
+
+  if(0 > (ret = sqlights_light_recv(msg, wait))) {
+    return -1;
+  }
+
+  // with a frame handler, carry on through whatever else has come, so
+  // it gets it all at once
+  int drained = 0;
+  do {
+    sq_msg_type type = ((struct sq_msg*)msg)->type;
+    if(type & SQ_TRACE_FLAG) {
+      sq_light_dispatch_traced(msg, ret, type & ~SQ_TRACE_FLAG);
+    } else if(type == SQ_BATCH) {
+      sq_light_dispatch_batch(msg, ret);
+    } else {
+      sq_light_dispatch(msg, type);
+    }
+  } while(frame_handler && ++drained < SQ_LIGHT_MAX_DRAIN
+	  && 0 <= (ret = sqlights_light_recv(msg, 0)));
+  if(frame_handler) {
+    sq_light_flush_updates();
+  }
+  return 0;
+}
+
+static void sq_light_dispatch(char * msg, sq_msg_type type) {
   light_t * light;
   struct sq_light_onoff * msgonoff;
   struct sq_light_brightness * msgbrightness;
   struct sq_light_color * msgcolor;
-  sq_msg_type type = ((struct sq_msg*)msg)->type;
 
   switch(type) {
     
@@ -325,18 +638,31 @@ int sqlights_lights_handle(char wait) {
   case SQ_LIGHT_ONOFF:
     msgonoff = (struct sq_light_onoff*)msg;
     light = sqlights_get_light(msgonoff->name);
-    light->onoff_handler(light, msgonoff->seton);
+    if(frame_handler) {
+      sq_light_update(light, type, msgonoff->seton != 0, 0, 0);
+    } else {
+      light->onoff_handler(light, msgonoff->seton);
+    }
     break;
     
   case SQ_LIGHT_BRIGHTNESS:
     msgbrightness = (struct sq_light_brightness*)msg;
     light = sqlights_get_light(msgbrightness->name);
-    light->brightness_handler(light, msgbrightness->brightness);
+    if(frame_handler) {
+      sq_light_update(light, type, msgbrightness->brightness, 0, 0);
+    } else {
+      light->brightness_handler(light, msgbrightness->brightness);
+    }
     break;
     
   case SQ_LIGHT_RGB:
     msgcolor = (struct sq_light_color*)msg;
     light = sqlights_get_light(msgcolor->name);
+    if(frame_handler) {
+      sq_light_update(light, type, msgcolor->color.rgb.r,
+		      msgcolor->color.rgb.g, msgcolor->color.rgb.b);
+      break;
+    }
     light->rgb_handler(light,
 		       msgcolor->color.rgb.r,
 		       msgcolor->color.rgb.g,
@@ -346,6 +672,11 @@ int sqlights_lights_handle(char wait) {
   case SQ_LIGHT_HSI:
     msgcolor = (struct sq_light_color*)msg;
     light = sqlights_get_light(msgcolor->name);
+    if(frame_handler) {
+      sq_light_update(light, type, msgcolor->color.hsi.h,
+		      msgcolor->color.hsi.s, msgcolor->color.hsi.i);
+      break;
+    }
     light->hsi_handler(light,
 		       msgcolor->color.hsi.h,
 		       msgcolor->color.hsi.s,
@@ -361,33 +692,354 @@ int sqlights_lights_handle(char wait) {
     fprintf(stderr, "Unknown message type %d\n", type);
     break;
   }
+}
 
-  return 0;
+// a light message with a trace after it
+static void sq_light_dispatch_traced(char * msg, int len, sq_msg_type type) {
+  size_t size = sqlights_msg_size(type);
+  struct sq_trace trace;
+  if(size == 0 || len < (int)(size + sizeof(trace))) {
+    fprintf(stderr, "Bad traced message type %d\n", type);
+    return;
+  }
+  memcpy(&trace, msg + size, sizeof(trace));
+  uint64_t entry = sq_trace_clock();
+  // with a frame handler, this only gathers it
+  sq_light_dispatch(msg, type);
+  uint64_t done = sq_trace_clock();
+  sqlights_trace_record(SQ_HOP_ROUTER_LIGHT, entry - trace.router_fwd);
+  sqlights_trace_record(SQ_HOP_HANDLER, done - entry);
+  sqlights_trace_record(SQ_HOP_END_TO_END, entry - trace.client_send);
+}
+
+// the messages of a batch from the router, one after another
+static void sq_light_dispatch_batch(char * msg, int len) {
+  struct sq_batch * batch = (struct sq_batch *)msg;
+  int at = sizeof(*batch);
+  if(len < at) {
+    fprintf(stderr, "Bad batch\n");
+    return;
+  }
+  for(uint32_t i = 0; i < batch->n; i++) {
+    sq_msg_type type;
+    size_t size;
+    if(len < at + (int)sizeof(type)) {
+      break;
+    }
+    type = ((struct sq_msg *)(msg + at))->type;
+    if(0 == (size = sqlights_msg_size(type)) || len < at + (int)size) {
+      break;
+    }
+    sq_light_dispatch(msg + at, type);
+    at += size;
+  }
+  if(at != len) {
+    fprintf(stderr, "Bad batch\n");
+  }
 }
 
-static struct sockaddr_in clservaddr;
+static struct sockaddr_storage clservaddr;
+static socklen_t clservaddrlen;
 static int cludpsock;
+// a client may send from several threads, so a new link after the
+// router restarts is swapped in whole and the old one is left open
+static struct sq_shm_link * clshm = NULL;
+static const char * clshm_path;
+static time_t clshm_checked;
 
 // initializes the light system for this process
 int sqlights_client_initialize(char * routeraddr) {
-  struct hostent *host;
-  
-  tryp(0 <= (cludpsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
-       "Failed to create udp socket");
-  //fctl(udpsock, F_SETFL, O_NONBLOCK);
-  memset(&clservaddr, 0, sizeof(clservaddr));
-  clservaddr.sin_family = AF_INET;
-  clservaddr.sin_port = htons(SQ_PORT);
-  try(NULL != (host = gethostbyname(routeraddr)),
-      "Invalid host name");
-  memmove(&clservaddr.sin_addr, host->h_addr, host->h_length);
+  clshm = NULL;
+  if(NULL != (clshm_path = sq_shm_path(routeraddr))) {
+    struct sq_shm_link * link = malloc(sizeof(struct sq_shm_link));
+    if(0 == sq_shm_connect(link, clshm_path)) {
+      clshm = link;
+      clshm_checked = time(NULL);
+      return 0;
+    }
+    free(link);
+    fprintf(stderr, "no router at %s, using udp to localhost\n", clshm_path);
+    routeraddr = "localhost";
+  }
+
+  cludpsock = sq_router_socket(routeraddr, &clservaddr, &clservaddrlen);
   return 0;
 }
 
+static void sq_client_shm_check(void) {
+  struct sq_shm_link * link = __atomic_load_n(&clshm, __ATOMIC_ACQUIRE);
+  time_t now = time(NULL);
+  if(now == clshm_checked) {
+    return;
+  }
+  clshm_checked = now;
+  if(sq_shm_hungup(link)) {
+    struct sq_shm_link * relink = malloc(sizeof(struct sq_shm_link));
+    if(0 == sq_shm_connect(relink, clshm_path)) {
+      __atomic_store_n(&clshm, relink, __ATOMIC_RELEASE);
+    } else {
+      free(relink);
+    }
+  }
+}
+
+static struct sq_client_stats clstats;
+
+// sends msg straight to the router
+static void sq_client_send_now(const void * msg, size_t length) {
+  if(clshm) {
+    sq_client_shm_check();
+    // a full ring is a lost datagram, as it would be over udp
+    if(sq_shm_send(__atomic_load_n(&clshm, __ATOMIC_ACQUIRE), msg, length)) {
+      __atomic_add_fetch(&clstats.send_errors, 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&clstats.sent, 1, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  if(0 > sendto(cludpsock, msg, length, MSG_DONTWAIT,
+		(struct sockaddr *) &clservaddr, clservaddrlen)) {
+    if(!sq_send_lost(errno)) {
+      dieperr("sq_client_sendto()");
+    }
+    __atomic_add_fetch(&clstats.send_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_add_fetch(&clstats.sent, 1, __ATOMIC_RELAXED);
+}
+
+/* async sending */
+
+#define SQ_ASYNC_BATCH 64
+
+// the queue is the shm transport's ring, in our own memory
+static struct sq_ring * clqueue = NULL;
+static uint32_t clqueue_done;  // queue position the sender has finished
+static int clinterval_us;
+static pthread_t clsender;
+
+// passes n queued messages to the kernel, in as few calls as it can
+static void sq_client_send_batch(char bufs[][BUFSIZE], int * lens, int n) {
+#ifdef __linux__
+  if(!clshm) {
+    struct mmsghdr msgs[SQ_ASYNC_BATCH];
+    struct iovec iovs[SQ_ASYNC_BATCH];
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for(int i = 0; i < n; i++) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = lens[i];
+      msgs[i].msg_hdr.msg_name = &clservaddr;
+      msgs[i].msg_hdr.msg_namelen = clservaddrlen;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int done = 0;
+    while(done < n) {
+      int ret = sendmmsg(cludpsock, msgs + done, n - done, MSG_DONTWAIT);
+      if(ret < 0) {
+	if(!sq_send_lost(errno)) {
+	  dieperr("sendmmsg()");
+	}
+	// the rest of the batch goes with it
+	__atomic_add_fetch(&clstats.send_errors, n - done, __ATOMIC_RELAXED);
+	return;
+      }
+      done += ret;
+      __atomic_add_fetch(&clstats.sent, ret, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+#endif
+  for(int i = 0; i < n; i++) {
+    sq_client_send_now(bufs[i], lens[i]);
+  }
+}
+
+static void * sq_client_sender(void * arg) {
+  static char bufs[SQ_ASYNC_BATCH][BUFSIZE];
+  int lens[SQ_ASYNC_BATCH];
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while(1) {
+    next.tv_nsec += clinterval_us * 1000L;
+    while(next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL))
+      ;
+    int n;
+    do {
+      for(n = 0; n < SQ_ASYNC_BATCH; n++) {
+	if(0 > (lens[n] = sq_ring_pop(clqueue, bufs[n], BUFSIZE))) {
+	  break;
+	}
+      }
+      if(n > 0) {
+	sq_client_send_batch(bufs, lens, n);
+      }
+      __atomic_store_n(&clqueue_done, clqueue->head, __ATOMIC_RELEASE);
+    } while(n == SQ_ASYNC_BATCH);
+  }
+  return NULL;
+}
+
+int sqlights_client_async(int interval_us) {
+  if(clqueue) {
+    clinterval_us = interval_us;
+    return 0;
+  }
+  if(interval_us <= 0 || NULL == (clqueue = malloc(sizeof(struct sq_ring)))) {
+    return -1;
+  }
+  sq_ring_init(clqueue);
+  clqueue_done = 0;
+  clinterval_us = interval_us;
+  if(pthread_create(&clsender, NULL, sq_client_sender, NULL)) {
+    free(clqueue);
+    clqueue = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void sq_client_send_held(int all);
+
+void sqlights_client_flush(void) {
+  sq_client_send_held(1);
+  if(!clqueue) {
+    return;
+  }
+  uint32_t target = __atomic_load_n(&clqueue->tail, __ATOMIC_ACQUIRE);
+  while((int32_t)(__atomic_load_n(&clqueue_done, __ATOMIC_ACQUIRE)
+		  - target) < 0) {
+    usleep(clinterval_us / 4 + 1);
+  }
+}
+
+void sqlights_client_stats(struct sq_client_stats * stats) {
+  stats->sent = __atomic_load_n(&clstats.sent, __ATOMIC_RELAXED);
+  stats->queue_full = __atomic_load_n(&clstats.queue_full, __ATOMIC_RELAXED);
+  stats->send_errors = __atomic_load_n(&clstats.send_errors, __ATOMIC_RELAXED);
+  stats->suppressed = __atomic_load_n(&clstats.suppressed, __ATOMIC_RELAXED);
+  stats->rate_limited = __atomic_load_n(&clstats.rate_limited,
+					__ATOMIC_RELAXED);
+}
+
+static double sq_client_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// takes a reply from the router, waiting until deadline.  Returns its
+// length, or -1 if none came.
+static int sq_client_recv(char * msg, double deadline) {
+  while(1) {
+    struct sq_shm_link * link = __atomic_load_n(&clshm, __ATOMIC_ACQUIRE);
+    int fd = link ? link->rx_fd : cludpsock;
+    int len;
+    if(link) {
+      if(0 <= (len = sq_shm_recv(link, msg, BUFSIZE))) {
+	return len;
+      }
+    } else if(0 <= (len = recv(cludpsock, msg, BUFSIZE, MSG_DONTWAIT))) {
+      return len;
+    } else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+	      && !sq_send_lost(errno)) {
+      return -1;
+    }
+    double wait = deadline - sq_client_clock();
+    if(wait <= 0) {
+      return -1;
+    }
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec = (long)wait;
+    tv.tv_usec = (long)((wait - tv.tv_sec) * 1e6);
+    select(fd + 1, &fds, NULL, NULL, &tv);
+  }
+}
+
+int sqlights_client_query_stats(void (*handler)(void * msg, int len,
+						void * arg),
+				void * arg, int timeout_ms) {
+  char msg[BUFSIZE];
+  struct sq_stats_query query;
+  query.type = SQ_STATS_QUERY;
+  // not through the async queue; the reply is waited for here
+  sq_client_send_now(&query, sizeof(query));
+  double deadline = sq_client_clock() + timeout_ms / 1000.0;
+  int len;
+  while(0 <= (len = sq_client_recv(msg, deadline))) {
+    sq_msg_type type = ((struct sq_msg *)msg)->type;
+    if(type < SQ_STATS_TOTALS || type > SQ_STATS_END) {
+      continue;
+    }
+    handler(msg, len, arg);
+    if(type == SQ_STATS_END) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static char cltrace = 0;
+static uint32_t cltrace_seq = 0;
+static __thread uint64_t clat = 0;
+
+void sqlights_client_trace(char on) {
+  cltrace = on;
+}
+
+uint64_t sqlights_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sqlights_client_at(uint64_t at) {
+  clat = at;
+}
+
 void sq_client_sendto(const void * msg, size_t length) {
-  tryp(0 <= sendto(cludpsock, msg, length, 0,
-		   (struct sockaddr *) &clservaddr, sizeof(clservaddr)),
-       "sq_client_sendto()");
+  char framed[BUFSIZE];
+  if((cltrace || clat)
+     && length + sizeof(struct sq_at) + sizeof(struct sq_trace) <= BUFSIZE
+     && sqlights_msg_size(((struct sq_msg *)msg)->type) == length) {
+    memcpy(framed, msg, length);
+    if(clat) {
+      struct sq_at at;
+      at.at = clat;
+      ((struct sq_msg *)framed)->type |= SQ_AT_FLAG;
+      memcpy(framed + length, &at, sizeof(at));
+      length += sizeof(at);
+    }
+    if(cltrace) {
+      struct sq_trace trace;
+      memset(&trace, 0, sizeof(trace));
+      trace.pid = getpid();
+      trace.seq = __atomic_fetch_add(&cltrace_seq, 1, __ATOMIC_RELAXED);
+      trace.client_send = sq_trace_clock();
+      ((struct sq_msg *)framed)->type |= SQ_TRACE_FLAG;
+      memcpy(framed + length, &trace, sizeof(trace));
+      length += sizeof(trace);
+    }
+    msg = framed;
+  }
+  if(clqueue) {
+    if(sq_ring_push(clqueue, msg, length)) {
+      __atomic_add_fetch(&clstats.queue_full, 1, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  sq_client_send_now(msg, length);
+}
+
+void sqlights_client_send(const void * msg, size_t length) {
+  sq_client_sendto(msg, length);
 }
 
 void sqlights_client_seton(char * name, char seton) {
@@ -425,3 +1077,248 @@ void sqlights_client_hsi(char * name, float h, float s, float i) {
   msg.color.hsi.i = i;
   sq_client_sendto((void*)&msg, sizeof(msg));
 }
+
+static void sq_client_fade(char * name, sq_msg_type to, float v0, float v1,
+			   float v2, uint32_t ms) {
+  struct sq_fade msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SQ_FADE;
+  strncpy(msg.name, name, 32);
+  msg.to = to;
+  msg.value[0] = v0;
+  msg.value[1] = v1;
+  msg.value[2] = v2;
+  msg.ms = ms;
+  sq_client_sendto((void*)&msg, sizeof(msg));
+}
+
+void sqlights_client_fade_brightness(char * name, float brightness,
+				     uint32_t ms) {
+  sq_client_fade(name, SQ_LIGHT_BRIGHTNESS, brightness, 0, 0, ms);
+}
+
+void sqlights_client_fade_rgb(char * name, float r, float g, float b,
+			      uint32_t ms) {
+  sq_client_fade(name, SQ_LIGHT_RGB, r, g, b, ms);
+}
+
+void sqlights_client_fade_hsi(char * name, float h, float s, float i,
+			      uint32_t ms) {
+  sq_client_fade(name, SQ_LIGHT_HSI, h, s, i, ms);
+}
+
+void sqlights_client_effect(char * group, int effect, uint32_t period_ms,
+			    float level, float param) {
+  struct sq_effect msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SQ_EFFECT;
+  strncpy(msg.group, group, 32);
+  msg.effect = effect;
+  msg.period_ms = period_ms;
+  msg.level = level;
+  msg.param = param;
+  sq_client_sendto((void*)&msg, sizeof(msg));
+}
+
+void sqlights_client_scene_capture(char * scene, char * group) {
+  struct sq_scene_capture msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SQ_SCENE_CAPTURE;
+  strncpy(msg.scene, scene, 32);
+  strncpy(msg.group, group, 32);
+  sq_client_sendto((void*)&msg, sizeof(msg));
+}
+
+void sqlights_client_scene_recall(char * scene, uint32_t fade_ms) {
+  struct sq_scene_recall msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SQ_SCENE_RECALL;
+  strncpy(msg.scene, scene, 32);
+  msg.fade_ms = fade_ms;
+  sq_client_sendto((void*)&msg, sizeof(msg));
+}
+
+sq_client_light_t * sqlights_client_open(char * name) {
+  sq_client_light_t * light = calloc(1, sizeof(sq_client_light_t));
+  if(light == NULL) {
+    return NULL;
+  }
+  strncpy(light->name, name, 32);
+  light->onoff.type = SQ_LIGHT_ONOFF;
+  strncpy(light->onoff.name, name, 32);
+  light->brightness.type = SQ_LIGHT_BRIGHTNESS;
+  strncpy(light->brightness.name, name, 32);
+  light->rgb.type = SQ_LIGHT_RGB;
+  strncpy(light->rgb.name, name, 32);
+  light->hsi.type = SQ_LIGHT_HSI;
+  strncpy(light->hsi.name, name, 32);
+  return light;
+}
+
+// handles with limits, for sq_client_send_held()
+static sq_client_light_t * cllimited = NULL;
+static pthread_mutex_t cllimited_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sqlights_client_close(sq_client_light_t * light) {
+  if(light->limited) {
+    pthread_mutex_lock(&cllimited_lock);
+    sq_client_light_t ** pp = &cllimited;
+    while(*pp != light) {
+      pp = &(*pp)->next;
+    }
+    *pp = light->next;
+    pthread_mutex_unlock(&cllimited_lock);
+  }
+  free(light);
+}
+
+void sqlights_client_limit(sq_client_light_t * light, float epsilon,
+			   float max_rate) {
+  light->epsilon = epsilon;
+  light->min_interval = max_rate > 0 ? 1.0 / max_rate : 0;
+  if(!light->limited) {
+    light->limited = 1;
+    pthread_mutex_lock(&cllimited_lock);
+    light->next = cllimited;
+    cllimited = light;
+    pthread_mutex_unlock(&cllimited_lock);
+  }
+}
+
+#define SQ_CLIENT_REFRESH 1.0 // seconds before an unchanged value is resent
+
+static void sq_client_light_lock(sq_client_light_t * light) {
+  while(__atomic_test_and_set(&light->busy, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void sq_client_light_unlock(sq_client_light_t * light) {
+  __atomic_clear(&light->busy, __ATOMIC_RELEASE);
+}
+
+// fills in a template's values and sends it
+static void sq_client_light_put(sq_client_light_t * light, void * msg,
+				const float * v, double t) {
+  size_t len;
+  switch(*(sq_msg_type *)msg) {
+  case SQ_LIGHT_ONOFF:
+    light->onoff.seton = v[0] != 0;
+    len = sizeof(struct sq_light_onoff);
+    break;
+  case SQ_LIGHT_BRIGHTNESS:
+    light->brightness.brightness = v[0];
+    len = sizeof(struct sq_light_brightness);
+    break;
+  default:
+    ((struct sq_light_color *)msg)->color.rgb.r = v[0];
+    ((struct sq_light_color *)msg)->color.rgb.g = v[1];
+    ((struct sq_light_color *)msg)->color.rgb.b = v[2];
+    len = sizeof(struct sq_light_color);
+    break;
+  }
+  sq_client_sendto(msg, len);
+  light->last_msg = msg;
+  memcpy(light->last, v, sizeof(light->last));
+  light->last_time = t;
+}
+
+// the epsilon and rate checks, for a light with limits
+static void sq_client_light_limited(sq_client_light_t * light, void * msg,
+				    float v0, float v1, float v2) {
+  float v[3] = {v0, v1, v2};
+  double t = sq_client_clock();
+  sq_client_light_lock(light);
+  if(light->last_msg == msg && t - light->last_time < SQ_CLIENT_REFRESH) {
+    float eps = msg == &light->onoff ? 0 : light->epsilon;
+    if(fabsf(v[0] - light->last[0]) <= eps
+       && fabsf(v[1] - light->last[1]) <= eps
+       && fabsf(v[2] - light->last[2]) <= eps) {
+      // back where it was, so anything held back is moot
+      if(light->held_msg) {
+	light->held_msg = NULL;
+	__atomic_add_fetch(&clstats.rate_limited, 1, __ATOMIC_RELAXED);
+      }
+      __atomic_add_fetch(&clstats.suppressed, 1, __ATOMIC_RELAXED);
+      sq_client_light_unlock(light);
+      return;
+    }
+  }
+  if(light->last_msg && t - light->last_time < light->min_interval) {
+    if(light->held_msg) {
+      __atomic_add_fetch(&clstats.rate_limited, 1, __ATOMIC_RELAXED);
+    }
+    light->held_msg = msg;
+    memcpy(light->held, v, sizeof(light->held));
+    sq_client_light_unlock(light);
+    return;
+  }
+  light->held_msg = NULL;
+  sq_client_light_put(light, msg, v, t);
+  sq_client_light_unlock(light);
+}
+
+static void sq_client_send_held(int all) {
+  double t = sq_client_clock();
+  pthread_mutex_lock(&cllimited_lock);
+  for(sq_client_light_t * light = cllimited; light; light = light->next) {
+    if(!light->held_msg) {
+      continue;
+    }
+    sq_client_light_lock(light);
+    if(light->held_msg
+       && (all || t - light->last_time >= light->min_interval)) {
+      void * msg = light->held_msg;
+      light->held_msg = NULL;
+      sq_client_light_put(light, msg, light->held, t);
+    }
+    sq_client_light_unlock(light);
+  }
+  pthread_mutex_unlock(&cllimited_lock);
+}
+
+void sqlights_client_send_due(void) {
+  sq_client_send_held(0);
+}
+
+void sqlights_client_light_seton(sq_client_light_t * light, char seton) {
+  if(light->limited) {
+    sq_client_light_limited(light, &light->onoff, seton != 0, 0, 0);
+    return;
+  }
+  light->onoff.seton = seton;
+  sq_client_sendto(&light->onoff, sizeof(light->onoff));
+}
+
+void sqlights_client_light_brightness(sq_client_light_t * light,
+				      float brightness) {
+  if(light->limited) {
+    sq_client_light_limited(light, &light->brightness, brightness, 0, 0);
+    return;
+  }
+  light->brightness.brightness = brightness;
+  sq_client_sendto(&light->brightness, sizeof(light->brightness));
+}
+
+void sqlights_client_light_rgb(sq_client_light_t * light,
+			       float r, float g, float b) {
+  if(light->limited) {
+    sq_client_light_limited(light, &light->rgb, r, g, b);
+    return;
+  }
+  light->rgb.color.rgb.r = r;
+  light->rgb.color.rgb.g = g;
+  light->rgb.color.rgb.b = b;
+  sq_client_sendto(&light->rgb, sizeof(light->rgb));
+}
+
+void sqlights_client_light_hsi(sq_client_light_t * light,
+			       float h, float s, float i) {
+  if(light->limited) {
+    sq_client_light_limited(light, &light->hsi, h, s, i);
+    return;
+  }
+  light->hsi.color.hsi.h = h;
+  light->hsi.color.hsi.s = s;
+  light->hsi.color.hsi.i = i;
+  sq_client_sendto(&light->hsi, sizeof(light->hsi));
+}
@@ -0,0 +1,413 @@
+/* dmxlights.c
+   drives DMX fixtures over IP, with Art-Net or E1.31 (sACN).  Each
+   light is mapped to one or more slots of a DMX universe; handlers
+   only write the universe's 512 byte buffer, a batch of changes at a
+   time through the frame handler.  At a fixed refresh rate
+   each universe which changed gets one packet, and unchanged ones are
+   resent once a second so receivers don't time out. */
+
+/* dmxlights.conf has lines of
+     (universe) (channel) (onoff|fade|rgb) (name)
+   where channel is 1-512 and an rgb light uses channel, channel+1 and
+   channel+2.  Lines starting with # are comments. */
+
+#include "protocol.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define ARTNET_PORT 6454
+#define ARTNET_OP_DMX 0x5000
+#define ARTNET_PROT_VER 14
+#define SACN_PORT 5568
+#define SACN_PRIORITY 100
+
+#define DMX_SLOTS 512
+#define MAX_UNIVERSES 64
+#define DEFAULT_FPS 40
+#define KEEPALIVE 1.0   // seconds between resends of unchanged universes
+
+enum dmx_proto_e {
+  DMX_ARTNET = 1,
+  DMX_SACN
+};
+
+struct dmx_universe {
+  int number;
+  unsigned char slots[DMX_SLOTS];
+  int used;            // highest slot in use, for Art-Net's length
+  int dirty;
+  double last_sent;
+  uint8_t seq;
+  struct sockaddr_in dest;
+};
+
+struct dmx_light {
+  struct dmx_universe * uni;
+  int slot;            // 0 based
+};
+
+static struct dmx_universe universes[MAX_UNIVERSES];
+static int nuniverses = 0;
+static int proto = DMX_ARTNET;
+static int dmxsock;
+static struct sockaddr_in dmx_dest;  // unicast/broadcast target
+static int sacn_multicast = 0;
+static unsigned char sacn_cid[16];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put16(unsigned char * p, int v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void dmx_set(struct dmx_universe * uni, int slot, float v) {
+  if(v < 0) v = 0;
+  if(v > 1) v = 1;
+  unsigned char level = (unsigned char)(255 * v + 0.5);
+  if(uni->slots[slot] != level) {
+    uni->slots[slot] = level;
+    uni->dirty = 1;
+  }
+}
+
+// ArtDmx: 18 byte header, then an even number of slots
+static int artnet_encode(struct dmx_universe * uni, unsigned char * p) {
+  int len = (uni->used + 1) & ~1;
+  if(len < 2) {
+    len = 2;
+  }
+  memcpy(p, "Art-Net", 8);
+  p[8] = ARTNET_OP_DMX & 0xff;    // opcode is little endian
+  p[9] = ARTNET_OP_DMX >> 8;
+  put16(p + 10, ARTNET_PROT_VER);
+  p[12] = uni->seq = uni->seq == 255 ? 1 : uni->seq + 1; // 0 disables
+  p[13] = 0;                      // physical port
+  p[14] = uni->number & 0xff;     // subnet and universe
+  p[15] = (uni->number >> 8) & 0x7f; // net
+  put16(p + 16, len);
+  memcpy(p + 18, uni->slots, len);
+  return 18 + len;
+}
+
+// E1.31 data packet: root, framing and DMP layers, always all 512 slots
+static int sacn_encode(struct dmx_universe * uni, unsigned char * p) {
+  static const unsigned char acn_id[12] = "ASC-E1.17\0\0";
+  int len = 126 + DMX_SLOTS;
+
+  memset(p, 0, 126);
+  // root layer
+  put16(p, 0x0010);               // preamble size
+  memcpy(p + 4, acn_id, 12);
+  put16(p + 16, 0x7000 | (len - 16));
+  p[21] = 0x04;                   // VECTOR_ROOT_E131_DATA
+  memcpy(p + 22, sacn_cid, 16);
+  // framing layer
+  put16(p + 38, 0x7000 | (len - 38));
+  p[43] = 0x02;                   // VECTOR_E131_DATA_PACKET
+  snprintf((char *)p + 44, 64, "sqlights dmxlights");
+  p[108] = SACN_PRIORITY;
+  p[111] = uni->seq++;
+  put16(p + 113, uni->number);
+  // DMP layer
+  put16(p + 115, 0x7000 | (len - 115));
+  p[117] = 0x02;                  // VECTOR_DMP_SET_PROPERTY
+  p[118] = 0xa1;                  // address and data type
+  put16(p + 121, 0x0001);         // address increment
+  put16(p + 123, DMX_SLOTS + 1);
+  p[125] = 0;                     // DMX start code
+  memcpy(p + 126, uni->slots, DMX_SLOTS);
+  return len;
+}
+
+void dmx_send_frame(double t) {
+  unsigned char packet[126 + DMX_SLOTS];
+  for(int i = 0; i < nuniverses; i++) {
+    struct dmx_universe * uni = &universes[i];
+    if(!uni->dirty && t - uni->last_sent < KEEPALIVE) {
+      continue;
+    }
+    int len = proto == DMX_ARTNET ? artnet_encode(uni, packet)
+      : sacn_encode(uni, packet);
+    if(sendto(dmxsock, packet, len, 0, (struct sockaddr *)&uni->dest,
+	      sizeof(uni->dest)) < 0) {
+      // a missing receiver or a full queue just costs this frame
+      if(errno != ECONNREFUSED && errno != ENOBUFS && errno != EAGAIN) {
+	dieperr("dmx sendto");
+      }
+      continue;
+    }
+    uni->dirty = 0;
+    uni->last_sent = t;
+  }
+}
+
+void dmx_brightness_handler(light_t * light, float brightness) {
+  struct dmx_light * dl = light->extra_data;
+  dmx_set(dl->uni, dl->slot, brightness);
+}
+void dmx_onoff_handler(light_t * light, char seton) {
+  dmx_brightness_handler(light, seton?1.0:0.0);
+}
+void dmx_rgb_handler(light_t * light, float r, float g, float b) {
+  struct dmx_light * dl = light->extra_data;
+  dmx_set(dl->uni, dl->slot, r);
+  dmx_set(dl->uni, dl->slot + 1, g);
+  dmx_set(dl->uni, dl->slot + 2, b);
+}
+void dmx_rgb_brightness_handler(light_t * light, float brightness) {
+  dmx_rgb_handler(light, brightness, brightness, brightness);
+}
+void dmx_rgb_onoff_handler(light_t * light, char seton) {
+  dmx_rgb_brightness_handler(light, seton?1.0:0.0);
+}
+
+// a batch of changes: the hsi ones converted together, as
+// default_hsi_handler() would each, then each through the light's own
+// handler
+void dmx_frame_handler(struct sq_light_update * updates, int n,
+		       void * data) {
+  float h[n], s[n], r[n], g[n], b[n];
+  int nhsi = 0;
+  for(int k = 0; k < n; k++) {
+    if(updates[k].type == SQ_LIGHT_HSI) {
+      h[nhsi] = updates[k].value[0];
+      s[nhsi] = updates[k].value[1];
+      nhsi++;
+    }
+  }
+  if(nhsi) {
+    sq_hsi_to_rgb_n(nhsi, h, s, r, g, b);
+  }
+  nhsi = 0;
+  for(int k = 0; k < n; k++) {
+    light_t * light = updates[k].light;
+    float * v = updates[k].value;
+    switch(updates[k].type) {
+    case SQ_LIGHT_ONOFF:
+      light->onoff_handler(light, v[0] != 0);
+      break;
+    case SQ_LIGHT_BRIGHTNESS:
+      light->brightness_handler(light, v[0]);
+      break;
+    case SQ_LIGHT_RGB:
+      light->rgb_handler(light, v[0], v[1], v[2]);
+      break;
+    case SQ_LIGHT_HSI:
+      light->rgb_handler(light, r[nhsi], g[nhsi], b[nhsi]);
+      nhsi++;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+struct dmx_universe * get_universe(int number) {
+  for(int i = 0; i < nuniverses; i++) {
+    if(universes[i].number == number) {
+      return &universes[i];
+    }
+  }
+  if(nuniverses >= MAX_UNIVERSES) {
+    return NULL;
+  }
+  struct dmx_universe * uni = &universes[nuniverses++];
+  memset(uni, 0, sizeof(*uni));
+  uni->number = number;
+  uni->dirty = 1;
+  uni->dest = dmx_dest;
+  if(sacn_multicast) {
+    // 239.255.(universe high byte).(universe low byte)
+    uni->dest.sin_addr.s_addr = htonl(0xefff0000 | (number & 0xffff));
+  }
+  return uni;
+}
+
+int load_lights(char * filename) {
+  FILE * fp = fopen(filename, "r");
+  if(fp == 0) {
+    printf("couldn't open file %s\n", filename);
+    return -1;
+  }
+  char line[256], type[16], name[33];
+  int number, channel;
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(line[0] == '#' || sscanf(line, "%15s", type) != 1) {
+      continue;
+    }
+    if(sscanf(line, "%d %d %15s %32s", &number, &channel, type, name) != 4) {
+      printf("parsing error for %s: %s", filename, line);
+      fclose(fp);
+      return -1;
+    }
+    int rgb = strcmp(type, "rgb") == 0;
+    int last = channel + (rgb ? 2 : 0);
+    int max_universe = proto == DMX_ARTNET ? 0x7fff : 63999;
+    struct dmx_universe * uni = NULL;
+    if(number < (proto == DMX_ARTNET ? 0 : 1) || number > max_universe
+       || channel < 1 || last > DMX_SLOTS
+       || NULL == (uni = get_universe(number))) {
+      printf("no channel %d in universe %d for %s\n", channel, number, name);
+      fclose(fp);
+      return -1;
+    }
+    if(last > uni->used) {
+      uni->used = last;
+    }
+
+    printf("adding light \"%s\"\n", name);
+    struct dmx_light * dl = malloc(sizeof(struct dmx_light));
+    dl->uni = uni;
+    dl->slot = channel - 1;
+    light_t * light;
+    if(rgb) {
+      light = sqlights_add_light(name, SQ_COLORED);
+      light->onoff_handler = &dmx_rgb_onoff_handler;
+      light->brightness_handler = &dmx_rgb_brightness_handler;
+      light->rgb_handler = &dmx_rgb_handler;
+    } else if(strcmp(type, "fade") == 0) {
+      light = sqlights_add_light(name, SQ_FADEABLE);
+      light->onoff_handler = &dmx_onoff_handler;
+      light->brightness_handler = &dmx_brightness_handler;
+    } else if(strcmp(type, "onoff") == 0) {
+      light = sqlights_add_light(name, SQ_ONOFF);
+      light->onoff_handler = &dmx_onoff_handler;
+    } else {
+      printf("unknown light type %s for %s\n", type, name);
+      fclose(fp);
+      return -1;
+    }
+    light->extra_data = dl;
+  }
+  fclose(fp);
+  printf("finished adding lights.\n");
+  return 0;
+}
+
+void init_output(char * address) {
+  struct hostent * host;
+  int one = 1;
+
+  tryp(0 <= (dmxsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
+       "Failed to create udp socket");
+  tryp(0 <= setsockopt(dmxsock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)),
+       "SO_BROADCAST");
+  // a source's CID only has to be unique and stable for the run
+  unsigned int seed = time(NULL) ^ getpid();
+  for(int i = 0; i < 16; i++) {
+    sacn_cid[i] = rand_r(&seed);
+  }
+
+  memset(&dmx_dest, 0, sizeof(dmx_dest));
+  dmx_dest.sin_family = AF_INET;
+  dmx_dest.sin_port = htons(proto == DMX_ARTNET ? ARTNET_PORT : SACN_PORT);
+  if(proto == DMX_SACN && address == NULL) {
+    sacn_multicast = 1;
+    return;
+  }
+  if(address == NULL) {
+    address = "255.255.255.255";
+  }
+  try(NULL != (host = gethostbyname(address)), "Invalid output address");
+  memmove(&dmx_dest.sin_addr, host->h_addr, host->h_length);
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname]\n"
+	 "\t-c (file)\tlight configuration (default dmxlights.conf)\n"
+	 "\t-p (artnet|sacn)\toutput protocol (default artnet)\n"
+	 "\t-a (address)\tsend to this address; default broadcast for\n"
+	 "\t\t\tArt-Net, per-universe multicast for sACN\n"
+	 "\t-f (fps)\tframes sent per second (default %d)\n",
+	 prgname, DEFAULT_FPS);
+}
+
+int main(int argc, char** argv) {
+  char * hostname = "localhost";
+  char * filename = "dmxlights.conf";
+  char * address = NULL;
+  int fps = DEFAULT_FPS;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:p:a:f:h")) != -1) {
+    switch(opt) {
+    case 'c': filename = optarg; break;
+    case 'a': address = optarg; break;
+    case 'f': fps = atoi(optarg); break;
+    case 'p':
+      if(strcmp(optarg, "artnet") == 0) {
+	proto = DMX_ARTNET;
+      } else if(strcmp(optarg, "sacn") == 0) {
+	proto = DMX_SACN;
+      } else {
+	print_usage(argv[0]);
+	return 1;
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(fps < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    hostname = argv[optind];
+  }
+
+  init_output(address);
+  if(sqlights_light_initialize(hostname)) {
+    printf("couldn't initialize squidlights\n");
+    exit(1);
+  }
+  if(load_lights(filename)) {
+    printf("couldn't load lights\n");
+    exit(1);
+  }
+  sqlights_set_frame_handler(&dmx_frame_handler, NULL);
+
+  // frames go out on a fixed schedule; in between, sleep in select()
+  // until a message arrives and drain everything queued
+  int fd = sqlights_lights_fd();
+  double period = 1.0 / fps;
+  double next_frame = now() + period;
+  while(1) {
+    double wait = next_frame - now();
+    if(wait > 0) {
+      fd_set fds;
+      struct timeval tv;
+      tv.tv_sec = (long)wait;
+      tv.tv_usec = (long)((wait - tv.tv_sec) * 1e6);
+      FD_ZERO(&fds);
+      FD_SET(fd, &fds);
+      select(fd+1, &fds, NULL, NULL, &tv);
+    }
+    while(0 == sqlights_lights_handle(0));
+    double t = now();
+    if(t >= next_frame) {
+      dmx_send_frame(t);
+      next_frame += period;
+      if(next_frame < t) {
+	next_frame = t + period; // fell behind; don't burst
+      }
+    }
+  }
+}
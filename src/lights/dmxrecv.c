@@ -0,0 +1,222 @@
+/* dmxrecv.c
+   listens for Art-Net or E1.31 (sACN) DMX packets, e.g. from
+   dmxlights on the same machine, and reports per universe how many
+   frames arrived, at what rate, how evenly spaced they were and how
+   many sequence numbers were skipped.  With -f, exits non-zero if the
+   rate or the jitter is off, so a loopback run can be scripted. */
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ARTNET_PORT 6454
+#define SACN_PORT 5568
+#define MAX_UNIVERSES 64
+#define RATE_TOLERANCE 0.10  // fraction of the expected rate
+
+struct uni_stats {
+  int number;
+  long frames;
+  long skipped;
+  int last_seq;
+  double first, last;
+  double sum_dt, sum_dt2, max_dt, min_dt;
+};
+
+static struct uni_stats stats[MAX_UNIVERSES];
+static int nstats = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct uni_stats * get_stats(int number) {
+  for(int i = 0; i < nstats; i++) {
+    if(stats[i].number == number) {
+      return &stats[i];
+    }
+  }
+  if(nstats >= MAX_UNIVERSES) {
+    return NULL;
+  }
+  struct uni_stats * st = &stats[nstats++];
+  memset(st, 0, sizeof(*st));
+  st->number = number;
+  st->last_seq = -1;
+  st->min_dt = 1e9;
+  return st;
+}
+
+// returns the universe number and sequence of a DMX data packet, or
+// -1 if it isn't one
+int parse_artnet(unsigned char * p, int len, int * seq) {
+  if(len < 18 || memcmp(p, "Art-Net", 8) || p[8] != 0x00 || p[9] != 0x50) {
+    return -1;
+  }
+  *seq = p[12];
+  return p[14] | (p[15] << 8);
+}
+
+int parse_sacn(unsigned char * p, int len, int * seq) {
+  if(len < 126 || memcmp(p + 4, "ASC-E1.17", 9) || p[21] != 0x04
+     || p[43] != 0x02 || p[117] != 0x02) {
+    return -1;
+  }
+  *seq = p[111];
+  return (p[113] << 8) | p[114];
+}
+
+void record(struct uni_stats * st, int seq, double t, int sacn) {
+  if(st->frames == 0) {
+    st->first = t;
+  } else {
+    double dt = t - st->last;
+    st->sum_dt += dt;
+    st->sum_dt2 += dt * dt;
+    if(dt > st->max_dt) st->max_dt = dt;
+    if(dt < st->min_dt) st->min_dt = dt;
+  }
+  // both wrap at 255, but Art-Net skips 0, which there means "not
+  // sequenced"
+  if(st->last_seq >= 0 && (sacn || seq != 0)) {
+    int expect = (st->last_seq + 1) & 0xff;
+    if(!sacn && expect == 0) {
+      expect = 1;
+    }
+    st->skipped += (seq - expect) & 0xff;
+  }
+  st->last_seq = seq;
+  st->last = t;
+  st->frames++;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options]\n"
+	 "\t-p (artnet|sacn)\tprotocol to listen for (default artnet)\n"
+	 "\t-t (seconds)\tlisten this long (default 5)\n"
+	 "\t-u (universe)\tjoin this universe's sACN multicast group\n"
+	 "\t-f (fps)\texpected frame rate; fail if a universe is off by\n"
+	 "\t\t\tmore than 10%%, or its jitter is over the -j limit\n"
+	 "\t-j (ms)\t\tlimit on the standard deviation of frame spacing\n"
+	 "\t\t\t(default 2)\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  int sacn = 0;
+  double duration = 5;
+  double fps = 0;
+  double max_jitter = 0.002;
+  int join = -1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "p:t:u:f:j:h")) != -1) {
+    switch(opt) {
+    case 'p':
+      if(strcmp(optarg, "sacn") == 0) {
+	sacn = 1;
+      } else if(strcmp(optarg, "artnet") != 0) {
+	print_usage(argv[0]);
+	return 1;
+      }
+      break;
+    case 't': duration = atof(optarg); break;
+    case 'u': join = atoi(optarg); break;
+    case 'f': fps = atof(optarg); break;
+    case 'j': max_jitter = atof(optarg) / 1000.0; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  int sock, one = 1;
+  struct sockaddr_in addr;
+  tryp(0 <= (sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
+       "Failed to create udp socket");
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(sacn ? SACN_PORT : ARTNET_PORT);
+  tryp(0 <= bind(sock, (struct sockaddr *)&addr, sizeof(addr)), "bind");
+  if(sacn && join >= 0) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = htonl(0xefff0000 | (join & 0xffff));
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    tryp(0 <= setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+			 sizeof(mreq)), "IP_ADD_MEMBERSHIP");
+  }
+
+  unsigned char buf[1024];
+  double end = now() + duration;
+  long ignored = 0;
+  while(1) {
+    double wait = end - now();
+    if(wait <= 0) {
+      break;
+    }
+    fd_set fds;
+    struct timeval tv;
+    tv.tv_sec = (long)wait;
+    tv.tv_usec = (long)((wait - tv.tv_sec) * 1e6);
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    if(select(sock+1, &fds, NULL, NULL, &tv) <= 0) {
+      continue;
+    }
+    int len = recv(sock, buf, sizeof(buf), 0);
+    double t = now();
+    int seq, number;
+    if(len < 0) {
+      continue;
+    }
+    number = sacn ? parse_sacn(buf, len, &seq) : parse_artnet(buf, len, &seq);
+    struct uni_stats * st;
+    if(number < 0 || NULL == (st = get_stats(number))) {
+      ignored++;
+      continue;
+    }
+    record(st, seq, t, sacn);
+  }
+
+  int failed = 0;
+  if(nstats == 0) {
+    printf("no DMX packets in %.1f s\n", duration);
+    return fps > 0;
+  }
+  printf("universe  frames     fps  mean ms  jitter ms   min ms   max ms  skipped\n");
+  for(int i = 0; i < nstats; i++) {
+    struct uni_stats * st = &stats[i];
+    long n = st->frames - 1;
+    double rate = 0, mean = 0, sd = 0;
+    if(n > 0) {
+      mean = st->sum_dt / n;
+      sd = sqrt(fmax(0, st->sum_dt2 / n - mean * mean));
+      rate = n / (st->last - st->first);
+    }
+    printf("%8d %7ld %7.2f %8.3f %10.3f %8.3f %8.3f %8ld", st->number,
+	   st->frames, rate, 1e3 * mean, 1e3 * sd,
+	   n > 0 ? 1e3 * st->min_dt : 0, 1e3 * st->max_dt, st->skipped);
+    if(fps > 0 && (n <= 0 || fabs(rate - fps) > RATE_TOLERANCE * fps
+		   || sd > max_jitter)) {
+      printf("  FAIL");
+      failed = 1;
+    }
+    printf("\n");
+  }
+  if(ignored) {
+    printf("%ld packets weren't DMX data\n", ignored);
+  }
+  return failed;
+}
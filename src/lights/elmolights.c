@@ -2,6 +2,7 @@
    is brightness controlled. */
 
 #include "protocol.h"
+#include "color.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -48,34 +49,59 @@ void elmo_rgb_handler(light_t * light, float r, float g, float b) {
   handle->i = sum;
 }
 
-static inline float deg_to_rad(float d) {
-  return d*M_PI/180.0;
-}
 void elmo_hsi_handler(light_t * light, float h, float s, float i) {
   struct elmo_light_s * handle = &elmo_lights[(int)light->extra_data];
   float r, g, b;
-  h = fmod(h, 360.0);
-  if(h < 120) {
-    r = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    g = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    b = (1-s)/3;
-  } else if(h < 240) {
-    h = h - 120;
-    g = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    b = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    r = (1-s)/3;
-  } else {
-    h = h - 240;
-    b = (1+s*cos(deg_to_rad(h))/cos(deg_to_rad(60-h)))/3;
-    r = (1+s*(1-cos(deg_to_rad(h))/cos(deg_to_rad(60-h))))/3;
-    g = (1-s)/3;
-  }
+  sq_hsi_to_rgb(h, s, &r, &g, &b);
   handle->r = r;
   handle->g = g;
   handle->b = b;
   handle->i = i;
 }
 
+// a batch of changes at once, the hsi ones converted together
+void elmo_frame_handler(struct sq_light_update * updates, int n,
+			void * data) {
+  float h[n], s[n], r[n], g[n], b[n];
+  int nhsi = 0;
+  for(int k = 0; k < n; k++) {
+    if(updates[k].type == SQ_LIGHT_HSI) {
+      h[nhsi] = updates[k].value[0];
+      s[nhsi] = updates[k].value[1];
+      nhsi++;
+    }
+  }
+  if(nhsi) {
+    sq_hsi_to_rgb_n(nhsi, h, s, r, g, b);
+  }
+  nhsi = 0;
+  for(int k = 0; k < n; k++) {
+    light_t * light = updates[k].light;
+    float * v = updates[k].value;
+    struct elmo_light_s * handle = &elmo_lights[(int)light->extra_data];
+    switch(updates[k].type) {
+    case SQ_LIGHT_ONOFF:
+      elmo_onoff_handler(light, v[0] != 0);
+      break;
+    case SQ_LIGHT_BRIGHTNESS:
+      elmo_brightness_handler(light, v[0]);
+      break;
+    case SQ_LIGHT_RGB:
+      elmo_rgb_handler(light, v[0], v[1], v[2]);
+      break;
+    case SQ_LIGHT_HSI:
+      handle->r = r[nhsi];
+      handle->g = g[nhsi];
+      handle->b = b[nhsi];
+      handle->i = v[2];
+      nhsi++;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
 int update_lights() {
   for(int i = 0; i < next_handle; i++) {
     struct elmo_light_s * handle = &elmo_lights[i];
@@ -123,6 +149,7 @@ int main(int argc, char** argv) {
 
   initialize_elmo_light("18.224.0.163", "elmo0");
   initialize_elmo_light("18.224.0.168", "elmo1");
+  sqlights_set_frame_handler(&elmo_frame_handler, NULL);
 
   struct timeval tv, tv2;
   gettimeofday(&tv, NULL);
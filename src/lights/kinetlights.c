@@ -0,0 +1,349 @@
+/* kinetlights.c
+   drives the 23 dimmer boards through their KiNET ethernet
+   controllers.  Each controller has four boards of 20 channels.  Light
+   handlers only change a frame buffer of the controller's 80 channels;
+   once per frame, every controller with changed channels gets one
+   packet carrying all of them, over a socket opened at startup.  Every
+   second each controller gets all 80, so one that's rebooted or missed
+   a packet comes back. */
+
+/* kinetlights.conf has lines of either
+     controller (id) (address)
+   or
+     (controller id) (channel) (onoff|fade|rgb) (name)
+   where channel is 0-79 (board*20 + light) and an rgb light uses
+   channel, channel+1 and channel+2.  Lines starting with # are
+   comments. */
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define KINET_UDP_PORT 6038
+#define KINET_VERSION 0x0001
+#define KINET_MAGIC 0x4adc0104
+#define KTYPE_DMXOUT 0x0101
+
+#define KINET_BOARDS 4
+#define KINET_BOARD_LIGHTS 20
+#define KINET_CHANNELS (KINET_BOARDS * KINET_BOARD_LIGHTS)
+#define KINET_FIRST_BOARD 0x88
+#define KINET_FIRST_LIGHT 0x40
+#define KINET_ESCAPE 0xf0
+
+#define MAX_CONTROLLERS 16
+#define DEFAULT_FPS 30
+#define KEEPALIVE 1.0   // seconds between sends of every channel
+
+// the controllers were written for 32 bit x86, so the header is little
+// endian with no padding
+struct kinet_hdr {
+  uint32_t magic;
+  uint16_t ver;
+  uint16_t type;
+  uint32_t seq;
+} __attribute__((packed));
+
+struct kinet_dmxout {
+  struct kinet_hdr hdr;
+  uint8_t port;
+  uint8_t flags;
+  uint16_t timer_val;
+  uint32_t uni;
+} __attribute__((packed));
+
+// worst case every channel is escaped: board switches plus
+// escape, light, doubled intensity for each channel
+#define KINET_MAX_PACKET (sizeof(struct kinet_dmxout) \
+			  + 2 * KINET_BOARDS + 4 * KINET_CHANNELS)
+
+struct kinet_controller {
+  int id;
+  int sock;  // connected to the controller
+  unsigned char levels[KINET_CHANNELS];
+  unsigned char dirty[KINET_CHANNELS];  // changed since the last send
+  int ndirty;
+  double last_full;  // when every channel was last sent
+};
+
+struct kinet_light {
+  struct kinet_controller * ctl;
+  int channel;
+};
+
+static struct kinet_controller controllers[MAX_CONTROLLERS];
+static int ncontrollers = 0;
+
+static void kinet_set(struct kinet_controller * ctl, int channel, float v) {
+  if(v < 0) v = 0;
+  if(v > 1) v = 1;
+  unsigned char level = (unsigned char)(255 * v + 0.5);
+  if(ctl->levels[channel] != level) {
+    ctl->levels[channel] = level;
+    if(!ctl->dirty[channel]) {
+      ctl->dirty[channel] = 1;
+      ctl->ndirty++;
+    }
+  }
+}
+
+// encodes the controller's dirty channels, or all of them, after the
+// header.  The board is only selected when it changes; a 0xf0 intensity
+// is doubled so it isn't read as an escape.
+static int kinet_encode(struct kinet_controller * ctl, int all,
+			unsigned char * data) {
+  struct kinet_dmxout * kdmxout = (struct kinet_dmxout *)data;
+  int dlen = sizeof(struct kinet_dmxout);
+  int board = -1;
+
+  memset(kdmxout, 0, sizeof(*kdmxout));
+  kdmxout->hdr.magic = htole32(KINET_MAGIC);
+  kdmxout->hdr.ver = htole16(KINET_VERSION);
+  kdmxout->hdr.type = htole16(KTYPE_DMXOUT);
+  kdmxout->uni = htole32(0xffffffff);
+
+  for(int c = 0; c < KINET_CHANNELS; c++) {
+    if(!all && !ctl->dirty[c]) {
+      continue;
+    }
+    if(c / KINET_BOARD_LIGHTS != board) {
+      board = c / KINET_BOARD_LIGHTS;
+      data[dlen++] = KINET_ESCAPE;
+      data[dlen++] = KINET_FIRST_BOARD + board;
+    }
+    data[dlen++] = KINET_ESCAPE;
+    data[dlen++] = KINET_FIRST_LIGHT + c % KINET_BOARD_LIGHTS;
+    if(ctl->levels[c] == KINET_ESCAPE) {
+      data[dlen++] = KINET_ESCAPE;
+    }
+    data[dlen++] = ctl->levels[c];
+  }
+  return dlen;
+}
+
+void kinet_send_frame(double t) {
+  unsigned char data[KINET_MAX_PACKET];
+  for(int i = 0; i < ncontrollers; i++) {
+    struct kinet_controller * ctl = &controllers[i];
+    int all = t - ctl->last_full >= KEEPALIVE;
+    if(ctl->ndirty == 0 && !all) {
+      continue;
+    }
+    int dlen = kinet_encode(ctl, all, data);
+    if(send(ctl->sock, data, dlen, 0) < 0) {
+      // the controller may be rebooting; the channels stay dirty, so
+      // the next frame tries them again
+      if(errno != ECONNREFUSED && errno != ENOBUFS && errno != EAGAIN) {
+	dieperr("kinet send");
+      }
+      continue;
+    }
+    memset(ctl->dirty, 0, sizeof(ctl->dirty));
+    ctl->ndirty = 0;
+    if(all) {
+      ctl->last_full = t;
+    }
+  }
+}
+
+void kinet_brightness_handler(light_t * light, float brightness) {
+  struct kinet_light * kl = light->extra_data;
+  kinet_set(kl->ctl, kl->channel, brightness);
+}
+void kinet_onoff_handler(light_t * light, char seton) {
+  kinet_brightness_handler(light, seton?1.0:0.0);
+}
+void kinet_rgb_handler(light_t * light, float r, float g, float b) {
+  struct kinet_light * kl = light->extra_data;
+  kinet_set(kl->ctl, kl->channel, r);
+  kinet_set(kl->ctl, kl->channel + 1, g);
+  kinet_set(kl->ctl, kl->channel + 2, b);
+}
+void kinet_rgb_brightness_handler(light_t * light, float brightness) {
+  kinet_rgb_handler(light, brightness, brightness, brightness);
+}
+void kinet_rgb_onoff_handler(light_t * light, char seton) {
+  kinet_rgb_brightness_handler(light, seton?1.0:0.0);
+}
+
+struct kinet_controller * find_controller(int id) {
+  for(int i = 0; i < ncontrollers; i++) {
+    if(controllers[i].id == id) {
+      return &controllers[i];
+    }
+  }
+  return NULL;
+}
+
+int add_controller(int id, char * address) {
+  struct sockaddr_in destsa;
+  struct hostent * host;
+
+  if(ncontrollers >= MAX_CONTROLLERS || find_controller(id)) {
+    printf("too many controllers, or controller %d given twice\n", id);
+    return -1;
+  }
+  if(NULL == (host = gethostbyname(address))) {
+    printf("invalid controller address %s\n", address);
+    return -1;
+  }
+  struct kinet_controller * ctl = &controllers[ncontrollers];
+  memset(ctl, 0, sizeof(*ctl));
+  ctl->id = id;
+  tryp(0 <= (ctl->sock = socket(PF_INET, SOCK_DGRAM, 0)),
+       "Failed to create udp socket");
+  memset(&destsa, 0, sizeof(destsa));
+  destsa.sin_family = AF_INET;
+  destsa.sin_port = htons(KINET_UDP_PORT);
+  memmove(&destsa.sin_addr, host->h_addr, host->h_length);
+  tryp(0 <= connect(ctl->sock, (struct sockaddr *)&destsa, sizeof(destsa)),
+       "connect to controller");
+  ncontrollers++;
+  return 0;
+}
+
+int load_lights(char * filename) {
+  FILE * fp = fopen(filename, "r");
+  if(fp == 0) {
+    printf("couldn't open file %s\n", filename);
+    return -1;
+  }
+  char line[256], type[16], name[33], address[128];
+  int id, channel;
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(line[0] == '#' || sscanf(line, "%15s", type) != 1) {
+      continue;
+    }
+    if(strcmp(type, "controller") == 0) {
+      if(sscanf(line, "%*s %d %127s", &id, address) != 2
+	 || add_controller(id, address)) {
+	printf("bad controller line in %s: %s", filename, line);
+	fclose(fp);
+	return -1;
+      }
+      continue;
+    }
+    if(sscanf(line, "%d %d %15s %32s", &id, &channel, type, name) != 4) {
+      printf("parsing error for %s: %s", filename, line);
+      fclose(fp);
+      return -1;
+    }
+    struct kinet_controller * ctl = find_controller(id);
+    int rgb = strcmp(type, "rgb") == 0;
+    if(ctl == NULL || channel < 0 || channel + (rgb ? 2 : 0) >= KINET_CHANNELS) {
+      printf("no channel %d on controller %d for %s\n", channel, id, name);
+      fclose(fp);
+      return -1;
+    }
+
+    printf("adding light \"%s\"\n", name);
+    struct kinet_light * kl = malloc(sizeof(struct kinet_light));
+    kl->ctl = ctl;
+    kl->channel = channel;
+    light_t * light;
+    if(rgb) {
+      light = sqlights_add_light(name, SQ_COLORED);
+      light->onoff_handler = &kinet_rgb_onoff_handler;
+      light->brightness_handler = &kinet_rgb_brightness_handler;
+      light->rgb_handler = &kinet_rgb_handler;
+    } else if(strcmp(type, "fade") == 0) {
+      light = sqlights_add_light(name, SQ_FADEABLE);
+      light->onoff_handler = &kinet_onoff_handler;
+      light->brightness_handler = &kinet_brightness_handler;
+    } else if(strcmp(type, "onoff") == 0) {
+      light = sqlights_add_light(name, SQ_ONOFF);
+      light->onoff_handler = &kinet_onoff_handler;
+    } else {
+      printf("unknown light type %s for %s\n", type, name);
+      fclose(fp);
+      return -1;
+    }
+    light->extra_data = kl;
+  }
+  fclose(fp);
+  printf("finished adding lights.\n");
+  return 0;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname]\n"
+	 "\t-c (file)\tlight configuration (default kinetlights.conf)\n"
+	 "\t-f (fps)\tframes sent per second (default %d)\n",
+	 prgname, DEFAULT_FPS);
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char** argv) {
+  char * hostname = "localhost";
+  char * filename = "kinetlights.conf";
+  int fps = DEFAULT_FPS;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:f:h")) != -1) {
+    switch(opt) {
+    case 'c': filename = optarg; break;
+    case 'f': fps = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(fps < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    hostname = argv[optind];
+  }
+
+  if(sqlights_light_initialize(hostname)) {
+    printf("couldn't initialize squidlights\n");
+    exit(1);
+  }
+  if(load_lights(filename)) {
+    printf("couldn't load lights\n");
+    exit(1);
+  }
+
+  // sleep in select() until either a message arrives or it's time for
+  // the next frame, then drain everything queued before sending
+  int fd = sqlights_lights_fd();
+  double period = 1.0 / fps;
+  double next_frame = now() + period;
+  while(1) {
+    double wait = next_frame - now();
+    if(wait > 0) {
+      fd_set fds;
+      struct timeval tv;
+      tv.tv_sec = (long)wait;
+      tv.tv_usec = (long)((wait - tv.tv_sec) * 1e6);
+      FD_ZERO(&fds);
+      FD_SET(fd, &fds);
+      select(fd+1, &fds, NULL, NULL, &tv);
+    }
+    while(0 == sqlights_lights_handle(0));
+    if(now() >= next_frame) {
+      kinet_send_frame(now());
+      next_frame += period;
+      if(next_frame < now()) {
+	next_frame = now() + period; // fell behind; don't burst
+      }
+    }
+  }
+}
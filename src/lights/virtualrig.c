@@ -0,0 +1,249 @@
+/* virtualrig.c
+   a headless stand-in for a venue's rig.  Registers any number of
+   onoff, fadeable and colored fixtures, keeps their state in flat
+   arrays indexed by fixture, and every few seconds reports how many
+   updates arrived, how evenly each fixture's updates were spaced, and
+   how old each fixture's state is.  Handling an update is a store and
+   a little arithmetic, so the rig itself is never what runs out. */
+
+#include "protocol.h"
+#include "histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REG_BATCH 64  // registrations in flight, so the router keeps up
+
+static const char * type_names[] = {
+  [SQ_ONOFF] = "onoff", [SQ_FADEABLE] = "fade", [SQ_COLORED] = "color"
+};
+
+// the rig's state, one entry per fixture
+static int nfixtures;
+static char * types;
+static char * on;
+static float * level;
+static float (*color)[3];
+static char * color_hsi;       // color holds h, s, i rather than r, g, b
+static double * last_update;   // when its state last changed, 0 for never
+
+// per fixture, this period
+static uint32_t * ngaps;
+static double * gap_sum;
+static double * gap_sumsq;
+static long updates[SQ_COLORED + 1];
+static struct sq_hist gaps;
+
+static double started;
+static volatile int stopping = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record(light_t * light) {
+  int i = (intptr_t)light->extra_data;
+  double t = now();
+  updates[(int)types[i]]++;
+  if(last_update[i] > 0) {
+    double gap = t - last_update[i];
+    ngaps[i]++;
+    gap_sum[i] += gap;
+    gap_sumsq[i] += gap * gap;
+    sq_hist_record(&gaps, gap * 1e9);
+  }
+  last_update[i] = t;
+}
+
+void rig_onoff(light_t * light, char seton) {
+  on[(intptr_t)light->extra_data] = seton;
+  record(light);
+}
+void rig_brightness(light_t * light, float brightness) {
+  level[(intptr_t)light->extra_data] = brightness;
+  record(light);
+}
+void rig_rgb(light_t * light, float r, float g, float b) {
+  int i = (intptr_t)light->extra_data;
+  color[i][0] = r;
+  color[i][1] = g;
+  color[i][2] = b;
+  color_hsi[i] = 0;
+  record(light);
+}
+void rig_hsi(light_t * light, float h, float s, float in) {
+  int i = (intptr_t)light->extra_data;
+  color[i][0] = h;
+  color[i][1] = s;
+  color[i][2] = in;
+  color_hsi[i] = 1;
+  record(light);
+}
+
+void add_fixtures(char * prefix, sq_light_type type, int n) {
+  char name[32];
+  static light_t * pending[REG_BATCH];
+  int npending = 0;
+  for(int k = 0; k < n; k++) {
+    int i = nfixtures++;
+    snprintf(name, sizeof(name), "%s-%s-%d", prefix, type_names[type], k);
+    light_t * light = sqlights_add_light(name, type);
+    light->extra_data = (void *)(intptr_t)i;
+    types[i] = type;
+    light->onoff_handler = &rig_onoff;
+    if(type >= SQ_FADEABLE) {
+      light->brightness_handler = &rig_brightness;
+    }
+    if(type == SQ_COLORED) {
+      light->rgb_handler = &rig_rgb;
+      light->hsi_handler = &rig_hsi;
+    }
+    pending[npending++] = light;
+    if(npending == REG_BATCH || k == n - 1) {
+      for(int j = 0; j < npending; j++) {
+	while(!pending[j]->acked) {
+	  sqlights_lights_handle(1);
+	}
+      }
+      npending = 0;
+    }
+  }
+}
+
+// t is now, period the time since the last report
+void report(double t, double period) {
+  struct sq_hist jitter, stale;
+  int touched = 0, never = 0;
+  sq_hist_init(&jitter);
+  sq_hist_init(&stale);
+  for(int i = 0; i < nfixtures; i++) {
+    if(last_update[i] == 0) {
+      never++;
+      continue;
+    }
+    // how long its state has stood unchanged
+    sq_hist_record(&stale, (t - last_update[i]) * 1e9);
+    if(ngaps[i] || last_update[i] > t - period) {
+      touched++;
+    }
+    if(ngaps[i] > 1) {
+      double mean = gap_sum[i] / ngaps[i];
+      double var = gap_sumsq[i] / ngaps[i] - mean * mean;
+      sq_hist_record(&jitter, (var > 0 ? sqrt(var) : 0) * 1e9);
+    }
+    ngaps[i] = 0;
+    gap_sum[i] = gap_sumsq[i] = 0;
+  }
+  long total = updates[SQ_ONOFF] + updates[SQ_FADEABLE] + updates[SQ_COLORED];
+  printf("%8.1f s  %9.0f updates/s  (onoff %.0f, fade %.0f, color %.0f)"
+	 "  %d of %d fixtures updated\n", t - started, total / period,
+	 updates[SQ_ONOFF] / period, updates[SQ_FADEABLE] / period,
+	 updates[SQ_COLORED] / period, touched, nfixtures);
+  printf("  gap ms    ");
+  sq_hist_print(stdout, &gaps, 1e6);
+  printf("  jitter ms ");
+  sq_hist_print(stdout, &jitter, 1e6);
+  printf("  stale ms  ");
+  sq_hist_print(stdout, &stale, 1e6);
+  if(never) {
+    printf("  %d fixtures never updated\n", never);
+  }
+  fflush(stdout);
+  memset(updates, 0, sizeof(updates));
+  sq_hist_init(&gaps);
+}
+
+void stop(int sig) {
+  stopping = 1;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options] [hostname|unix:[path]|shm[:path]]\n"
+	 "\t-o (n)\t\tonoff fixtures (default 0)\n"
+	 "\t-f (n)\t\tfadeable fixtures (default 0)\n"
+	 "\t-c (n)\t\tcolored fixtures (default 1000)\n"
+	 "\t-n (prefix)\tfixture names are prefix-type-n (default rig)\n"
+	 "\t-i (seconds)\treport this often (default 5)\n"
+	 "\t-t (seconds)\texit after this long (default run until ^C)\n",
+	 prgname);
+}
+
+int main(int argc, char** argv) {
+  char * hostname = "localhost";
+  char * prefix = "rig";
+  int counts[SQ_COLORED + 1] = {0, 0, 0, 1000};
+  double interval = 5, duration = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:f:c:n:i:t:h")) != -1) {
+    switch(opt) {
+    case 'o': counts[SQ_ONOFF] = atoi(optarg); break;
+    case 'f': counts[SQ_FADEABLE] = atoi(optarg); break;
+    case 'c': counts[SQ_COLORED] = atoi(optarg); break;
+    case 'n': prefix = optarg; break;
+    case 'i': interval = atof(optarg); break;
+    case 't': duration = atof(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  int n = counts[SQ_ONOFF] + counts[SQ_FADEABLE] + counts[SQ_COLORED];
+  if(counts[SQ_ONOFF] < 0 || counts[SQ_FADEABLE] < 0 || counts[SQ_COLORED] < 0
+     || n == 0 || interval <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if(optind < argc) {
+    hostname = argv[optind];
+  }
+
+  types = calloc(n, 1);
+  on = calloc(n, 1);
+  level = calloc(n, sizeof(float));
+  color = calloc(n, sizeof(*color));
+  color_hsi = calloc(n, 1);
+  last_update = calloc(n, sizeof(double));
+  ngaps = calloc(n, sizeof(uint32_t));
+  gap_sum = calloc(n, sizeof(double));
+  gap_sumsq = calloc(n, sizeof(double));
+  sq_hist_init(&gaps);
+
+  if(sqlights_light_initialize(hostname)) {
+    printf("couldn't initialize squidlights\n");
+    exit(1);
+  }
+  double start = now();
+  for(int type = SQ_ONOFF; type <= SQ_COLORED; type++) {
+    add_fixtures(prefix, type, counts[type]);
+  }
+  printf("%d fixtures registered in %.2f s\n", nfixtures, now() - start);
+  fflush(stdout);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  started = now();
+  double last = started, next = started + interval;
+  double end = duration > 0 ? started + duration : 0;
+  while(!stopping && (end == 0 || now() < end)) {
+    sqlights_lights_handle(1);
+    double t = now();
+    if(t >= next) {
+      report(t, t - last);
+      last = t;
+      next += interval;
+    }
+  }
+  double t = now();
+  if(t - last > 0.1) {
+    report(t, t - last);
+  }
+  return 0;
+}
@@ -0,0 +1,154 @@
+// playhead.c
+// implementation of playhead.h
+
+#include "playhead.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <lo/lo.h>
+#include <jack/jack.h>
+#include <jack/transport.h>
+
+// how long to carry on from the last /time or file update before
+// deciding the player has stopped
+#define HOLD_NS 1000000000ULL
+
+static struct sq_playhead heard;  // from OSC or the file
+static pthread_mutex_t heard_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t default_track = 0;
+static jack_client_t * jclient = NULL;
+static lo_server_thread oscserver = NULL;
+static char clock_path[256];
+static struct timespec clock_mtime;
+
+static void hear(uint32_t track, double seconds, int rolling) {
+  pthread_mutex_lock(&heard_lock);
+  heard.known = 1;
+  heard.track = track;
+  heard.pos = seconds > 0 ? seconds * 1e9 : 0;
+  heard.at = sqlights_time();
+  heard.rolling = rolling;
+  pthread_mutex_unlock(&heard_lock);
+}
+
+static double osc_number(char type, lo_arg * arg) {
+  switch(type) {
+  case 'f': return arg->f;
+  case 'd': return arg->d;
+  case 'i': return arg->i;
+  case 'h': return arg->h;
+  default: return -1;
+  }
+}
+
+static int time_handler(const char *path, const char *types, lo_arg **argv,
+			int argc, void *msg, void *user_data) {
+  switch(argc) {
+  case 1:
+    hear(default_track, osc_number(types[0], argv[0]), 1);
+    break;
+  case 2:
+  case 3:
+    hear(osc_number(types[0], argv[0]), osc_number(types[1], argv[1]),
+	 argc == 2 || osc_number(types[2], argv[2]) != 0);
+    break;
+  }
+  return 0;
+}
+
+static void osc_error(int num, const char *msg, const char *path) {
+  printf("liblo server error %d in path %s: %s\n", num, path, msg);
+  fflush(stdout);
+}
+
+// rereads the clock file if it's changed
+static void read_clock_file(void) {
+  struct stat st;
+  double v[3];
+  FILE * fp;
+  if(stat(clock_path, &st)
+     || (st.st_mtim.tv_sec == clock_mtime.tv_sec
+	 && st.st_mtim.tv_nsec == clock_mtime.tv_nsec)
+     || NULL == (fp = fopen(clock_path, "r"))) {
+    return;
+  }
+  clock_mtime = st.st_mtim;
+  int n = fscanf(fp, "%lf %lf %lf", &v[0], &v[1], &v[2]);
+  fclose(fp);
+  if(n == 1) {
+    hear(default_track, v[0], 1);
+  } else if(n >= 2) {
+    hear(v[0], v[1], n == 2 || v[2] != 0);
+  }
+}
+
+int sq_playhead_open(int source, const char * arg, uint32_t track) {
+  default_track = track;
+  memset(&heard, 0, sizeof(heard));
+  switch(source) {
+  case SQ_PLAYHEAD_JACK:
+    if(!(jclient = jack_client_open(arg, JackNoStartServer, NULL))
+       || jack_activate(jclient)) {
+      printf("couldn't connect to jack\n");
+      return -1;
+    }
+    printf("following the jack transport\n");
+    return 0;
+  case SQ_PLAYHEAD_FILE:
+    strncpy(clock_path, arg, sizeof(clock_path) - 1);
+    memset(&clock_mtime, 0, sizeof(clock_mtime));
+    printf("following %s\n", clock_path);
+    return 0;
+  default:
+    arg = arg ? arg : SQ_PLAYHEAD_OSC_PORT;
+    oscserver = lo_server_thread_new(arg, osc_error);
+    if(oscserver == NULL) {
+      return -1;
+    }
+    lo_server_thread_add_method(oscserver, "/time", NULL, time_handler, NULL);
+    lo_server_thread_start(oscserver);
+    printf("following /time on OSC port %s\n", arg);
+    return 0;
+  }
+}
+
+void sq_playhead_read(struct sq_playhead * ph, uint64_t now) {
+  if(jclient) {
+    jack_position_t jpos;
+    jack_transport_state_t state = jack_transport_query(jclient, &jpos);
+    ph->known = jpos.frame_rate > 0;
+    ph->track = default_track;
+    ph->pos = ph->known ? (uint64_t)jpos.frame * 1000000000 / jpos.frame_rate
+      : 0;
+    ph->at = now;
+    ph->rolling = state == JackTransportRolling;
+    return;
+  }
+  if(clock_path[0]) {
+    read_clock_file();
+  }
+  pthread_mutex_lock(&heard_lock);
+  *ph = heard;
+  pthread_mutex_unlock(&heard_lock);
+  // carry it forward from when it was heard, for a while
+  if(ph->known && ph->rolling && now > ph->at) {
+    uint64_t since = now - ph->at;
+    ph->pos += since < HOLD_NS ? since : HOLD_NS;
+    ph->rolling = since < HOLD_NS;
+  }
+}
+
+void sq_playhead_close(void) {
+  if(jclient) {
+    jack_client_close(jclient);
+    jclient = NULL;
+  }
+  if(oscserver) {
+    lo_server_thread_free(oscserver);
+    oscserver = NULL;
+  }
+  clock_path[0] = '\0';
+}
@@ -0,0 +1,182 @@
+// record.c
+// implementation of record.h
+
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (SQ_RECORD_RING - 1)
+#define WRITER_SLEEP_NS 10000000  // between looks at an empty ring
+
+static int rec_fd = -1;
+static char * rec_ring = NULL;
+// positions in the ring, counted in bytes from the start, so head -
+// tail is what's waiting to be written.  The router moves head, the
+// writer tail.
+static uint64_t rec_head = 0;
+static uint64_t rec_tail = 0;
+static volatile int rec_stopping = 0;
+static pthread_t rec_thread;
+static uint64_t rec_recorded = 0;
+static uint64_t rec_dropped = 0;
+
+static size_t sq_record_padded(size_t len) {
+  return (len + 7) & ~(size_t)7;
+}
+
+static void sq_record_copy_in(uint64_t pos, const void * data, size_t len) {
+  size_t at = pos & RING_MASK;
+  size_t first = len < SQ_RECORD_RING - at ? len : SQ_RECORD_RING - at;
+  memcpy(rec_ring + at, data, first);
+  memcpy(rec_ring, (const char *)data + first, len - first);
+}
+
+void sq_record(const void * msg, size_t len, int source, uint64_t t) {
+  if(rec_ring == NULL) {
+    return;
+  }
+  struct sq_record_entry entry;
+  size_t need = sizeof(entry) + sq_record_padded(len);
+  uint64_t head = rec_head;
+  if(need > SQ_RECORD_RING - (head - __atomic_load_n(&rec_tail,
+						     __ATOMIC_ACQUIRE))) {
+    rec_dropped++;
+    return;
+  }
+  memset(&entry, 0, sizeof(entry));
+  entry.t = t;
+  entry.len = len;
+  entry.source = source;
+  sq_record_copy_in(head, &entry, sizeof(entry));
+  sq_record_copy_in(head + sizeof(entry), msg, len);
+  // the padding goes out as whatever the ring held; the reader skips it
+  __atomic_store_n(&rec_head, head + need, __ATOMIC_RELEASE);
+  rec_recorded++;
+}
+
+// writes out everything in the ring.  Returns 0, or -1 if the file
+// can't take it, in which case the ring is emptied anyway.
+static int sq_record_write_out(void) {
+  uint64_t head = __atomic_load_n(&rec_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = rec_tail;
+  int ret = 0;
+  while(tail < head) {
+    size_t at = tail & RING_MASK;
+    size_t len = head - tail;
+    len = len < SQ_RECORD_RING - at ? len : SQ_RECORD_RING - at;
+    ssize_t n = write(rec_fd, rec_ring + at, len);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      ret = -1;
+      n = len;
+    }
+    tail += n;
+    __atomic_store_n(&rec_tail, tail, __ATOMIC_RELEASE);
+  }
+  return ret;
+}
+
+static void * sq_record_writer(void * arg) {
+  struct timespec nap = {0, WRITER_SLEEP_NS};
+  int failed = 0;
+  while(!rec_stopping) {
+    if(__atomic_load_n(&rec_head, __ATOMIC_ACQUIRE) == rec_tail) {
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    if(sq_record_write_out() && !failed) {
+      perror("recording");
+      failed = 1;
+    }
+  }
+  sq_record_write_out();
+  return NULL;
+}
+
+int sq_record_start(const char * path) {
+  struct sq_record_header header;
+  struct timespec ts;
+  if(0 > (rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+    return -1;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SQ_RECORD_MAGIC, sizeof(header.magic));
+  header.version = SQ_RECORD_VERSION;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.started = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  header.started_mono = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if(sizeof(header) != write(rec_fd, &header, sizeof(header))
+     || NULL == (rec_ring = malloc(SQ_RECORD_RING))) {
+    close(rec_fd);
+    rec_fd = -1;
+    return -1;
+  }
+  // touch it now, not on the router's thread as it fills
+  memset(rec_ring, 0, SQ_RECORD_RING);
+  rec_stopping = 0;
+  if(pthread_create(&rec_thread, NULL, sq_record_writer, NULL)) {
+    free(rec_ring);
+    rec_ring = NULL;
+    close(rec_fd);
+    rec_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void sq_record_stop(void) {
+  if(rec_ring == NULL) {
+    return;
+  }
+  rec_stopping = 1;
+  pthread_join(rec_thread, NULL);
+  close(rec_fd);
+  rec_fd = -1;
+  free(rec_ring);
+  rec_ring = NULL;
+}
+
+void sq_record_counts(uint64_t * recorded, uint64_t * dropped) {
+  *recorded = rec_recorded;
+  *dropped = rec_dropped;
+}
+
+int sq_record_read_header(FILE * fp, struct sq_record_header * header) {
+  if(1 != fread(header, sizeof(*header), 1, fp)
+     || memcmp(header->magic, SQ_RECORD_MAGIC, sizeof(header->magic))
+     || header->version != SQ_RECORD_VERSION) {
+    return -1;
+  }
+  return 0;
+}
+
+int sq_record_read(FILE * fp, struct sq_record_entry * entry, void * msg,
+		   size_t size) {
+  char skip[8];
+  if(1 != fread(entry, sizeof(*entry), 1, fp)) {
+    return -1;
+  }
+  size_t len = entry->len;
+  size_t keep = len < size ? len : size;
+  if(keep != fread(msg, 1, keep, fp)) {
+    return -1;
+  }
+  // the rest of a message too big for msg, then the padding
+  for(size_t left = sq_record_padded(len) - keep; left > 0; ) {
+    size_t n = left < sizeof(skip) ? left : sizeof(skip);
+    if(n != fread(skip, 1, n, fp)) {
+      return -1;
+    }
+    left -= n;
+  }
+  return len;
+}
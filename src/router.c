@@ -3,6 +3,14 @@
 // lights by name.
 
 #include "protocol.h"
+#include "shm.h"
+#include "uring.h"
+#include "histogram.h"
+#include "record.h"
+#include "scenes.h"
+#include <fnmatch.h>
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,23 +31,97 @@
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <sys/un.h>
+# include <sys/timerfd.h>
+# include <poll.h>
 
 #endif
 
 #include <time.h>
 #include <errno.h>
 
-#define BUFSIZE 256
+#define BUFSIZE SQ_SHM_UP_SIZE  // largest message taken, however it came
+
+// a process connected over shared memory
+typedef struct sq_serv_peer_s {
+  struct sq_serv_peer_s * next_peer;
+  struct sq_shm_link link;
+  char dead;  // dropped, but io_uring may still complete polls on it
+  int polls;  // io_uring polls outstanding
+} sq_serv_peer_t;
 
 typedef struct sq_serv_light_s {
   struct sq_serv_light_s * next_light;
   char name[32];
   int light_type;
-  struct sockaddr_in lightaddr;
+  int lightsock;  // the router socket, udp or unix, it registered on
+  struct sockaddr_storage lightaddr;
+  socklen_t lightaddrlen;
+  sq_serv_peer_t * peer; // if not NULL, reached through this instead
   time_t lastalive;
+  uint64_t in, forwarded, dropped;
+  // what it was last sent, by a client or the engine, if known
+  sq_msg_type state_type;
+  float state[3];
+  // a fade in progress, if fade_type is set
+  sq_msg_type fade_type;
+  float fade_from[3], fade_to[3];
+  uint64_t fade_start, fade_ns;
+  uint32_t rendered_tick;  // the last frame an effect set it in
 } sq_serv_light_t;
 
 static sq_serv_light_t * serv_lights = NULL;
+// changes whenever a light comes or goes, for the engine's caches
+static uint32_t serv_lights_version = 0;
+static sq_serv_peer_t * serv_peers = NULL;
+
+// Only the router's one thread touches these, so counting is plain
+// increments and the stats query reads them from the same thread.
+static struct sq_stats_totals serv_stats;
+static struct sq_hist serv_handle_hist; // ns to handle each message
+// the trace after the message being handled, if it has one, and where
+// in the message it goes back
+static struct sq_trace serv_trace;
+static char * serv_trace_at = NULL;
+
+// messages held for their execute-at time: a binary heap of when,
+// ordered by time then arrival, over slots holding the messages
+#define SQ_SERV_MAX_HELD 65536
+struct sq_serv_held_s {
+  uint64_t at;
+  uint32_t seq;
+  uint32_t slot;
+};
+static struct sq_serv_held_s * serv_held = NULL;
+static int serv_nheld = 0;
+static uint32_t serv_held_seq = 0;
+static char (*serv_held_msgs)[BUFSIZE];
+static int * serv_held_lens;
+static uint32_t * serv_free_slots;  // a stack of the unused ones
+static int serv_nfree = 0;
+static int serv_timerfd = -1;       // readable when the first is due
+static uint64_t serv_timer_at = 0;  // what it's set for, 0 for nothing
+
+// the fade and effect engine's frame clock, which only runs while
+// there's something to render
+static int serv_tickfd = -1;
+static uint64_t serv_frame_ns = 25000000;
+static char serv_ticking = 0;
+
+static char serv_recording = 0;
+// set by SIGINT or SIGTERM while recording, so the log is finished
+static volatile sig_atomic_t serv_stopping = 0;
+
+static uint64_t sq_serv_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int sq_serv_held_before(struct sq_serv_held_s * a,
+			       struct sq_serv_held_s * b) {
+  return a->at < b->at || (a->at == b->at && (int32_t)(a->seq - b->seq) < 0);
+}
 
 void dump_serv_light_table(void) {
   sq_serv_light_t * curr = serv_lights;
@@ -51,8 +133,8 @@ void dump_serv_light_table(void) {
     char name[33];
     strncpy(name, curr->name, 32);
     name[32] = '\0';
-    printf(" %s type=%d lastalive=%ld\n",
-	   name, curr->light_type, curr->lastalive);
+    printf(" %s type=%d lastalive=%ld%s\n",
+	   name, curr->light_type, curr->lastalive, curr->peer ? " shm" : "");
     
   }
 }
@@ -82,38 +164,82 @@ sq_serv_light_t * sq_serv_light_by_name(char * name) {
 }
 
 static int servsock;
+static int unixsock = -1;
+static int shmsock = -1;
+static char uring_on = 0; // running the io_uring loop
+
+int sq_serv_uring_send(int sock, const void * msg, size_t length,
+		       struct sockaddr_storage * addr, socklen_t addrlen,
+		       int n, sq_serv_light_t * counted);
+void sq_serv_uring_peer_added(sq_serv_peer_t * peer);
+void sq_serv_uring_peer_dropped(sq_serv_peer_t * peer);
+
+// sends msg to the process running light.  Returns what sendto() does.
+// msg carries n messages for lights, 0 being the router's own; if it's
+// counted them as forwarded to light, counted is light.  A send that
+// fails after going on the ring is counted as dropped then, and this
+// lets it take back the forwarded count as well, as if it had failed
+// here.
+int sq_serv_send(sq_serv_light_t * light, const void * msg, size_t length,
+		 int n, sq_serv_light_t * counted) {
+  if(light->peer) {
+    // a full ring drops the message, like a full socket buffer would
+    if(sq_shm_send(&light->peer->link, msg, length)) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    return length;
+  }
+  if(uring_on) {
+    return sq_serv_uring_send(light->lightsock, msg, length,
+			      &light->lightaddr, light->lightaddrlen,
+			      n, counted);
+  }
+  // never block on a light whose socket is full
+  return sendto(light->lightsock, msg, length, MSG_DONTWAIT,
+		(struct sockaddr *)&light->lightaddr, light->lightaddrlen);
+}
 
 void sq_send_die(sq_serv_light_t * light) {
   struct sq_die msg;
   msg.type = SQ_DIE;
-  sendto(servsock, (void*)&msg, sizeof(msg), 0,
-	 (struct sockaddr *)&light->lightaddr, sizeof(light->lightaddr));
+  sq_serv_send(light, (void*)&msg, sizeof(msg), 0, NULL);
 }
 
 void sq_serv_send_ack(sq_serv_light_t * light) {
   struct sq_msg_ack_reg msg;
   msg.type = SQ_ACK_REG;
   strncpy(msg.name, light->name, 32);
-  sendto(servsock, (void*)&msg, sizeof(msg), 0,
-	 (struct sockaddr *)&light->lightaddr, sizeof(light->lightaddr));
+  sq_serv_send(light, (void*)&msg, sizeof(msg), 0, NULL);
+}
+
+// a light reached at lightaddr through sock, or through peer
+void sq_set_light_addr(sq_serv_light_t * light, int sock,
+		       struct sockaddr_storage * lightaddr, socklen_t addrlen,
+		       sq_serv_peer_t * peer) {
+  light->lightsock = sock;
+  memcpy(&light->lightaddr, lightaddr, addrlen);
+  light->lightaddrlen = addrlen;
+  light->peer = peer;
 }
 
-void sq_add_light(char * name, int light_type,
-		  struct sockaddr_in * lightaddr) {
+void sq_add_light(char * name, int light_type, int sock,
+		  struct sockaddr_storage * lightaddr, socklen_t addrlen,
+		  sq_serv_peer_t * peer) {
   sq_serv_light_t * light = sq_serv_light_by_name(name);
   if(light != NULL) {
     //    sq_send_die(light);
     light->light_type = light_type;
-    memcpy(&light->lightaddr, lightaddr, sizeof(struct sockaddr_in));
+    sq_set_light_addr(light, sock, lightaddr, addrlen, peer);
     light->lastalive = time(NULL);
     sq_serv_send_ack(light);
     return;
   }
-  light = malloc(sizeof(sq_serv_light_t));
+  light = calloc(1, sizeof(sq_serv_light_t));
   light->next_light = NULL;
   strncpy(light->name, name, 32);
   light->light_type = light_type;
-  memcpy(&light->lightaddr, lightaddr, sizeof(struct sockaddr_in));
+  sq_set_light_addr(light, sock, lightaddr, addrlen, peer);
   light->lastalive = time(NULL);
   sq_serv_send_ack(light);
 
@@ -123,6 +249,7 @@ void sq_add_light(char * name, int light_type,
   } else {
     last->next_light = light;
   }
+  serv_lights_version++;
 }
 
 void sq_remove_light(char * name) {
@@ -138,6 +265,7 @@ void sq_remove_light(char * name) {
 	} else {
 	  lastlight->next_light = curr->next_light;
 	}
+	serv_lights_version++;
 	return;
       }
       lastlight = curr;
@@ -166,9 +294,25 @@ void sq_serv_remove_old() {
 
 void sq_serv_forward(sq_serv_light_t * light, const void * msg,
 		     size_t length) {
-  int ret = sendto(servsock, msg, length, 0,
-		   (struct sockaddr*)&light->lightaddr, sizeof(light->lightaddr));
-  if(ret < 0) {
+  if(serv_trace_at) {
+    // the trace follows the message, so goes along with it
+    serv_trace.router_fwd = sq_serv_clock();
+    memcpy(serv_trace_at, &serv_trace, sizeof(serv_trace));
+    sqlights_trace_record(SQ_HOP_ROUTER,
+			  serv_trace.router_fwd - serv_trace.router_recv);
+    length += sizeof(struct sq_trace);
+  }
+  int ret = sq_serv_send(light, msg, length, 1, light);
+  light->in++;
+  if(ret >= 0) {
+    light->forwarded++;
+    serv_stats.forwarded++;
+    return;
+  }
+  light->dropped++;
+  serv_stats.dropped++;
+  // a full socket only costs this message
+  if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
     char buf[33];
     strncpy(buf, light->name, 32);
     buf[32] = '\0';
@@ -179,7 +323,7 @@ void sq_serv_forward(sq_serv_light_t * light, const void * msg,
 
 static struct sockaddr_in servaddr;
 
-void sq_serv_init(void) {
+void sq_serv_init(char * unixpath, char * shmpath) {
   try(0 <= (servsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)),
       "Failed to create udp socket");
   const char on = 1;
@@ -193,45 +337,632 @@ void sq_serv_init(void) {
   tryp(0 <= bind(servsock, (struct sockaddr*) &servaddr, sizeof(servaddr)),
        "Failed to bind server udp socket");
 
+#ifndef __WIN32__
+  // now that the udp port is ours, anything at unixpath is left over
+  // from a router which didn't exit cleanly
+  struct sockaddr_un unixaddr;
+  memset(&unixaddr, 0, sizeof(unixaddr));
+  unixaddr.sun_family = AF_UNIX;
+  if(unixpath != NULL && strlen(unixpath) < sizeof(unixaddr.sun_path)) {
+    strcpy(unixaddr.sun_path, unixpath);
+    unlink(unixpath);
+    if(0 > (unixsock = socket(AF_UNIX, SOCK_DGRAM, 0))
+       || 0 > bind(unixsock, (struct sockaddr*) &unixaddr, sizeof(unixaddr))) {
+      perror(unixpath);
+      unixsock = -1;
+    }
+  }
+#endif
+
+  if(shmpath != NULL && 0 > (shmsock = sq_shm_listen(shmpath))) {
+    fprintf(stderr, "can't listen at %s; udp only\n", shmpath);
+  }
 
+#ifndef __WIN32__
+  // wakes the router for held messages; the realtime clock, as that's
+  // what their times are on
+  if(0 > (serv_timerfd = timerfd_create(CLOCK_REALTIME,
+					 TFD_NONBLOCK | TFD_CLOEXEC))) {
+    perror("timerfd_create");
+  }
+  if(0 > (serv_tickfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC))) {
+    perror("timerfd_create");
+  }
+#endif
 }
 
-void sq_serv_handle(void) {
-  char msg[BUFSIZE];
-  int recvlen;
-  struct sockaddr_in clientaddr;
+void sq_serv_accept_peer(void) {
+  sq_serv_peer_t * peer = malloc(sizeof(sq_serv_peer_t));
+  if(sq_shm_accept(&peer->link, shmsock)) {
+    free(peer);
+    return;
+  }
+  peer->dead = 0;
+  peer->polls = 0;
+  peer->next_peer = serv_peers;
+  serv_peers = peer;
+  if(uring_on) {
+    sq_serv_uring_peer_added(peer);
+  }
+}
 
-  sq_serv_remove_old();
+// the process behind peer exited; forget it and its lights
+void sq_serv_drop_peer(sq_serv_peer_t * peer) {
+  sq_serv_light_t * light = serv_lights;
+  char removed = 0;
+  while(light != NULL) {
+    sq_serv_light_t * next = light->next_light;
+    if(light->peer == peer) {
+      sq_remove_light(light->name);
+      free(light);
+      removed = 1;
+    }
+    light = next;
+  }
+  sq_serv_peer_t ** prev = &serv_peers;
+  while(*prev != peer) {
+    prev = &(*prev)->next_peer;
+  }
+  *prev = peer->next_peer;
+  if(peer->link.dropped) {
+    printf("shm peer left, %ld messages dropped on full rings\n",
+	   peer->link.dropped);
+  }
+  sq_shm_close(&peer->link);
+  if(uring_on) {
+    sq_serv_uring_peer_dropped(peer);
+  } else {
+    free(peer);
+  }
+  if(removed) {
+    dump_serv_light_table();
+  }
+}
 
-  fd_set fds;
-  struct timeval tv;
-  tv.tv_sec = 1;
-  tv.tv_usec = 0;
-  FD_ZERO(&fds);
-  FD_SET(servsock, &fds);
-  select(servsock+1, &fds, NULL, NULL, &tv);
-  
-  int clientlen = sizeof(clientaddr);
-  recvlen = recvfrom(servsock, msg, BUFSIZE, MSG_DONTWAIT, (struct sockaddr *)&clientaddr, &clientlen);
-  if(recvlen < 0) {
-    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-      return;
-    } else {
-      dieperr("sq_serv_handle recv");
+/* the fade and effect engine */
+
+#define SQ_SERV_MAX_EFFECTS 64
+#define SQ_SERV_MAX_BATCHES 64  // light processes sent to in one frame
+
+struct sq_serv_effect_s {
+  char group[33];
+  uint32_t effect;
+  uint64_t start, period;  // ns
+  float level, param;
+  // the lights in group, as of members_version of the lights
+  sq_serv_light_t ** members;
+  int nmembers, members_size;
+  uint32_t members_version;
+};
+static struct sq_serv_effect_s serv_effects[SQ_SERV_MAX_EFFECTS];
+static int serv_neffects = 0;
+static int serv_nfading = 0;  // at least the lights being faded
+static uint32_t serv_tick = 0;
+
+// what's going to one light process this frame
+struct sq_serv_batch_s {
+  sq_serv_light_t * dest;  // a light in it, to send through
+  int n;
+  size_t len;              // including the struct sq_batch
+  char buf[SQ_BATCH_SIZE];
+};
+static struct sq_serv_batch_s serv_batches[SQ_SERV_MAX_BATCHES];
+static int serv_nbatches = 0;
+
+void sq_serv_start_ticking(void) {
+  struct itimerspec its;
+  if(serv_ticking || serv_tickfd < 0) {
+    return;
+  }
+  its.it_interval.tv_sec = serv_frame_ns / 1000000000;
+  its.it_interval.tv_nsec = serv_frame_ns % 1000000000;
+  // the first frame straight away
+  its.it_value.tv_sec = 0;
+  its.it_value.tv_nsec = 1;
+  timerfd_settime(serv_tickfd, 0, &its, NULL);
+  serv_ticking = 1;
+}
+
+void sq_serv_stop_ticking(void) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  timerfd_settime(serv_tickfd, 0, &its, NULL);
+  serv_ticking = 0;
+}
+
+// whether a and b are reached through the same socket address or peer,
+// so are lights of one process
+static int sq_serv_same_process(sq_serv_light_t * a, sq_serv_light_t * b) {
+  if(a->peer || b->peer) {
+    return a->peer == b->peer;
+  }
+  return a->lightsock == b->lightsock && a->lightaddrlen == b->lightaddrlen
+    && 0 == memcmp(&a->lightaddr, &b->lightaddr, a->lightaddrlen);
+}
+
+void sq_serv_send_batch(struct sq_serv_batch_s * batch) {
+  char * msg = batch->buf;
+  size_t len = batch->len;
+  if(batch->n == 1) {
+    // alone, it goes as itself
+    msg += sizeof(struct sq_batch);
+    len -= sizeof(struct sq_batch);
+  } else {
+    struct sq_batch head;
+    head.type = SQ_BATCH;
+    head.n = batch->n;
+    memcpy(batch->buf, &head, sizeof(head));
+  }
+  serv_stats.batches++;
+  if(sq_serv_send(batch->dest, msg, len, batch->n, NULL) < 0) {
+    serv_stats.dropped += batch->n;
+  }
+  batch->n = 0;
+  batch->len = sizeof(struct sq_batch);
+}
+
+void sq_serv_flush_batches(void) {
+  for(int i = 0; i < serv_nbatches; i++) {
+    if(serv_batches[i].n) {
+      sq_serv_send_batch(&serv_batches[i]);
+    }
+  }
+  serv_nbatches = 0;
+}
+
+// the batch for light's process, with room for size more bytes
+struct sq_serv_batch_s * sq_serv_batch_for(sq_serv_light_t * light,
+					   size_t size) {
+  static int last = 0;  // lights of a process tend to come together
+  struct sq_serv_batch_s * batch = NULL;
+  if(last < serv_nbatches
+     && sq_serv_same_process(serv_batches[last].dest, light)) {
+    batch = &serv_batches[last];
+  }
+  for(int i = 0; batch == NULL && i < serv_nbatches; i++) {
+    if(sq_serv_same_process(serv_batches[i].dest, light)) {
+      batch = &serv_batches[last = i];
+    }
+  }
+  if(batch == NULL) {
+    if(serv_nbatches == SQ_SERV_MAX_BATCHES) {
+      sq_serv_flush_batches();
+    }
+    batch = &serv_batches[last = serv_nbatches++];
+    batch->dest = light;
+    batch->n = 0;
+    batch->len = sizeof(struct sq_batch);
+  } else if(batch->len + size > SQ_BATCH_SIZE) {
+    sq_serv_send_batch(batch);
+  }
+  return batch;
+}
+
+// puts a message setting light to v in this frame's batch for its
+// process, unless that's what it was last set to
+void sq_serv_render(sq_serv_light_t * light, sq_msg_type type, float * v) {
+  int nv = type == SQ_LIGHT_RGB || type == SQ_LIGHT_HSI ? 3 : 1;
+  if(light->state_type == type
+     && 0 == memcmp(light->state, v, nv * sizeof(float))) {
+    return;
+  }
+  light->state_type = type;
+  memcpy(light->state, v, nv * sizeof(float));
+
+  // the same type and name come first in each
+  union {
+    struct sq_light_onoff onoff;
+    struct sq_light_brightness brightness;
+    struct sq_light_color color;
+  } msg;
+  size_t size = sqlights_msg_size(type);
+  memset(&msg, 0, sizeof(msg));
+  msg.onoff.type = type;
+  memcpy(msg.onoff.name, light->name, 32);
+  switch(type) {
+  case SQ_LIGHT_ONOFF:
+    msg.onoff.seton = v[0] > 0;
+    break;
+  case SQ_LIGHT_BRIGHTNESS:
+    msg.brightness.brightness = v[0];
+    break;
+  default:
+    // the hsi fields are where the rgb ones are
+    msg.color.color.rgb.r = v[0];
+    msg.color.color.rgb.g = v[1];
+    msg.color.color.rgb.b = v[2];
+    break;
+  }
+  struct sq_serv_batch_s * batch = sq_serv_batch_for(light, size);
+  memcpy(batch->buf + batch->len, &msg, size);
+  batch->len += size;
+  batch->n++;
+  serv_stats.rendered++;
+}
+
+// a level, as brightness or on/off as the light takes
+void sq_serv_render_level(sq_serv_light_t * light, float level) {
+  float v = level;
+  if(light->light_type == SQ_ONOFF) {
+    v = level > 0;
+    sq_serv_render(light, SQ_LIGHT_ONOFF, &v);
+  } else {
+    sq_serv_render(light, SQ_LIGHT_BRIGHTNESS, &v);
+  }
+}
+
+// a client set light directly, which ends any fade on it
+void sq_serv_set_state(sq_serv_light_t * light, sq_msg_type type,
+		       float v0, float v1, float v2) {
+  light->state_type = type;
+  light->state[0] = v0;
+  light->state[1] = v1;
+  light->state[2] = v2;
+  if(light->fade_type) {
+    light->fade_type = 0;
+    serv_nfading--;
+  }
+}
+
+// where light's fade is at now, into v.  Returns 1 if it's finished.
+int sq_serv_fade_at(sq_serv_light_t * light, uint64_t now, float * v) {
+  double f = light->fade_ns ? (double)(now - light->fade_start) / light->fade_ns
+    : 1;
+  if(f >= 1) {
+    memcpy(v, light->fade_to, sizeof(light->fade_to));
+    return 1;
+  }
+  for(int k = 0; k < 3; k++) {
+    v[k] = light->fade_from[k] + (light->fade_to[k] - light->fade_from[k]) * f;
+  }
+  if(light->fade_type == SQ_LIGHT_HSI) {
+    v[0] = fmodf(v[0], 360);
+    v[0] += v[0] < 0 ? 360 : 0;
+  }
+  return 0;
+}
+
+// starts light fading from where it is to value, over ns
+void sq_serv_fade_light(sq_serv_light_t * light, sq_msg_type to,
+			const float * value, uint64_t ns) {
+  if(light->state_type == to) {
+    memcpy(light->fade_from, light->state, sizeof(light->fade_from));
+  } else {
+    // from off, or for hsi, from this color at no intensity
+    memset(light->fade_from, 0, sizeof(light->fade_from));
+    if(to == SQ_LIGHT_HSI) {
+      light->fade_from[0] = value[0];
+      light->fade_from[1] = value[1];
+    }
+  }
+  memcpy(light->fade_to, value, sizeof(light->fade_to));
+  if(to == SQ_LIGHT_HSI) {
+    // the short way round the wheel
+    float d = fmodf(light->fade_to[0] - light->fade_from[0], 360);
+    d += d > 180 ? -360 : d < -180 ? 360 : 0;
+    light->fade_from[0] = light->fade_to[0] - d;
+  }
+  light->fade_start = sq_serv_clock();
+  light->fade_ns = ns;
+  if(!light->fade_type) {
+    serv_nfading++;
+  }
+  light->fade_type = to;
+  sq_serv_start_ticking();
+}
+
+void sq_serv_fade(struct sq_fade * msg) {
+  sq_serv_light_t * light = sq_serv_light_by_name(msg->name);
+  if(light == NULL) {
+    serv_stats.unknown_dest++;
+    return;
+  }
+  if(msg->to != SQ_LIGHT_BRIGHTNESS && msg->to != SQ_LIGHT_RGB
+     && msg->to != SQ_LIGHT_HSI) {
+    serv_stats.bad++;
+    return;
+  }
+  sq_serv_fade_light(light, msg->to, msg->value, (uint64_t)msg->ms * 1000000);
+}
+
+void sq_serv_effect_remove(int i) {
+  free(serv_effects[i].members);
+  memmove(&serv_effects[i], &serv_effects[i + 1],
+	  (serv_neffects - i - 1) * sizeof(serv_effects[0]));
+  serv_neffects--;
+}
+
+void sq_serv_effect(struct sq_effect * msg) {
+  char group[33];
+  memcpy(group, msg->group, 32);
+  group[32] = '\0';
+  if(msg->effect > SQ_FX_STROBE
+     || (msg->effect != SQ_FX_STOP && msg->period_ms == 0)) {
+    serv_stats.bad++;
+    return;
+  }
+  // stopping "*" stops everything
+  for(int i = serv_neffects - 1; i >= 0; i--) {
+    if(0 == strcmp(serv_effects[i].group, group)
+       || (msg->effect == SQ_FX_STOP && 0 == strcmp(group, "*"))) {
+      sq_serv_effect_remove(i);
+    }
+  }
+  if(msg->effect == SQ_FX_STOP) {
+    return;
+  }
+  if(serv_neffects == SQ_SERV_MAX_EFFECTS) {
+    printf("Too many effects; not running one on \"%s\"\n", group);
+    return;
+  }
+  struct sq_serv_effect_s * fx = &serv_effects[serv_neffects++];
+  memset(fx, 0, sizeof(*fx));
+  strcpy(fx->group, group);
+  fx->effect = msg->effect;
+  fx->start = sq_serv_clock();
+  fx->period = (uint64_t)msg->period_ms * 1000000;
+  fx->level = msg->level;
+  fx->param = msg->param;
+  // so they're found on the first frame
+  fx->members_version = serv_lights_version - 1;
+  sq_serv_start_ticking();
+}
+
+// finds fx's lights again if any have come or gone
+void sq_serv_effect_members(struct sq_serv_effect_s * fx) {
+  if(fx->members_version == serv_lights_version) {
+    return;
+  }
+  fx->nmembers = 0;
+  for(sq_serv_light_t * light = serv_lights; light; light = light->next_light) {
+    char name[33];
+    memcpy(name, light->name, 32);
+    name[32] = '\0';
+    if(fnmatch(fx->group, name, 0)) {
+      continue;
+    }
+    if(fx->nmembers == fx->members_size) {
+      fx->members_size = fx->members_size ? 2 * fx->members_size : 16;
+      fx->members = realloc(fx->members,
+			    fx->members_size * sizeof(*fx->members));
+    }
+    fx->members[fx->nmembers++] = light;
+  }
+  fx->members_version = serv_lights_version;
+}
+
+// renders a frame of every effect and fade, and sends it
+void sq_serv_frame(void) {
+  uint64_t now = sq_serv_clock();
+  float v[3];
+  serv_tick++;
+
+  // the latest effect on a light wins, so they go newest first
+  for(int e = serv_neffects - 1; e >= 0; e--) {
+    struct sq_serv_effect_s * fx = &serv_effects[e];
+    sq_serv_effect_members(fx);
+    uint64_t t = now - fx->start;
+    double phase = (double)(t % fx->period) / fx->period;
+    int step = fx->nmembers ? (t / fx->period) % fx->nmembers : 0;
+    float duty = fx->param > 0 ? fx->param : 0.5;
+    for(int i = 0; i < fx->nmembers; i++) {
+      sq_serv_light_t * light = fx->members[i];
+      if(light->rendered_tick == serv_tick
+	 || (fx->effect == SQ_FX_COLOR_WHEEL
+	     && light->light_type != SQ_COLORED)) {
+	continue;
+      }
+      light->rendered_tick = serv_tick;
+      switch(fx->effect) {
+      case SQ_FX_CHASE:
+	sq_serv_render_level(light, i == step ? fx->level : 0);
+	break;
+      case SQ_FX_STROBE:
+	sq_serv_render_level(light, phase < duty ? fx->level : 0);
+	break;
+      case SQ_FX_COLOR_WHEEL:
+	v[0] = fmod(360 * (phase + fx->param * i / fx->nmembers), 360);
+	v[1] = 1;
+	v[2] = fx->level;
+	sq_serv_render(light, SQ_LIGHT_HSI, v);
+	break;
+      }
+    }
+  }
+
+  // fades carry on under effects, but only show where there's none
+  if(serv_nfading) {
+    int fading = 0;
+    for(sq_serv_light_t * light = serv_lights; light; light = light->next_light) {
+      if(!light->fade_type) {
+	continue;
+      }
+      int done = sq_serv_fade_at(light, now, v);
+      if(light->rendered_tick != serv_tick) {
+	sq_serv_render(light, light->fade_type, v);
+      }
+      if(done) {
+	light->fade_type = 0;
+      } else {
+	fading++;
+      }
+    }
+    serv_nfading = fading;
+  }
+
+  sq_serv_flush_batches();
+  if(serv_nfading == 0 && serv_neffects == 0) {
+    sq_serv_stop_ticking();
+  }
+}
+
+/* scenes */
+
+static struct sq_scene * serv_scenes = NULL;
+
+void sq_serv_scene_capture(struct sq_scene_capture * msg) {
+  char group[33];
+  memcpy(group, msg->group, 32);
+  group[32] = '\0';
+  if(group[0] == '\0') {
+    sq_scene_forget(&serv_scenes, msg->scene);
+    return;
+  }
+  struct sq_scene * scene = sq_scene_get(&serv_scenes, msg->scene);
+  sq_scene_clear(scene);
+  for(sq_serv_light_t * light = serv_lights; light; light = light->next_light) {
+    char name[33];
+    memcpy(name, light->name, 32);
+    name[32] = '\0';
+    if(light->state_type && 0 == fnmatch(group, name, 0)) {
+      sq_scene_set(scene, name, light->state_type, light->state);
+    }
+  }
+}
+
+// finds the light each of scene's is, again if it or the lights have
+// changed since last time
+void sq_serv_scene_resolve(struct sq_scene * scene) {
+  if(scene->resolved && scene->resolved_changes == scene->changes
+     && scene->resolved_version == serv_lights_version) {
+    return;
+  }
+  scene->resolved = realloc(scene->resolved, (scene->n + 1) * sizeof(void *));
+  for(uint32_t i = 0; i < scene->n; i++) {
+    scene->resolved[i] = sq_serv_light_by_name(scene->lights[i].name);
+  }
+  scene->resolved_changes = scene->changes;
+  scene->resolved_version = serv_lights_version;
+}
+
+// sets every light in the scene in one go: they're rendered into the
+// batches for their processes, like a frame, and sent together
+void sq_serv_scene_recall(struct sq_scene_recall * msg) {
+  struct sq_scene * scene = sq_scene_find(serv_scenes, msg->scene);
+  if(scene == NULL) {
+    serv_stats.unknown_dest++;
+    return;
+  }
+  sq_serv_scene_resolve(scene);
+  uint64_t ns = (uint64_t)msg->fade_ms * 1000000;
+  for(uint32_t i = 0; i < scene->n; i++) {
+    sq_serv_light_t * light = scene->resolved[i];
+    struct sq_scene_light * l = &scene->lights[i];
+    if(light == NULL) {
+      continue;
+    }
+    if(ns && l->type != SQ_LIGHT_ONOFF) {
+      sq_serv_fade_light(light, l->type, l->value, ns);
+      continue;
+    }
+    if(light->fade_type) {
+      light->fade_type = 0;
+      serv_nfading--;
+    }
+    sq_serv_render(light, l->type, l->value);
+  }
+  sq_serv_flush_batches();
+}
+
+// the frame clock went off.  Late frames are skipped, not caught up.
+void sq_serv_tick_fired(void) {
+  uint64_t expirations;
+  if(read(serv_tickfd, &expirations, sizeof(expirations)) > 0
+     && serv_ticking) {
+    sq_serv_frame();
+  }
+}
+
+// sends a reply to whoever sent a message, as sq_serv_dispatch() has it
+int sq_serv_reply(const void * msg, size_t length, int sock,
+		  struct sockaddr_storage * clientaddr, socklen_t clientlen,
+		  sq_serv_peer_t * peer) {
+  if(peer) {
+    return sq_shm_send(&peer->link, msg, length);
+  }
+  if(uring_on) {
+    return sq_serv_uring_send(sock, msg, length, clientaddr, clientlen,
+			      0, NULL);
+  }
+  return sendto(sock, msg, length, MSG_DONTWAIT,
+		(struct sockaddr *)clientaddr, clientlen);
+}
+
+// answers SQ_STATS_QUERY: the totals, the nonempty parts of the
+// histogram, the lights a few to a message, then the end
+void sq_serv_send_stats(int sock, struct sockaddr_storage * clientaddr,
+			socklen_t clientlen, sq_serv_peer_t * peer) {
+  serv_stats.type = SQ_STATS_TOTALS;
+  serv_stats.lights = 0;
+  for(sq_serv_light_t * light = serv_lights; light; light = light->next_light) {
+    serv_stats.lights++;
+  }
+  serv_stats.held = serv_nheld;
+  serv_stats.fading = serv_nfading;
+  serv_stats.effects = serv_neffects;
+  serv_stats.scenes = 0;
+  for(struct sq_scene * scene = serv_scenes; scene; scene = scene->next) {
+    serv_stats.scenes++;
+  }
+  serv_stats.peers = 0;
+  for(sq_serv_peer_t * p = serv_peers; p; p = p->next_peer) {
+    serv_stats.peers++;
+  }
+  sq_serv_reply(&serv_stats, sizeof(serv_stats), sock, clientaddr, clientlen,
+		peer);
+
+  struct sq_stats_hist hist;
+  hist.type = SQ_STATS_HIST;
+  for(int first = 0; first < SQ_HIST_BUCKETS; first += SQ_STATS_HIST_CHUNK) {
+    int n = SQ_HIST_BUCKETS - first;
+    n = n < SQ_STATS_HIST_CHUNK ? n : SQ_STATS_HIST_CHUNK;
+    uint32_t any = 0;
+    for(int i = 0; i < n; i++) {
+      any |= (hist.counts[i] = serv_handle_hist.counts[first + i]);
+    }
+    if(any) {
+      hist.first = first;
+      hist.n = n;
+      sq_serv_reply(&hist, sizeof(hist), sock, clientaddr, clientlen, peer);
     }
   }
 
+  struct sq_stats_lights lights;
+  struct sq_stats_end end;
+  lights.type = SQ_STATS_LIGHTS;
+  lights.n = 0;
+  end.type = SQ_STATS_END;
+  end.nlights = 0;
+  for(sq_serv_light_t * light = serv_lights; light; light = light->next_light) {
+    memcpy(lights.lights[lights.n].name, light->name, 32);
+    lights.lights[lights.n].in = light->in;
+    lights.lights[lights.n].forwarded = light->forwarded;
+    lights.lights[lights.n].dropped = light->dropped;
+    end.nlights++;
+    if(++lights.n == SQ_STATS_LIGHTS_PER_MSG || light->next_light == NULL) {
+      sq_serv_reply(&lights, sizeof(lights), sock, clientaddr, clientlen, peer);
+      lights.n = 0;
+    }
+  }
+  sq_serv_reply(&end, sizeof(end), sock, clientaddr, clientlen, peer);
+}
+
+void sq_serv_handle_msg(char * msg, int recvlen, int sock,
+			struct sockaddr_storage * clientaddr,
+			socklen_t clientlen, sq_serv_peer_t * peer) {
   sq_serv_light_t * light;
   struct sq_msg_reg_light * msgreg;
   struct sq_light_onoff * msgonoff;
   struct sq_light_brightness * msgbrightness;
   struct sq_light_color * msgcolor;
-  sq_msg_type type = ((struct sq_msg*)msg)->type;
+  sq_msg_type type = ((struct sq_msg*)msg)->type & ~SQ_TRACE_FLAG;
 
   switch(type) {
   case SQ_REG_LIGHT:
     msgreg = (struct sq_msg_reg_light*)msg;
-    sq_add_light(msgreg->name, msgreg->light_type, &clientaddr);
+    sq_add_light(msgreg->name, msgreg->light_type, sock, clientaddr, clientlen,
+		 peer);
     dump_serv_light_table();
     break;
 
@@ -254,35 +985,723 @@ void sq_serv_handle(void) {
   case SQ_LIGHT_ONOFF:
     msgonoff = (struct sq_light_onoff*)msg;
     light = sq_serv_light_by_name(msgonoff->name);
-    if(light != NULL)
+    if(light != NULL) {
+      sq_serv_set_state(light, type, msgonoff->seton, 0, 0);
       sq_serv_forward(light, msg, sizeof(struct sq_light_onoff));
+    } else
+      serv_stats.unknown_dest++;
     break;
     
   case SQ_LIGHT_BRIGHTNESS:
     msgbrightness = (struct sq_light_brightness*)msg;
     light = sq_serv_light_by_name(msgbrightness->name);
-    if(light != NULL)
+    if(light != NULL) {
+      sq_serv_set_state(light, type, msgbrightness->brightness, 0, 0);
       sq_serv_forward(light, msg, sizeof(struct sq_light_brightness));
+    } else
+      serv_stats.unknown_dest++;
     break;
     
   case SQ_LIGHT_RGB:
   case SQ_LIGHT_HSI:
     msgcolor = (struct sq_light_color*)msg;
     light = sq_serv_light_by_name(msgcolor->name);
-    if(light != NULL)
+    if(light != NULL) {
+      sq_serv_set_state(light, type, msgcolor->color.rgb.r,
+			msgcolor->color.rgb.g, msgcolor->color.rgb.b);
       sq_serv_forward(light, msg, sizeof(struct sq_light_color));
+    } else
+      serv_stats.unknown_dest++;
+    break;
+
+  case SQ_FADE:
+    sq_serv_fade((struct sq_fade*)msg);
+    break;
+
+  case SQ_EFFECT:
+    sq_serv_effect((struct sq_effect*)msg);
+    break;
+
+  case SQ_SCENE_CAPTURE:
+    sq_serv_scene_capture((struct sq_scene_capture*)msg);
+    break;
+
+  case SQ_SCENE_RECALL:
+    sq_serv_scene_recall((struct sq_scene_recall*)msg);
     break;
 
   case SQ_DIE:
     // The router shouldn't even be getting this.
     break;
+
+  case SQ_STATS_QUERY:
+    sq_serv_send_stats(sock, clientaddr, clientlen, peer);
+    break;
+
+  default:
+    // including the stats replies, which only clients should get
+    break;
+  }
+}
+
+// sets the timer for the first held message
+void sq_serv_arm_timer(void) {
+  uint64_t at = serv_nheld ? serv_held[0].at : 0;
+  if(serv_timerfd < 0 || at == serv_timer_at) {
+    return;
+  }
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = at / 1000000000;
+  its.it_value.tv_nsec = at % 1000000000;
+  // a time of zero disarms it
+  timerfd_settime(serv_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+  serv_timer_at = at;
+}
+
+// holds msg, recvlen bytes with any trace but no sq_at, until at
+void sq_serv_hold(char * msg, int recvlen, uint64_t at) {
+  if(serv_held == NULL) {
+    serv_held = malloc(SQ_SERV_MAX_HELD * sizeof(*serv_held));
+    serv_held_msgs = malloc(SQ_SERV_MAX_HELD * sizeof(*serv_held_msgs));
+    serv_held_lens = malloc(SQ_SERV_MAX_HELD * sizeof(*serv_held_lens));
+    serv_free_slots = malloc(SQ_SERV_MAX_HELD * sizeof(*serv_free_slots));
+    for(int i = 0; i < SQ_SERV_MAX_HELD; i++) {
+      serv_free_slots[i] = SQ_SERV_MAX_HELD - 1 - i;
+    }
+    serv_nfree = SQ_SERV_MAX_HELD;
   }
+  if(serv_nfree == 0) {
+    serv_stats.schedule_full++;
+    return;
+  }
+  uint32_t slot = serv_free_slots[--serv_nfree];
+  memcpy(serv_held_msgs[slot], msg, recvlen);
+  serv_held_lens[slot] = recvlen;
+  struct sq_serv_held_s held = {at, serv_held_seq++, slot};
+  int i = serv_nheld++;
+  while(i > 0 && sq_serv_held_before(&held, &serv_held[(i - 1) / 2])) {
+    serv_held[i] = serv_held[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  serv_held[i] = held;
+  serv_stats.scheduled++;
+  sq_serv_arm_timer();
+}
+
+// passes on the held messages whose time has come
+void sq_serv_release_due(void) {
+  struct sockaddr_storage noaddr;
+  uint64_t now;
+  if(serv_nheld == 0 || serv_held[0].at > (now = sqlights_time())) {
+    return;
+  }
+  memset(&noaddr, 0, sizeof(noaddr));
+  while(serv_nheld > 0 && serv_held[0].at <= now) {
+    struct sq_serv_held_s top = serv_held[0];
+    struct sq_serv_held_s last = serv_held[--serv_nheld];
+    int i = 0;
+    while(1) {
+      int child = 2 * i + 1;
+      if(child >= serv_nheld) {
+	break;
+      }
+      if(child + 1 < serv_nheld
+	 && sq_serv_held_before(&serv_held[child + 1], &serv_held[child])) {
+	child++;
+      }
+      if(!sq_serv_held_before(&serv_held[child], &last)) {
+	break;
+      }
+      serv_held[i] = serv_held[child];
+      i = child;
+    }
+    serv_held[i] = last;
+
+    char * msg = serv_held_msgs[top.slot];
+    sq_msg_type type = ((struct sq_msg*)msg)->type;
+    sqlights_trace_record(SQ_HOP_SCHEDULE, now - top.at);
+    if(type & SQ_TRACE_FLAG) {
+      // the router's hop is its handling, not the wait
+      serv_trace_at = msg + sqlights_msg_size(type & ~SQ_TRACE_FLAG);
+      memcpy(&serv_trace, serv_trace_at, sizeof(serv_trace));
+      serv_trace.router_recv = sq_serv_clock();
+    }
+    sq_serv_handle_msg(msg, serv_held_lens[top.slot], -1, &noaddr, 0, NULL);
+    serv_trace_at = NULL;
+    serv_free_slots[serv_nfree++] = top.slot;
+    now = sqlights_time();
+  }
+  sq_serv_arm_timer();
+}
+
+// acts on one message, which came from clientaddr through sock (udp
+// or unix), or from peer over shared memory
+void sq_serv_dispatch(char * msg, int recvlen, int sock,
+		      struct sockaddr_storage * clientaddr, socklen_t clientlen,
+		      sq_serv_peer_t * peer) {
+  uint64_t t0 = sq_serv_clock();
+  if(recvlen > BUFSIZE) {
+    // more than anything here is sized for: held slots, replies
+    serv_stats.bad++;
+    return;
+  }
+  if(serv_recording) {
+    sq_record(msg, recvlen, peer ? SQ_RECORD_SHM
+	      : sock == unixsock ? SQ_RECORD_UNIX : SQ_RECORD_UDP, t0);
+  }
+  sq_msg_type type = ((struct sq_msg*)msg)->type;
+  uint64_t at = 0;
+  if(type & SQ_AT_FLAG) {
+    type &= ~SQ_AT_FLAG;
+    size_t size = sqlights_msg_size(type & ~SQ_TRACE_FLAG);
+    if(size == 0 || recvlen < (int)(size + sizeof(struct sq_at))) {
+      serv_stats.bad++;
+      return;
+    }
+    memcpy(&at, msg + size, sizeof(at));
+    // any trace moves up to where the light will look for it
+    memmove(msg + size, msg + size + sizeof(struct sq_at),
+	    recvlen - size - sizeof(struct sq_at));
+    recvlen -= sizeof(struct sq_at);
+    ((struct sq_msg*)msg)->type = type;
+  }
+  if(type & SQ_TRACE_FLAG) {
+    type &= ~SQ_TRACE_FLAG;
+    size_t size = sqlights_msg_size(type);
+    if(size == 0 || recvlen < (int)(size + sizeof(struct sq_trace))) {
+      serv_stats.bad++;
+      return;
+    }
+    serv_trace_at = msg + size;
+    memcpy(&serv_trace, serv_trace_at, sizeof(serv_trace));
+    serv_trace.router_recv = t0;
+    sqlights_trace_record(SQ_HOP_CLIENT_ROUTER, t0 - serv_trace.client_send);
+  }
+  if(recvlen < (int)sizeof(sq_msg_type) || type <= 0
+     || type >= SQ_NUM_MSG_TYPES) {
+    serv_stats.bad++;
+    return;
+  }
+  serv_stats.in[type]++;
+  if(at) {
+    uint64_t now = sqlights_time();
+    if(at > now) {
+      sq_serv_hold(msg, recvlen, at);
+      serv_trace_at = NULL;
+      sq_hist_record(&serv_handle_hist, sq_serv_clock() - t0);
+      return;
+    }
+    sqlights_trace_record(SQ_HOP_SCHEDULE, now - at);
+  }
+  sq_serv_handle_msg(msg, recvlen, sock, clientaddr, clientlen, peer);
+  serv_trace_at = NULL;
+  sq_hist_record(&serv_handle_hist, sq_serv_clock() - t0);
+}
+
+// takes up to a ring's worth of messages from peer, so no one peer can
+// starve the rest.  Returns 1 if it may still have more.
+int sq_serv_drain_peer(sq_serv_peer_t * peer) {
+  char msg[BUFSIZE];
+  struct sockaddr_storage noaddr;
+  int len = -1;
+  memset(&noaddr, 0, sizeof(noaddr));
+  for(int n = 0; n < SQ_SHM_SLOTS; n++) {
+    if(0 > (len = sq_shm_recv(&peer->link, msg, BUFSIZE))) {
+      break;
+    }
+    sq_serv_dispatch(msg, len, -1, &noaddr, 0, peer);
+  }
+  return len >= 0;
+}
+
+// takes one datagram from sock, udp or unix
+void sq_serv_recv(int sock) {
+  char msg[BUFSIZE];
+  int recvlen;
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen = sizeof(clientaddr);
+
+  recvlen = recvfrom(sock, msg, BUFSIZE, MSG_DONTWAIT,
+		     (struct sockaddr *)&clientaddr, &clientlen);
+  if(recvlen < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return;
+    } else {
+      dieperr("sq_serv_handle recv");
+    }
+  }
+  sq_serv_dispatch(msg, recvlen, sock, &clientaddr, clientlen, NULL);
+}
+
+// the timer went off; what's due is released at the top of the loop
+void sq_serv_timer_fired(void) {
+  uint64_t expirations;
+  if(read(serv_timerfd, &expirations, sizeof(expirations)) < 0) {
+    // EAGAIN: it was set again before this read
+  }
+}
+
+void sq_serv_handle(void) {
+  sq_serv_remove_old();
+  sqlights_trace_check();
+  sq_serv_release_due();
+
+  // an empty ring arms its eventfd, so draining first makes it safe to
+  // sleep on them
+  int busy = 0;
+  for(sq_serv_peer_t * peer = serv_peers; peer != NULL; peer = peer->next_peer) {
+    busy |= sq_serv_drain_peer(peer);
+  }
+
+  fd_set fds;
+  struct timeval tv;
+  int maxfd = servsock;
+  tv.tv_sec = busy ? 0 : 1;
+  tv.tv_usec = 0;
+  FD_ZERO(&fds);
+  FD_SET(servsock, &fds);
+  if(unixsock >= 0) {
+    FD_SET(unixsock, &fds);
+    maxfd = unixsock > maxfd ? unixsock : maxfd;
+  }
+  if(shmsock >= 0) {
+    FD_SET(shmsock, &fds);
+    maxfd = shmsock > maxfd ? shmsock : maxfd;
+  }
+  if(serv_timerfd >= 0) {
+    FD_SET(serv_timerfd, &fds);
+    maxfd = serv_timerfd > maxfd ? serv_timerfd : maxfd;
+  }
+  if(serv_tickfd >= 0) {
+    FD_SET(serv_tickfd, &fds);
+    maxfd = serv_tickfd > maxfd ? serv_tickfd : maxfd;
+  }
+  for(sq_serv_peer_t * peer = serv_peers; peer != NULL; peer = peer->next_peer) {
+    FD_SET(peer->link.rx_fd, &fds);
+    FD_SET(peer->link.sock, &fds);
+    maxfd = peer->link.rx_fd > maxfd ? peer->link.rx_fd : maxfd;
+    maxfd = peer->link.sock > maxfd ? peer->link.sock : maxfd;
+  }
+  if(select(maxfd+1, &fds, NULL, NULL, &tv) < 0) {
+    return;
+  }
+
+  if(serv_timerfd >= 0 && FD_ISSET(serv_timerfd, &fds)) {
+    sq_serv_timer_fired();
+    sq_serv_release_due();
+  }
+  if(serv_tickfd >= 0 && FD_ISSET(serv_tickfd, &fds)) {
+    sq_serv_tick_fired();
+  }
+
+  if(shmsock >= 0 && FD_ISSET(shmsock, &fds)) {
+    sq_serv_accept_peer();
+  }
+  sq_serv_peer_t * peer = serv_peers;
+  while(peer != NULL) {
+    sq_serv_peer_t * next = peer->next_peer;
+    if(FD_ISSET(peer->link.sock, &fds) && sq_shm_hungup(&peer->link)) {
+      // whatever it sent before exiting is still in the ring
+      sq_serv_drain_peer(peer);
+      sq_serv_drop_peer(peer);
+    }
+    peer = next;
+  }
+  if(unixsock >= 0 && FD_ISSET(unixsock, &fds)) {
+    sq_serv_recv(unixsock);
+  }
+  if(FD_ISSET(servsock, &fds)) {
+    sq_serv_recv(servsock);
+  }
+}
+
+#ifdef SQ_HAVE_URING
+
+// The io_uring loop.  Each socket has one multishot recvmsg which keeps
+// delivering datagrams into provided buffers; forwards are queued as
+// sendmsg sqes; and the shm sockets and eventfds are watched with
+// multishot polls.  One io_uring_enter() per batch submits all the
+// sends queued while handling the last batch and waits for the next.
+
+#define URING_ENTRIES 4096
+#define URING_CQ_ENTRIES 16384
+#define URING_BUFS 4096
+// room for a struct io_uring_recvmsg_out, an address and a message
+#define URING_BUF_SIZE 512
+#define URING_SENDS URING_ENTRIES
+
+// what a completion is for, in the low bits of its user_data; the rest
+// is a socket, send slot, peer or timerfd
+enum sq_uring_op_e {
+  URING_RECV = 1,
+  URING_SEND,
+  URING_ACCEPT,
+  URING_PEER_RX,
+  URING_PEER_SOCK,
+  URING_IGNORE,
+  URING_TIMER
+};
+#define URING_OP_BITS 3
+#define URING_OP_MASK ((1 << URING_OP_BITS) - 1)
+#define uring_data(op, x) (((unsigned long)(x) << URING_OP_BITS) | (op))
+
+// a sendmsg in flight, which has to stay put until it completes
+struct sq_uring_send_s {
+  struct msghdr mh;
+  struct iovec iov;
+  struct sockaddr_storage addr;
+  char data[SQ_BATCH_SIZE];
+  int n;                     // messages for lights in it
+  // which counted them as forwarded, or NULL.  Only shm peers' lights
+  // are ever freed, and they don't send through the ring.
+  sq_serv_light_t * counted;
+  int next_free;
+};
+
+static struct sq_uring uring;
+static struct sq_uring_send_s * uring_sends;
+static int uring_free_send = -1;
+// only the lengths matter; the kernel lays out each buffer as a
+// struct io_uring_recvmsg_out, then the address, then the message
+static struct msghdr uring_recv_mh = {
+  .msg_namelen = sizeof(struct sockaddr_storage)
+};
+
+int sq_serv_uring_send(int sock, const void * msg, size_t length,
+		       struct sockaddr_storage * addr, socklen_t addrlen,
+		       int n, sq_serv_light_t * counted) {
+  if(uring_free_send < 0 || length > SQ_BATCH_SIZE) {
+    // every slot's in flight; don't wait for one
+    return sendto(sock, msg, length, MSG_DONTWAIT,
+		  (struct sockaddr *)addr, addrlen);
+  }
+  int i = uring_free_send;
+  struct sq_uring_send_s * send = &uring_sends[i];
+  uring_free_send = send->next_free;
+  memcpy(send->data, msg, length);
+  memcpy(&send->addr, addr, addrlen);
+  send->n = n;
+  send->counted = counted;
+  send->iov.iov_base = send->data;
+  send->iov.iov_len = length;
+  memset(&send->mh, 0, sizeof(send->mh));
+  send->mh.msg_name = &send->addr;
+  send->mh.msg_namelen = addrlen;
+  send->mh.msg_iov = &send->iov;
+  send->mh.msg_iovlen = 1;
+
+  struct io_uring_sqe * sqe = sq_uring_sqe(&uring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sock;
+  sqe->addr = (unsigned long)&send->mh;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_DONTWAIT;
+  sqe->user_data = uring_data(URING_SEND, i);
+  return length;
+}
+
+void sq_serv_uring_recv(int sock) {
+  struct io_uring_sqe * sqe = sq_uring_sqe(&uring);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = sock;
+  sqe->addr = (unsigned long)&uring_recv_mh;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = uring_data(URING_RECV, sock);
+}
+
+void sq_serv_uring_poll(int fd, unsigned events, unsigned long data) {
+  struct io_uring_sqe * sqe = sq_uring_sqe(&uring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = events;
+  sqe->user_data = data;
+}
+
+void sq_serv_uring_unpoll(unsigned long data) {
+  struct io_uring_sqe * sqe = sq_uring_sqe(&uring);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = data;
+  sqe->user_data = uring_data(URING_IGNORE, 0);
+}
+
+void sq_serv_uring_peer_added(sq_serv_peer_t * peer) {
+  sq_serv_uring_poll(peer->link.rx_fd, POLLIN,
+		     uring_data(URING_PEER_RX, peer));
+  sq_serv_uring_poll(peer->link.sock, POLLIN,
+		     uring_data(URING_PEER_SOCK, peer));
+  peer->polls = 2;
+}
+
+// the polls hold their own references to the descriptors, so they have
+// to be cancelled; peer is freed when both have ended
+void sq_serv_uring_peer_dropped(sq_serv_peer_t * peer) {
+  peer->dead = 1;
+  sq_serv_uring_unpoll(uring_data(URING_PEER_RX, peer));
+  sq_serv_uring_unpoll(uring_data(URING_PEER_SOCK, peer));
+}
+
+// handles a completion.  Returns -1 if the kernel turns out not to have
+// multishot recvmsg.
+int sq_serv_uring_complete(struct io_uring_cqe * cqe) {
+  int op = cqe->user_data & URING_OP_MASK;
+  unsigned long x = cqe->user_data >> URING_OP_BITS;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  sq_serv_peer_t * peer = (sq_serv_peer_t *)x;
+  char * buf;
+
+  switch(op) {
+  case URING_RECV:
+    if(cqe->res >= 0 && NULL != (buf = sq_uring_buf(&uring, cqe))) {
+      struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *)buf;
+      char * name = buf + sizeof(*out);
+      char * payload = name + uring_recv_mh.msg_namelen;
+      int room = URING_BUF_SIZE - (payload - buf);
+      // no more than recvfrom() would take, in the other loop
+      room = room < BUFSIZE ? room : BUFSIZE;
+      int len = out->payloadlen < room ? out->payloadlen : room;
+      socklen_t namelen = out->namelen < uring_recv_mh.msg_namelen
+	? out->namelen : uring_recv_mh.msg_namelen;
+      sq_serv_dispatch(payload, len, (int)x, (struct sockaddr_storage *)name,
+		       namelen, NULL);
+    }
+    sq_uring_buf_return(&uring, cqe);
+    if(!more) {
+      if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+	return -1;
+      }
+      // usually -ENOBUFS, when a burst used every buffer
+      sq_serv_uring_recv((int)x);
+    }
+    break;
+
+  case URING_SEND:
+    if(cqe->res < 0) {
+      // counted as sent when it was queued, so it's uncounted here
+      struct sq_uring_send_s * send = &uring_sends[x];
+      if(send->counted) {
+	send->counted->forwarded -= send->n;
+	send->counted->dropped += send->n;
+	serv_stats.forwarded -= send->n;
+      }
+      serv_stats.dropped += send->n;
+    }
+    uring_sends[x].next_free = uring_free_send;
+    uring_free_send = x;
+    break;
+
+  case URING_ACCEPT:
+    sq_serv_accept_peer();
+    if(!more) {
+      sq_serv_uring_poll(shmsock, POLLIN, uring_data(URING_ACCEPT, 0));
+    }
+    break;
+
+  case URING_TIMER:
+    if((int)x == serv_tickfd) {
+      sq_serv_tick_fired();
+    } else {
+      sq_serv_timer_fired();
+      sq_serv_release_due();
+    }
+    if(!more) {
+      sq_serv_uring_poll((int)x, POLLIN, cqe->user_data);
+    }
+    break;
+
+  case URING_PEER_RX:
+  case URING_PEER_SOCK:
+    if(peer->dead) {
+      if(!more && --peer->polls == 0) {
+	free(peer);
+      }
+      break;
+    }
+    // the ring itself is drained at the top of the loop
+    if(op == URING_PEER_SOCK && sq_shm_hungup(&peer->link)) {
+      sq_serv_drain_peer(peer);
+      sq_serv_drop_peer(peer);
+      if(!more) {
+	peer->polls--;
+      }
+    } else if(!more) {
+      sq_serv_uring_poll(op == URING_PEER_RX ? peer->link.rx_fd : peer->link.sock,
+			 POLLIN, cqe->user_data);
+    }
+    break;
+  }
+  return 0;
+}
+
+// runs the router on io_uring.  Returns 0 when the router is stopping,
+// or -1, having undone everything, if io_uring can't be used.
+int sq_serv_uring_run(void) {
+  if(sq_uring_init(&uring, URING_ENTRIES, URING_CQ_ENTRIES, URING_BUFS,
+		   URING_BUF_SIZE)) {
+    return -1;
+  }
+  uring_sends = malloc(URING_SENDS * sizeof(struct sq_uring_send_s));
+  for(int i = 0; i < URING_SENDS; i++) {
+    uring_sends[i].next_free = i + 1 < URING_SENDS ? i + 1 : -1;
+  }
+  uring_free_send = 0;
+  uring_on = 1;
+
+  sq_serv_uring_recv(servsock);
+  if(unixsock >= 0) {
+    sq_serv_uring_recv(unixsock);
+  }
+  if(shmsock >= 0) {
+    sq_serv_uring_poll(shmsock, POLLIN, uring_data(URING_ACCEPT, 0));
+  }
+  if(serv_timerfd >= 0) {
+    sq_serv_uring_poll(serv_timerfd, POLLIN,
+		       uring_data(URING_TIMER, serv_timerfd));
+  }
+  if(serv_tickfd >= 0) {
+    sq_serv_uring_poll(serv_tickfd, POLLIN,
+		       uring_data(URING_TIMER, serv_tickfd));
+  }
+  for(sq_serv_peer_t * peer = serv_peers; peer != NULL; peer = peer->next_peer) {
+    sq_serv_uring_peer_added(peer);
+  }
+
+  while(!serv_stopping) {
+    sq_serv_remove_old();
+    sqlights_trace_check();
+    sq_serv_release_due();
+    int busy = 0;
+    for(sq_serv_peer_t * peer = serv_peers; peer != NULL; peer = peer->next_peer) {
+      busy |= sq_serv_drain_peer(peer);
+    }
+    int ret = sq_uring_submit(&uring, busy ? 0 : 1000);
+    if(ret < 0) {
+      errno = -ret;
+      dieperr("io_uring_enter");
+    }
+    struct io_uring_cqe * cqe;
+    while(NULL != (cqe = sq_uring_cqe(&uring))) {
+      if(sq_serv_uring_complete(cqe)) {
+	// nothing was received yet, so nothing is lost but a few acks
+	sq_uring_exit(&uring);
+	uring_on = 0;
+	free(uring_sends);
+	return -1;
+      }
+      sq_uring_cqe_seen(&uring);
+    }
+  }
+  return 0;
+}
+
+#else
+
+int sq_serv_uring_send(int sock, const void * msg, size_t length,
+		       struct sockaddr_storage * addr, socklen_t addrlen,
+		       int n, sq_serv_light_t * counted) {
+  return -1;
+}
+void sq_serv_uring_peer_added(sq_serv_peer_t * peer) {
+}
+void sq_serv_uring_peer_dropped(sq_serv_peer_t * peer) {
+}
+int sq_serv_uring_run(void) {
+  return -1;
+}
+
+#endif
+
+void sq_serv_stop(int sig) {
+  serv_stopping = 1;
+}
+
+void print_usage(char * prgname) {
+  printf("usage: %s [options]\n"
+	 "\t-u (path)\tunix datagram socket for local clients and lights\n"
+	 "\t\t\t(default %s)\n"
+	 "\t-U\t\tno unix datagram socket\n"
+	 "\t-s (path)\tunix socket for shared-memory clients and lights\n"
+	 "\t\t\t(default %s)\n"
+	 "\t-S\t\tno shared memory\n"
+	 "\t-i\t\tuse io_uring, if the kernel has it (Linux 6.0 or later)\n"
+	 "\t-R (file)\trecord every message received to file, for replay\n"
+	 "\t-F (fps)\tframes a second fades and effects are rendered at\n"
+	 "\t\t\t(default 40)\n"
+	 "\t-C (file)\tscenes to start with\n",
+	 prgname, SQ_UNIX_SOCKET, SQ_SHM_SOCKET);
 }
 
 int main(int argc, char **argv) {
-  sq_serv_init();
+  char * unixpath = SQ_UNIX_SOCKET;
+  char * shmpath = SQ_SHM_SOCKET;
+  char * recordpath = NULL;
+  char * scenepath = NULL;
+  int use_uring = 0;
+  double fps = 40;
+  int opt;
+
+  while((opt = getopt(argc, argv, "u:Us:SiR:F:C:h")) != -1) {
+    switch(opt) {
+    case 'u': unixpath = optarg; break;
+    case 'U': unixpath = NULL; break;
+    case 's': shmpath = optarg; break;
+    case 'S': shmpath = NULL; break;
+    case 'i': use_uring = 1; break;
+    case 'R': recordpath = optarg; break;
+    case 'F': fps = atof(optarg); break;
+    case 'C': scenepath = optarg; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(fps <= 0 || fps > 1000) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  serv_frame_ns = 1e9 / fps;
+  if(scenepath) {
+    FILE * fp = fopen(scenepath, "r");
+    if(fp == NULL) {
+      dieperr(scenepath);
+    }
+    if(sq_scenes_parse(fp, scenepath, &serv_scenes)) {
+      return 1;
+    }
+    fclose(fp);
+  }
+
+  sq_serv_init(unixpath, shmpath);
   dump_serv_light_table();
-  while(1) {
+  if(recordpath) {
+    if(sq_record_start(recordpath)) {
+      dieperr(recordpath);
+    }
+    serv_recording = 1;
+    signal(SIGINT, sq_serv_stop);
+    signal(SIGTERM, sq_serv_stop);
+  }
+  if(use_uring && sq_serv_uring_run()) {
+    fprintf(stderr, "io_uring unavailable, using select()\n");
+  }
+  while(!serv_stopping) {
     sq_serv_handle();
   }
+  if(recordpath) {
+    uint64_t recorded, dropped;
+    sq_record_stop();
+    sq_record_counts(&recorded, &dropped);
+    printf("recorded %llu messages to %s", (unsigned long long)recorded,
+	   recordpath);
+    if(dropped) {
+      printf(", %llu lost to a full ring", (unsigned long long)dropped);
+    }
+    printf("\n");
+  }
+  return 0;
 }
@@ -0,0 +1,150 @@
+// scenes.c
+// implementation of scenes.h
+
+#include "scenes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LINESIZE 512
+
+struct sq_scene * sq_scene_find(struct sq_scene * scenes, const char * name) {
+  for(; scenes; scenes = scenes->next) {
+    if(0 == strncmp(scenes->name, name, 32)) {
+      return scenes;
+    }
+  }
+  return NULL;
+}
+
+struct sq_scene * sq_scene_get(struct sq_scene ** scenes, const char * name) {
+  struct sq_scene * scene = sq_scene_find(*scenes, name);
+  if(scene == NULL) {
+    scene = calloc(1, sizeof(struct sq_scene));
+    strncpy(scene->name, name, 32);
+    scene->next = *scenes;
+    *scenes = scene;
+  }
+  return scene;
+}
+
+void sq_scene_forget(struct sq_scene ** scenes, const char * name) {
+  for(struct sq_scene ** p = scenes; *p; p = &(*p)->next) {
+    if(0 == strncmp((*p)->name, name, 32)) {
+      struct sq_scene * scene = *p;
+      *p = scene->next;
+      free(scene->lights);
+      free(scene->resolved);
+      free(scene);
+      return;
+    }
+  }
+}
+
+void sq_scene_clear(struct sq_scene * scene) {
+  scene->n = 0;
+  scene->changes++;
+}
+
+void sq_scene_set(struct sq_scene * scene, const char * light,
+		  sq_msg_type type, const float * value) {
+  struct sq_scene_light * l = NULL;
+  for(uint32_t i = 0; i < scene->n; i++) {
+    if(0 == strncmp(scene->lights[i].name, light, 32)) {
+      l = &scene->lights[i];
+      break;
+    }
+  }
+  if(l == NULL) {
+    if(scene->n == scene->size) {
+      scene->size = scene->size ? 2 * scene->size : 16;
+      scene->lights = realloc(scene->lights,
+			      scene->size * sizeof(struct sq_scene_light));
+    }
+    l = &scene->lights[scene->n++];
+    memset(l, 0, sizeof(*l));
+    strncpy(l->name, light, 32);
+  }
+  int nv = type == SQ_LIGHT_RGB || type == SQ_LIGHT_HSI ? 3 : 1;
+  l->type = type;
+  memset(l->value, 0, sizeof(l->value));
+  memcpy(l->value, value, nv * sizeof(float));
+  scene->changes++;
+}
+
+// parses a state and its values.  Returns 0, or -1 with why in err.
+static int sq_scenes_parse_state(char ** words, int nwords,
+				 sq_msg_type * type, float * v,
+				 const char ** err) {
+  int n;
+  if(0 == strcmp(words[0], "on") || 0 == strcmp(words[0], "off")) {
+    *type = SQ_LIGHT_ONOFF;
+    v[0] = words[0][1] == 'n';
+    n = 0;
+  } else if(0 == strcmp(words[0], "brightness")) {
+    *type = SQ_LIGHT_BRIGHTNESS;
+    n = 1;
+  } else if(0 == strcmp(words[0], "rgb") || 0 == strcmp(words[0], "hsi")) {
+    *type = words[0][0] == 'r' ? SQ_LIGHT_RGB : SQ_LIGHT_HSI;
+    n = 3;
+  } else {
+    *err = "the state is on, off, brightness, rgb or hsi";
+    return -1;
+  }
+  if(nwords - 1 != n) {
+    *err = n == 0 ? "on and off take no values"
+      : n == 1 ? "brightness takes a value" : "rgb and hsi take three values";
+    return -1;
+  }
+  for(int i = 0; i < n; i++) {
+    char * end;
+    v[i] = strtof(words[1 + i], &end);
+    if(end == words[1 + i] || *end != '\0') {
+      *err = "a value isn't a number";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int sq_scenes_parse(FILE * fp, const char * path, struct sq_scene ** scenes) {
+  char line[LINESIZE];
+  int lineno = 0, bad = 0;
+
+  while(fgets(line, sizeof(line), fp)) {
+    char * words[6];
+    int nwords = 0;
+    const char * err = NULL;
+    sq_msg_type type;
+    float v[3];
+    char * end;
+    lineno++;
+    if(NULL != (end = strchr(line, '#'))) {
+      *end = '\0';
+    }
+    for(char * w = strtok(line, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+      if(nwords < 6) {
+	words[nwords] = w;
+      }
+      nwords++;
+    }
+    if(nwords == 0) {
+      continue;
+    }
+    if(nwords < 3) {
+      err = "wants a scene, a light and a state";
+    } else if(nwords > 6) {
+      err = "too many values";
+    } else if(strlen(words[0]) > 32 || strlen(words[1]) > 32) {
+      err = "a name is longer than 32";
+    } else if(0 == sq_scenes_parse_state(words + 2, nwords - 2, &type, v,
+					 &err)) {
+      sq_scene_set(sq_scene_get(scenes, words[0]), words[1], type, v);
+    }
+    if(err) {
+      printf("%s:%d: %s\n", path, lineno, err);
+      bad = 1;
+    }
+  }
+  return bad ? -1 : 0;
+}
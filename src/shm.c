@@ -0,0 +1,306 @@
+// shm.c
+// implementation of shm.h
+
+#define _GNU_SOURCE // memfd_create
+#include "shm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SLOT_MASK (SQ_SHM_SLOTS - 1)
+
+void sq_ring_init(struct sq_ring * r) {
+  r->head = r->tail = r->waiting = 0;
+  for(uint32_t i = 0; i < SQ_SHM_SLOTS; i++) {
+    r->slots[i].seq = i;
+  }
+}
+
+// Each slot's seq says whose turn it is: pos when it's free for the
+// producer claiming position pos, pos+1 once that message is in it.
+int sq_ring_push(struct sq_ring * r, const void * msg, size_t len) {
+  struct sq_ring_slot * slot;
+  uint32_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  while(1) {
+    slot = &r->slots[pos & SLOT_MASK];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(seq - pos);
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	break;
+      }
+    } else if(diff < 0) {
+      return -1; // full
+    } else {
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->len = len;
+  memcpy(slot->data, msg, len);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int sq_ring_pop(struct sq_ring * r, void * msg, size_t size) {
+  uint32_t pos = r->head;
+  struct sq_ring_slot * slot = &r->slots[pos & SLOT_MASK];
+  uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if((int32_t)(seq - (pos + 1)) < 0) {
+    return -1;
+  }
+  size_t len = slot->len < size ? slot->len : size;
+  memcpy(msg, slot->data, len);
+  __atomic_store_n(&slot->seq, pos + SQ_SHM_SLOTS, __ATOMIC_RELEASE);
+  r->head = pos + 1;
+  return len;
+}
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// what the router sends along with the memfd and the two eventfds
+struct sq_shm_hello {
+  uint32_t version;
+  uint32_t size;
+};
+
+int sq_shm_send(struct sq_shm_link * link, const void * msg, size_t len) {
+  size_t max = link->tx == &link->region->up ? SQ_SHM_UP_SIZE
+    : SQ_SHM_SLOT_SIZE;
+  if(len > max || sq_ring_push(link->tx, msg, len)) {
+    __atomic_add_fetch(&link->dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  // pairs with the fence in sq_shm_recv: either the consumer sees the
+  // message before sleeping, or we see it waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&link->tx->waiting, __ATOMIC_RELAXED)
+     && __atomic_exchange_n(&link->tx->waiting, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    if(write(link->tx_fd, &one, sizeof(one)) < 0) {
+      // only fails if the counter is saturated, which still wakes it
+    }
+  }
+  return 0;
+}
+
+int sq_shm_recv(struct sq_shm_link * link, void * msg, size_t size) {
+  int len = sq_ring_pop(link->rx, msg, size);
+  if(len >= 0) {
+    return len;
+  }
+  // about to report empty, so the caller may sleep: clear any old
+  // wakeup, then ask for a new one and look again
+  uint64_t count;
+  if(read(link->rx_fd, &count, sizeof(count)) < 0) {
+    // EAGAIN; nothing pending
+  }
+  __atomic_store_n(&link->rx->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return sq_ring_pop(link->rx, msg, size);
+}
+
+int sq_shm_hungup(struct sq_shm_link * link) {
+  char c;
+  // neither end writes to the socket after setup, so anything readable
+  // is the end of the stream
+  int ret = recv(link->sock, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+  if(ret < 0) {
+    return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+  }
+  return 1;
+}
+
+static int sq_shm_addr(struct sockaddr_un * addr, const char * path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static void sq_shm_map(struct sq_shm_link * link, struct sq_shm_region * region,
+		       int router) {
+  link->region = region;
+  link->rx = router ? &region->up : &region->down;
+  link->tx = router ? &region->down : &region->up;
+  link->dropped = 0;
+}
+
+int sq_shm_connect(struct sq_shm_link * link, const char * path) {
+  struct sockaddr_un addr;
+  struct sq_shm_hello hello;
+  int fds[3];
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { &hello, sizeof(hello) };
+  struct msghdr mh;
+  struct timeval tv = { 1, 0 };
+
+  if(sq_shm_addr(&addr, path)) {
+    return -1;
+  }
+  if(0 > (link->sock = socket(AF_UNIX, SOCK_STREAM, 0))) {
+    return -1;
+  }
+  setsockopt(link->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if(0 > connect(link->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(link->sock);
+    return -1;
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+  struct cmsghdr * cmsg;
+  if(recvmsg(link->sock, &mh, 0) != sizeof(hello)
+     || NULL == (cmsg = CMSG_FIRSTHDR(&mh))
+     || cmsg->cmsg_type != SCM_RIGHTS
+     || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    fprintf(stderr, "bad handshake from router at %s\n", path);
+    close(link->sock);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  void * base = MAP_FAILED;
+  if(hello.version == SQ_SHM_VERSION
+     && hello.size == sizeof(struct sq_shm_region)) {
+    base = mmap(NULL, sizeof(struct sq_shm_region), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fds[0], 0);
+  } else {
+    fprintf(stderr, "router at %s speaks a different shm version\n", path);
+  }
+  close(fds[0]);
+  if(base == MAP_FAILED) {
+    close(fds[1]);
+    close(fds[2]);
+    close(link->sock);
+    return -1;
+  }
+  sq_shm_map(link, base, 0);
+  link->tx_fd = fds[1];
+  link->rx_fd = fds[2];
+  return 0;
+}
+
+int sq_shm_listen(const char * path) {
+  struct sockaddr_un addr;
+  int sock;
+  if(sq_shm_addr(&addr, path)) {
+    return -1;
+  }
+  if(0 > (sock = socket(AF_UNIX, SOCK_STREAM, 0))) {
+    return -1;
+  }
+  // the router's already bound the udp port, so any socket here is
+  // left over from a router which didn't exit cleanly
+  unlink(path);
+  if(0 > bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+     || 0 > listen(sock, 16)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int sq_shm_accept(struct sq_shm_link * link, int listensock) {
+  struct sq_shm_hello hello = { SQ_SHM_VERSION, sizeof(struct sq_shm_region) };
+  int fds[3] = { -1, -1, -1 };
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { &hello, sizeof(hello) };
+  struct msghdr mh;
+  void * base = MAP_FAILED;
+
+  if(0 > (link->sock = accept(listensock, NULL, NULL))) {
+    return -1;
+  }
+  if(0 > (fds[0] = memfd_create("sqlights", MFD_CLOEXEC))
+     || 0 > ftruncate(fds[0], sizeof(struct sq_shm_region))
+     || MAP_FAILED == (base = mmap(NULL, sizeof(struct sq_shm_region),
+				   PROT_READ | PROT_WRITE, MAP_SHARED,
+				   fds[0], 0))
+     || 0 > (fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+     || 0 > (fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+    perror("sq_shm_accept");
+    goto fail;
+  }
+  sq_ring_init(&((struct sq_shm_region *)base)->up);
+  sq_ring_init(&((struct sq_shm_region *)base)->down);
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if(sendmsg(link->sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(hello)) {
+    goto fail;
+  }
+  close(fds[0]);
+  sq_shm_map(link, base, 1);
+  link->rx_fd = fds[1];
+  link->tx_fd = fds[2];
+  return 0;
+
+ fail:
+  for(int i = 0; i < 3; i++) {
+    if(fds[i] >= 0) close(fds[i]);
+  }
+  if(base != MAP_FAILED) {
+    munmap(base, sizeof(struct sq_shm_region));
+  }
+  close(link->sock);
+  return -1;
+}
+
+void sq_shm_close(struct sq_shm_link * link) {
+  munmap(link->region, sizeof(struct sq_shm_region));
+  close(link->sock);
+  if(link->rx_fd >= 0) close(link->rx_fd);
+  if(link->tx_fd >= 0) close(link->tx_fd);
+}
+
+#else
+
+// no memfd or eventfd here; everyone stays on udp
+
+int sq_shm_connect(struct sq_shm_link * link, const char * path) {
+  return -1;
+}
+int sq_shm_listen(const char * path) {
+  return -1;
+}
+int sq_shm_accept(struct sq_shm_link * link, int listensock) {
+  return -1;
+}
+void sq_shm_close(struct sq_shm_link * link) {
+}
+int sq_shm_send(struct sq_shm_link * link, const void * msg, size_t len) {
+  return -1;
+}
+int sq_shm_recv(struct sq_shm_link * link, void * msg, size_t size) {
+  return -1;
+}
+int sq_shm_hungup(struct sq_shm_link * link) {
+  return 1;
+}
+
+#endif
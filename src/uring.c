@@ -0,0 +1,183 @@
+// uring.c
+// implementation of uring.h
+
+#include "uring.h"
+
+#ifdef SQ_HAVE_URING
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sq_uring_enter(struct sq_uring * u, unsigned to_submit,
+			  unsigned min_complete, int wait_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  void * argp = NULL;
+  size_t argsz = 0;
+
+  if(min_complete && wait_ms >= 0) {
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (unsigned long)&ts;
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+  u->enters++;
+  int ret = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+		    flags, argp, argsz);
+  return ret < 0 ? -errno : ret;
+}
+
+int sq_uring_init(struct sq_uring * u, unsigned entries, unsigned cq_entries,
+		  unsigned nbufs, unsigned buf_size) {
+  struct io_uring_params p;
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+  if(0 > (u->fd = syscall(__NR_io_uring_setup, entries, &p))) {
+    return -1;
+  }
+  if(!(p.features & IORING_FEAT_EXT_ARG)) {
+    close(u->fd);
+    return -1;
+  }
+  u->entries = p.sq_entries;
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+  }
+  char * sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  char * cq = sq;
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED) {
+    cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  }
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 u->fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+    close(u->fd);
+    return -1;
+  }
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->sqe_tail = u->sqe_submitted = *u->sq_tail;
+
+  // the buffer ring has to be page aligned, which mmap() is
+  struct io_uring_buf_reg reg;
+  u->br_entries = nbufs;
+  u->buf_size = buf_size;
+  u->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+	       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u->bufs = mmap(NULL, (size_t)nbufs * buf_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(u->br == MAP_FAILED || u->bufs == MAP_FAILED) {
+    close(u->fd);
+    return -1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)u->br;
+  reg.ring_entries = nbufs;
+  reg.bgid = 0;
+  if(0 > syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+		 &reg, 1)) {
+    close(u->fd);
+    return -1;
+  }
+  for(unsigned i = 0; i < nbufs; i++) {
+    struct io_uring_buf * buf = &u->br->bufs[i];
+    buf->addr = (unsigned long)(u->bufs + (size_t)i * buf_size);
+    buf->len = buf_size;
+    buf->bid = i;
+  }
+  __atomic_store_n(&u->br->tail, (unsigned short)nbufs, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void sq_uring_exit(struct sq_uring * u) {
+  // unmapping the rings is left to exit(); closing the ring cancels
+  // everything in flight
+  close(u->fd);
+}
+
+struct io_uring_sqe * sq_uring_sqe(struct sq_uring * u) {
+  while(u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+	>= u->entries) {
+    sq_uring_submit(u, 0);
+  }
+  unsigned idx = u->sqe_tail & *u->sq_mask;
+  struct io_uring_sqe * sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  u->sqe_tail++;
+  return sqe;
+}
+
+int sq_uring_submit(struct sq_uring * u, int wait_ms) {
+  unsigned to_submit = u->sqe_tail - u->sqe_submitted;
+  int ret;
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+  if(to_submit == 0 && wait_ms == 0) {
+    return 0;
+  }
+  ret = sq_uring_enter(u, to_submit, wait_ms ? 1 : 0, wait_ms);
+  if(ret > 0) {
+    u->sqe_submitted += ret;
+  }
+  // a signal only ends the wait early; the caller may be being stopped,
+  // and whatever wasn't submitted goes with the next call
+  return ret == -ETIME || ret == -EBUSY || ret == -EINTR ? 0
+    : (ret < 0 ? ret : 0);
+}
+
+struct io_uring_cqe * sq_uring_cqe(struct sq_uring * u) {
+  unsigned head = *u->cq_head;
+  if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &u->cqes[head & *u->cq_mask];
+}
+
+void sq_uring_cqe_seen(struct sq_uring * u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char * sq_uring_buf(struct sq_uring * u, struct io_uring_cqe * cqe) {
+  if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return NULL;
+  }
+  return u->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * u->buf_size;
+}
+
+void sq_uring_buf_return(struct sq_uring * u, struct io_uring_cqe * cqe) {
+  if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  unsigned short tail = u->br->tail;
+  struct io_uring_buf * buf = &u->br->bufs[tail & (u->br_entries - 1)];
+  buf->addr = (unsigned long)(u->bufs + (size_t)bid * u->buf_size);
+  buf->len = u->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&u->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif